@@ -0,0 +1,227 @@
+//
+// 调度线程的CPU亲和性和NUMA放置
+//
+
+#include "affinity.h"
+#include "config.h"
+#include "log.h"
+
+#include <sched.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <yaml-cpp/yaml.h>
+
+namespace sylar {
+
+    static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    template<>
+    class LexicalCast<std::string, ThreadPlacement> {
+    public:
+        ThreadPlacement operator()(const std::string& v)
+        {
+            YAML::Node node = YAML::Load(v);
+            ThreadPlacement p;
+            if (node["cpus"].IsDefined())
+            {
+                p.cpus = node["cpus"].as<std::string>();
+            }
+            if (node["bind"].IsDefined())
+            {
+                p.bind = node["bind"].as<std::string>();
+            }
+            if (node["numa_groups"].IsDefined())
+            {
+                p.numa_groups = node["numa_groups"].as<bool>();
+            }
+            return p;
+        }
+    };
+
+    template<>
+    class LexicalCast<ThreadPlacement, std::string> {
+    public:
+        std::string operator()(const ThreadPlacement& p)
+        {
+            YAML::Node node;
+            node["cpus"] = p.cpus;
+            node["bind"] = p.bind;
+            node["numa_groups"] = p.numa_groups;
+            std::stringstream ss;
+            ss << node;
+            return ss.str();
+        }
+    };
+
+    static ConfigVar<std::map<std::string, ThreadPlacement> >::ptr g_thread_placement =
+            Config::Lookup("fox_thread.placement", std::map<std::string, ThreadPlacement>(),
+                           "scheduler thread cpu/numa placement, key is scheduler name");
+
+    std::vector<int> ParseCpuList(const std::string& str)
+    {
+        std::vector<int> cpus;
+        std::stringstream ss(str);
+        std::string item;
+        while (std::getline(ss, item, ','))
+        {
+            item.erase(std::remove_if(item.begin(), item.end(), ::isspace), item.end());
+            if (item.empty())
+            {
+                continue;
+            }
+            size_t pos = item.find('-');
+            int begin = atoi(item.substr(0, pos).c_str());
+            int end = pos == std::string::npos ? begin : atoi(item.substr(pos + 1).c_str());
+            for (int i = begin; i <= end; ++i)
+            {
+                cpus.push_back(i);
+            }
+        }
+        std::sort(cpus.begin(), cpus.end());
+        cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+        return cpus;
+    }
+
+    std::vector<NumaNode> GetNumaNodes()
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed))
+        {
+            SYLAR_LOG_ERROR(g_logger) << "sched_getaffinity errno=" << errno << " " << strerror(errno);
+            return {};
+        }
+
+        std::vector<NumaNode> nodes;
+        const char* path = "/sys/devices/system/node";
+        DIR* dir = opendir(path);
+        if (dir)
+        {
+            struct dirent* entry = nullptr;
+            while ((entry = readdir(dir)) != nullptr)
+            {
+                std::string name = entry->d_name;
+                if (name.size() <= 4 || name.compare(0, 4, "node") != 0
+                        || name.find_first_not_of("0123456789", 4) != std::string::npos)
+                {
+                    continue;
+                }
+                std::ifstream ifs(std::string(path) + "/" + name + "/cpulist");
+                std::string cpulist;
+                if (!ifs || !std::getline(ifs, cpulist))
+                {
+                    continue;
+                }
+                NumaNode node;
+                node.id = atoi(name.c_str() + 4);
+                for (int cpu : ParseCpuList(cpulist))
+                {
+                    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                    {
+                        node.cpus.push_back(cpu);
+                    }
+                }
+                if (!node.cpus.empty())
+                {
+                    nodes.push_back(node);
+                }
+            }
+            closedir(dir);
+        }
+        std::sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) {
+            return a.id < b.id;
+        });
+
+        if (nodes.empty())
+        {
+            NumaNode node;
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+                if (CPU_ISSET(cpu, &allowed))
+                {
+                    node.cpus.push_back(cpu);
+                }
+            }
+            nodes.push_back(node);
+        }
+        return nodes;
+    }
+
+    bool SetThreadAffinity(const std::vector<int>& cpus)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus)
+        {
+            if (cpu >= 0 && cpu < CPU_SETSIZE)
+            {
+                CPU_SET(cpu, &set);
+            }
+        }
+        if (sched_setaffinity(0, sizeof(set), &set))
+        {
+            SYLAR_LOG_ERROR(g_logger) << "sched_setaffinity errno=" << errno << " " << strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<WorkerPlacement> GetWorkerPlacement(const std::string& name, size_t count, size_t& groups)
+    {
+        groups = 1;
+        auto conf = g_thread_placement->getValue();
+        auto it = conf.find(name);
+        if (it == conf.end() || count == 0)
+        {
+            return {};
+        }
+        const ThreadPlacement& p = it->second;
+
+        std::vector<NumaNode> nodes = GetNumaNodes();
+        if (!p.cpus.empty())
+        {
+            std::vector<int> wanted = ParseCpuList(p.cpus);
+            for (auto& node : nodes)
+            {
+                std::vector<int> cpus;
+                std::set_intersection(node.cpus.begin(), node.cpus.end()
+                                      , wanted.begin(), wanted.end(), std::back_inserter(cpus));
+                node.cpus.swap(cpus);
+            }
+            nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [](const NumaNode& node) {
+                return node.cpus.empty();
+            }), nodes.end());
+        }
+        if (nodes.empty())
+        {
+            SYLAR_LOG_ERROR(g_logger) << name << " placement cpus=" << p.cpus << " no available cpu";
+            return {};
+        }
+
+        // 线程轮流分到各个节点, 节点内轮流分配CPU
+        std::vector<WorkerPlacement> rt(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t n = i % nodes.size();
+            const NumaNode& node = nodes[n];
+            if (p.bind == "node")
+            {
+                rt[i].cpus = node.cpus;
+            }
+            else
+            {
+                rt[i].cpus.push_back(node.cpus[(i / nodes.size()) % node.cpus.size()]);
+            }
+            rt[i].group = p.numa_groups ? (int)n : 0;
+        }
+        if (p.numa_groups)
+        {
+            groups = std::min(count, nodes.size());
+        }
+        return rt;
+    }
+}
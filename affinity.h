@@ -0,0 +1,76 @@
+//
+// 调度线程的CPU亲和性和NUMA放置
+//
+
+#ifndef MYSYLAR_AFFINITY_H
+#define MYSYLAR_AFFINITY_H
+
+#include <string>
+#include <vector>
+
+namespace sylar {
+
+    /**
+     * @brief NUMA节点和它上面的CPU
+     */
+    struct NumaNode {
+        int id = 0;
+        std::vector<int> cpus;
+    };
+
+    /**
+     * @brief 解析"0-3,8,10-11"格式的CPU列表(sysfs的cpulist格式)
+     */
+    std::vector<int> ParseCpuList(const std::string& str);
+
+    /**
+     * @brief 从/sys/devices/system/node读取NUMA节点, 只保留当前线程可用的CPU
+     * @details 没有sysfs信息(非NUMA机器, 容器)时返回一个包含所有可用CPU的节点
+     */
+    std::vector<NumaNode> GetNumaNodes();
+
+    /**
+     * @brief 把当前线程绑定到cpus上
+     */
+    bool SetThreadAffinity(const std::vector<int>& cpus);
+
+    /**
+     * @brief 一个调度器的线程放置配置
+     * @details 配置在fox_thread.placement下, key为调度器名称
+     *          fox_thread:
+     *              placement:
+     *                  io:
+     *                      cpus: 0-7,16-23
+     *                      bind: cpu
+     *                      numa_groups: true
+     */
+    struct ThreadPlacement {
+        std::string cpus;           // 可用的CPU, 为空表示所有可用的CPU
+        std::string bind = "cpu";   // cpu: 每个线程绑一个CPU, node: 绑到所在节点的全部CPU
+        bool numa_groups = false;   // 调度线程按NUMA节点分组, 只在组内窃取任务
+
+        bool operator==(const ThreadPlacement& oth) const {
+            return cpus == oth.cpus
+                && bind == oth.bind
+                && numa_groups == oth.numa_groups;
+        }
+    };
+
+    /**
+     * @brief 一个调度线程的放置结果
+     */
+    struct WorkerPlacement {
+        std::vector<int> cpus;  // 绑定的CPU
+        int group = 0;          // 所在的组, numa_groups时为节点的序号, 否则都为0
+    };
+
+    /**
+     * @brief 按名称为name的调度器的配置, 计算count个调度线程的放置
+     * @details 线程轮流分到各个节点, 节点内轮流分配CPU
+     * @param[out] groups 分组数
+     * @return 没有配置或者没有可用的CPU时返回空, 不绑定
+     */
+    std::vector<WorkerPlacement> GetWorkerPlacement(const std::string& name, size_t count, size_t& groups);
+}
+
+#endif //MYSYLAR_AFFINITY_H
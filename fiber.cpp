@@ -4,7 +4,9 @@
 
 
 #include <functional>
-#include <ucontext.h>   // 协程库
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
 #include "fiber.h"
 #include "sylar.h"
 
@@ -17,65 +19,261 @@ namespace sylar{
 
     static thread_local Fiber* t_fiber = nullptr;   // 当前协程
     static thread_local Fiber::ptr t_threadFiber = nullptr; // 旧的协成
+    static thread_local std::atomic<int>* t_slice_flags = nullptr;   // 调度线程当前时间片的标记
 
     static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
             Config::Lookup<uint32_t >("fiber.stack_size", 128*1024, "fiber stack size");
 
-    class MallocStackAlloctor {
+    // fiber.stack_size在调度路径上读(StackSizeFor), 缓存起来读时不加锁
+    static std::atomic<uint32_t> s_fiber_stack_size = {128 * 1024};
+
+    struct FiberStackSizeIniter {
+        FiberStackSizeIniter() {
+            s_fiber_stack_size = g_fiber_stack_size->getValue();
+            g_fiber_stack_size->addListener([](const uint32_t&, const uint32_t& new_value) {
+                s_fiber_stack_size = new_value;
+            });
+        }
+    };
+
+    static FiberStackSizeIniter s_fiber_stack_size_initer;
+
+    static ConfigVar<uint32_t>::ptr g_stack_cache_size =
+            Config::Lookup<uint32_t>("fiber.stack_cache_size", 32, "fiber stacks cached per thread");
+
+    static ConfigVar<uint32_t>::ptr g_stack_pool_size =
+            Config::Lookup<uint32_t>("fiber.stack_pool_size", 256, "idle fiber stacks kept in the shared pool");
+
+    static ConfigVar<std::string>::ptr g_stack_release =
+            Config::Lookup<std::string>("fiber.stack_release", "free",
+                                        "how idle pooled stacks give back memory: free, dontneed, none");
+
+    /**
+     * @brief mmap分配的协程栈, 低地址有一个PROT_NONE的保护页, 栈溢出直接SIGSEGV而不会写坏堆
+     * @details 释放的栈先放到当前线程的缓存(fiber.stack_cache_size), 缓存满了把最早的一半挪到共享池
+     *          (fiber.stack_pool_size), 进共享池时按fiber.stack_release归还物理页, 共享池也满了才munmap
+     */
+    class MmapStackAllocator {
     public:
         static void* Alloc(size_t size) {
-            return malloc(size);
+            size = RoundSize(size);
+            if (!t_cache_dead) {
+                std::vector<Stack>& stacks = t_cache.stacks;
+                for (size_t i = stacks.size(); i > 0; --i) {
+                    if (stacks[i - 1].size == size) {
+                        void* vp = stacks[i - 1].sp;
+                        stacks.erase(stacks.begin() + (i - 1));
+                        return vp;
+                    }
+                }
+            }
+            Pool* pool = GetPool();
+            {
+                Spinlock::Lock lock(pool->mutex);
+                for (size_t i = pool->stacks.size(); i > 0; --i) {
+                    if (pool->stacks[i - 1].size == size) {
+                        void* vp = pool->stacks[i - 1].sp;
+                        pool->stacks.erase(pool->stacks.begin() + (i - 1));
+                        return vp;
+                    }
+                }
+            }
+
+            size_t page = PageSize();
+            void* base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE
+                              , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (base == MAP_FAILED) {
+                SYLAR_LOG_ERROR(g_logger) << "mmap fiber stack size=" << size << " errno=" << errno
+                                          << " " << strerror(errno);
+                throw std::bad_alloc();
+            }
+            if (mprotect(base, page, PROT_NONE)) {
+                SYLAR_LOG_ERROR(g_logger) << "mprotect fiber stack guard errno=" << errno
+                                          << " " << strerror(errno);
+            }
+            return (char*)base + page;
         }
 
         static void Dealloc(void* vp, size_t size) {
-            return free(vp);
+            Stack stack = {vp, RoundSize(size)};
+            if (t_cache_dead) {
+                Release(&stack, 1);
+                return;
+            }
+            std::vector<Stack>& stacks = t_cache.stacks;
+            stacks.push_back(stack);
+            size_t max = g_stack_cache_size->getValue();
+            if (stacks.size() > max) {
+                size_t count = stacks.size() - max / 2;
+                Release(&stacks[0], count);
+                stacks.erase(stacks.begin(), stacks.begin() + count);
+            }
+        }
+
+    private:
+        struct Stack {
+            void* sp;       // 可用的栈(保护页之上)的低地址
+            size_t size;    // 不含保护页
+        };
+
+        struct Pool {
+            Spinlock mutex;
+            std::vector<Stack> stacks;
+        };
+
+        struct Cache {
+            std::vector<Stack> stacks;
+
+            ~Cache() {
+                Release(stacks.data(), stacks.size());
+                // 线程退出时之后析构的协程直接放共享池
+                t_cache_dead = true;
+            }
+        };
+
+        static size_t PageSize() {
+            static size_t s_page = sysconf(_SC_PAGESIZE);
+            return s_page;
         }
+
+        static size_t RoundSize(size_t size) {
+            size_t page = PageSize();
+            return (size + page - 1) / page * page;
+        }
+
+        static Pool* GetPool() {
+            // 不析构, 线程退出时还能往里放
+            static Pool* s_pool = new Pool;
+            return s_pool;
+        }
+
+        /**
+         * @brief 归还栈的物理页, 保留最上面一页, 重新使用时协程入口的栈帧不会缺页
+         */
+        static void Advise(const Stack& stack) {
+            static std::atomic<int> s_advice = {-1};
+            if (s_advice == -1) {
+                std::string release = g_stack_release->getValue();
+#ifdef MADV_FREE
+                s_advice = release == "free" ? MADV_FREE : (release == "dontneed" ? MADV_DONTNEED : 0);
+#else
+                s_advice = release == "none" ? 0 : MADV_DONTNEED;
+#endif
+            }
+            if (s_advice == 0 || stack.size <= PageSize()) {
+                return;
+            }
+            if (madvise(stack.sp, stack.size - PageSize(), s_advice) && errno == EINVAL
+                    && s_advice != MADV_DONTNEED) {
+                // 内核不支持MADV_FREE(4.5之前)
+                s_advice = MADV_DONTNEED;
+                madvise(stack.sp, stack.size - PageSize(), s_advice);
+            }
+        }
+
+        /**
+         * @brief count个栈放到共享池, 共享池满了直接munmap
+         */
+        static void Release(Stack* stacks, size_t count) {
+            if (count == 0) {
+                return;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                Advise(stacks[i]);
+            }
+            Pool* pool = GetPool();
+            size_t max = g_stack_pool_size->getValue();
+            std::vector<Stack> unmap;
+            {
+                Spinlock::Lock lock(pool->mutex);
+                for (size_t i = 0; i < count; ++i) {
+                    if (pool->stacks.size() < max) {
+                        pool->stacks.push_back(stacks[i]);
+                    } else {
+                        unmap.push_back(stacks[i]);
+                    }
+                }
+            }
+            for (auto& i : unmap) {
+                munmap((char*)i.sp - PageSize(), i.size + PageSize());
+            }
+        }
+
+        static thread_local Cache t_cache;
+        static thread_local bool t_cache_dead;
     };
 
-    using StackAllocator = MallocStackAlloctor;
+    thread_local MmapStackAllocator::Cache MmapStackAllocator::t_cache;
+    thread_local bool MmapStackAllocator::t_cache_dead = false;
+
+    using StackAllocator = MmapStackAllocator;
+
+    static ConfigVar<uint32_t>::ptr g_shared_stack_size =
+            Config::Lookup<uint32_t>("fiber.shared_stack_size", 1024 * 1024, "shared stack size for shared-stack fibers");
+
+    static ConfigVar<uint32_t>::ptr g_shared_stack_count =
+            Config::Lookup<uint32_t>("fiber.shared_stack_count", 4, "shared stacks per thread");
+
+    // x86-64的red zone, 保存共享栈时多保存这么多
+    static const size_t STACK_RED_ZONE = 128;
+
+    struct Fiber::SharedStack {
+        char* stack = nullptr;
+        size_t size = 0;
+        Fiber* occupant = nullptr;  // 栈上是哪个协程的内容, 只有所在线程读写
+
+        explicit SharedStack(size_t s)
+            : size(s) {
+            stack = (char*)StackAllocator::Alloc(size);
+        }
+
+        ~SharedStack() {
+            StackAllocator::Dealloc(stack, size);
+        }
+    };
 
     // 主协程
     Fiber::Fiber()
     {
         m_state = EXEC;
         SetThis(this);  // 设置到线程变量 t_fiber;
-
-        // 该函数初始化ucp所指向的结构体ucontext_t(用来保存前执行状态上下文)，填充当前有效的上下文
-        // 获取当前context
-        if (getcontext(&m_ctx))
-        {
-            SYLAR_ASSERT2(false, "getcontext");
-        }
+        // 上下文在第一次切换出去时保存
 
         ++s_fiber_count;
         SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber main";
     }
 
     // 子协程 需要分配栈
-    Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
+    Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller, bool shared_stack)
         : m_id(++s_fiber_id),
-          m_cb(cb)
+          m_cb(std::move(cb))
     {
         ++s_fiber_count;
-        m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
+        if (shared_stack && !use_caller) {
+            // 第一次执行时才绑定共享栈和初始化上下文
+            m_shared = true;
+            SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber id = " << m_id << " shared stack";
+            return;
+        }
+        bool profiling = IsStackProfiling();
+        if (profiling || (!stacksize && IsStackAdaptive())) {
+            m_stackProfile = GetStackProfile(m_cb);
+        }
+        if (!stacksize) {
+            stacksize = StackSizeFor(m_stackProfile);
+        }
+        m_stacksize = stacksize;
 
         // 栈生成
         m_stack = StackAllocator::Alloc(m_stacksize);   // 申请空间
-        if (getcontext(&m_ctx))
-        {
-            SYLAR_ASSERT2(false, "getcontext");
-        }
-
-        m_ctx.uc_link = nullptr;    // 指向当前的上下文结束时要恢复到的上下文
-        // 该上下文中使用的栈
-        m_ctx.uc_stack.ss_sp = m_stack;
-        m_ctx.uc_stack.ss_size = m_stacksize;
-
-        if (!use_caller) {
-            makecontext(&m_ctx, &Fiber::MainFunc, 0);   // 用于将一个新函数和堆栈，绑定到指定context中
+        if (profiling) {
+            PaintStack(m_stack, m_stacksize);
+            m_stackPainted = true;
         }
-        else {  // 在MainFiber上调度
-            makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);
+        // 将协程执行函数和栈绑定到上下文, use_caller时在MainFiber上调度
+        if (!MakeContext(&m_ctx, m_stack, m_stacksize, use_caller ? &Fiber::CallerMainFunc : &Fiber::MainFunc))
+        {
+            SYLAR_ASSERT2(false, "makecontext");
         }
         SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber id = " << m_id;
     }
@@ -84,10 +282,15 @@ namespace sylar{
     Fiber::~Fiber()
     {
         --s_fiber_count;
-        if (m_stack)
+        if (m_stack || m_shared)
         {
             SYLAR_ASSERT(m_state == TERM || m_state == EXCEPT || m_state == INIT);
-            StackAllocator::Dealloc(m_stack, m_stacksize);
+            if (m_stack) {
+                StackAllocator::Dealloc(m_stack, m_stacksize);
+            }
+            // 结束时已经让出了共享栈, 不用通知所在线程
+            SYLAR_ASSERT(!m_sharedStack || m_sharedStack->occupant != this);
+            free(m_saveBuffer);
         } else {
             // 主协程
             SYLAR_ASSERT(!m_cb);
@@ -109,20 +312,36 @@ namespace sylar{
      */
     void Fiber::reset(std::function<void()> cb)
     {
-        SYLAR_ASSERT(m_stack);
+        // 重置后会填充栈时才需要入口的统计
+        StackProfile* profile = nullptr;
+        if (!m_shared && (m_stackPainted || IsStackProfiling())) {
+            profile = GetStackProfile(cb);
+        }
+        reset(std::move(cb), profile);
+    }
+
+    void Fiber::reset(std::function<void()> cb, StackProfile* profile)
+    {
+        SYLAR_ASSERT(m_stack || m_shared);
         SYLAR_ASSERT(m_state == TERM
             || m_state == EXCEPT
             || m_state == INIT);
-        m_cb = cb;
-        if (getcontext(&m_ctx)) // 获取上下文 重置
+        if (m_shared) {
+            m_cb = std::move(cb);
+            m_saveSize = 0;
+            m_state = INIT; // 执行时再在共享栈上初始化上下文
+            return;
+        }
+        m_cb = std::move(cb);
+        if (IsStackProfiling() && !m_stackPainted) {
+            PaintStack(m_stack, m_stacksize);
+            m_stackPainted = true;
+        }
+        m_stackProfile = m_cb && m_stackPainted ? profile : nullptr;
+        if (!MakeContext(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc)) // 重置上下文
         {
-            SYLAR_ASSERT2(false, "getcontext");
+            SYLAR_ASSERT2(false, "makecontext");
         }
-        m_ctx.uc_link = nullptr;
-        m_ctx.uc_stack.ss_sp = m_stack;
-        m_ctx.uc_stack.ss_size = m_stacksize;
-
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);
         m_state = INIT;
     }
 
@@ -134,20 +353,30 @@ namespace sylar{
     void Fiber::swapIn(){
         SetThis(this);
         SYLAR_ASSERT(m_state != EXEC);
+        if (m_shared) {
+            acquireSharedStack(m_state == INIT);
+        }
         m_state = EXEC;
-        // 函数保存当前的上下文到oucp所指向的数据结构，并且设置到ucp所指向的上下文
-        // 执行绑定的函数 MainFunc
-        if (swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx)) {
+        // 保存当前的上下文到主协程, 切换到本协程的上下文, 第一次切换时执行绑定的函数 MainFunc
+        if (!SwapContext(&MainFiber()->m_ctx, &m_ctx)) {
             SYLAR_ASSERT2(false, "swapcontext");
         }
+        if (m_stackPainted) {
+            recordStackUsage();
+        }
         // SYLAR_LOG_INFO(g_logger) << t_threadFiber->getId();
     }
 
     // 切换到后台执行 true
     void Fiber::swapOut(){
-        SetThis(Scheduler::GetMainFiber());
-        //SetThis(t_threadFiber.get());
-        if (swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)) {
+        // 还在协程栈上, 这时的调用栈就是长时间没让出的代码路径
+        if (t_slice_flags && (t_slice_flags->load(std::memory_order_relaxed) & SLICE_OVERRUN)) {
+            SYLAR_LOG_WARN(g_logger) << "fiber_id=" << m_id << " ran over scheduler.slice_budget, leave at"
+                                     << std::endl << sylar::BacktraceToString(64, 2, "    ");
+        }
+        Fiber* main_fiber = MainFiber();
+        SetThis(main_fiber);
+        if (!SwapContext(&m_ctx, &main_fiber->m_ctx)) {
             SYLAR_ASSERT2(false, "swapcontext");
         }
     }
@@ -156,20 +385,93 @@ namespace sylar{
     void Fiber::call() {
         SetThis(this);
         m_state = EXEC;
-        if (swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
+        if (!SwapContext(&t_threadFiber->m_ctx, &m_ctx)) {
             SYLAR_ASSERT2(false, "swapcontext");
         }
+        if (m_stackPainted) {
+            recordStackUsage();
+        }
     }
 
     // false
     void Fiber::back()
     {
         SetThis(t_threadFiber.get());
-        if (swapcontext(&m_ctx, &t_threadFiber->m_ctx)) {
+        if (!SwapContext(&m_ctx, &t_threadFiber->m_ctx)) {
             SYLAR_ASSERT2(false, "swapcontext");
         }
     }
 
+    void Fiber::acquireSharedStack(bool fresh) {
+        // 当前线程的共享栈, 协程轮流绑定
+        static thread_local std::vector<std::shared_ptr<SharedStack> > s_stacks;
+        static thread_local size_t s_next = 0;
+        if (!m_sharedStack) {
+            if (s_stacks.empty()) {
+                size_t count = std::max<uint32_t>(g_shared_stack_count->getValue(), 1);
+                for (size_t i = 0; i < count; ++i) {
+                    s_stacks.emplace_back(new SharedStack(g_shared_stack_size->getValue()));
+                }
+            }
+            m_sharedStack = s_stacks[s_next++ % s_stacks.size()];
+            m_stackThread = GetThreadId();
+            m_stacksize = m_sharedStack->size;
+        }
+        SYLAR_ASSERT2(m_stackThread == GetThreadId(), "shared stack fiber_id=" + std::to_string(m_id)
+                      + " resumed on thread " + std::to_string(GetThreadId())
+                      + ", stack on thread " + std::to_string(m_stackThread));
+
+        SharedStack* ss = m_sharedStack.get();
+        if (ss->occupant != this) {
+            if (ss->occupant) {
+                ss->occupant->saveSharedStack();
+            }
+            ss->occupant = this;
+            if (!fresh && m_saveSize) {
+                memcpy(ss->stack + ss->size - m_saveSize, m_saveBuffer, m_saveSize);
+            }
+        }
+        if (fresh && !MakeContext(&m_ctx, ss->stack, ss->size, &Fiber::MainFunc)) {
+            SYLAR_ASSERT2(false, "makecontext");
+        }
+    }
+
+    void Fiber::saveSharedStack() {
+        SharedStack* ss = m_sharedStack.get();
+        char* sp = (char*)ContextStackPointer(&m_ctx);
+        SYLAR_ASSERT2(sp, "shared stack not supported");
+        sp = sp - ss->stack > (ptrdiff_t)STACK_RED_ZONE ? sp - STACK_RED_ZONE : ss->stack;
+        size_t size = ss->stack + ss->size - sp;
+        if (size > m_saveCapacity) {
+            free(m_saveBuffer);
+            m_saveBuffer = (char*)malloc(size);
+            m_saveCapacity = size;
+        }
+        memcpy(m_saveBuffer, sp, size);
+        m_saveSize = size;
+    }
+
+    void Fiber::recordStackUsage() {
+        if (!m_stackPainted || !m_stackProfile || (m_state != TERM && m_state != EXCEPT)) {
+            return;
+        }
+        size_t used = MeasureStack(m_stack, m_stacksize);
+        RecordStackUsage(m_stackProfile, used, m_stacksize);
+        PaintStack((char*)m_stack + m_stacksize - used, used);
+        m_stackProfile = nullptr;
+    }
+
+    size_t Fiber::StackSizeFor(const StackProfile* profile) {
+        size_t size = s_fiber_stack_size.load(std::memory_order_relaxed);
+        return IsStackAdaptive() ? ChooseStackSize(profile, size) : size;
+    }
+
+    Fiber* Fiber::MainFiber() {
+        // 不在调度器里时(直接swapIn), 切回线程的主协程
+        Fiber* main_fiber = Scheduler::GetMainFiber();
+        return main_fiber ? main_fiber : t_threadFiber.get();
+    }
+
     uint64_t Fiber::GetFiberId() {
 
         if(t_fiber) {
@@ -178,6 +480,14 @@ namespace sylar{
         return 0;
     }
 
+    bool Fiber::ShouldYield() {
+        return t_slice_flags && (t_slice_flags->load(std::memory_order_relaxed) & SLICE_YIELD);
+    }
+
+    void Fiber::SetSliceFlags(std::atomic<int>* flags) {
+        t_slice_flags = flags;
+    }
+
     // 设置当前线程的运行协程
     void Fiber::SetThis(Fiber* f)
     {
@@ -242,6 +552,11 @@ namespace sylar{
                                       << sylar::BacktraceToString();
         }
 
+        // 结束了栈上的内容不用再保存, 协程可能在别的线程析构, 这里就让出共享栈
+        if (cur->m_sharedStack) {
+            cur->m_sharedStack->occupant = nullptr;
+        }
+
         // 去掉会存在内存泄露问题
         auto raw_ptr = cur.get();   // 子协程裸指针
         cur.reset();
@@ -6,8 +6,10 @@
 #define MYSYLAR_FIBER_H
 
 #include <memory>
-#include <sys/ucontext.h>
+#include <atomic>
 #include <functional>
+#include "fiber_context.h"
+#include "stack_profile.h"
 
 // 主协程： 创建协成并调用协成
 // 子协程： 执行完/让出cpu 回到主协成
@@ -29,6 +31,14 @@ public:
       EXCEPT    // 异常状态
     };
 
+    /**
+     * @brief 调度器看门狗对当前时间片的标记, 见scheduler.slice_budget
+     */
+    enum SliceFlag {
+      SLICE_OVERRUN = 0x1,  // 时间片超过了预算, 让出时输出调用栈
+      SLICE_YIELD = 0x2     // 请求协程尽快让出, 见ShouldYield
+    };
+
 private:
     /**
      * @brief 无参构造函数
@@ -42,8 +52,13 @@ public:
      * @param[in] cb 协程执行的函数
      * @param[in] stacksize 协程栈大小
      * @param[in] use_caller 是否在MainFiber上调度
+     * @param[in] shared_stack 是否使用共享栈, 为true时忽略stacksize
+     * @details 共享栈模式: 每个线程有fiber.shared_stack_count个fiber.shared_stack_size大小的共享栈,
+     *          协程第一次执行时绑定到当前线程的一个共享栈, 之后只能在这个线程执行(调度器会自动指定线程).
+     *          别的协程要用这个共享栈时, 才把它栈上用到的部分拷贝到按大小分配的堆内存, 再次执行时拷回.
+     * @attention 共享栈协程不能把栈上变量的地址交给其他协程, 让出之后那块内存可能属于别的协程
      */
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false);
+    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false, bool shared_stack = false);
     ~Fiber();
 
     /**
@@ -52,6 +67,11 @@ public:
      * @post getState() = INIT
      */
     void reset(std::function<void()> cb);
+
+    /**
+     * @brief 同reset(cb), 由调用方传入已经查好的入口栈统计(GetStackProfile(cb)), 只在统计栈使用时用到
+     */
+    void reset(std::function<void()> cb, StackProfile* profile);
     /**
     * @brief 将当前协程切换到运行状态
     * @pre getState() != EXEC
@@ -84,11 +104,54 @@ public:
      */
     State getState() const { return m_state;}
 
+    /**
+     * @brief 返回调度优先级, 见Scheduler::Priority, 小于0表示没有设置
+     */
+    int getPriority() const { return m_priority;}
+
+    /**
+     * @brief 设置调度优先级, 之后每次被调度(YieldToReady, IO事件唤醒)都按这个优先级排队
+     */
+    void setPriority(int priority) { m_priority = priority;}
+
+    /**
+     * @brief 是否使用共享栈
+     */
+    bool isSharedStack() const { return m_shared;}
+
+    /**
+     * @brief 共享栈协程绑定的线程id, 还没执行过或者不是共享栈协程返回-1
+     */
+    int getStackThread() const { return m_stackThread;}
+
+    /**
+     * @brief 共享栈协程让出时保存的栈大小(字节)
+     */
+    size_t getSavedStackSize() const { return m_saveSize;}
+
     /**
     * @brief 获取当前协程的id
     */
     static uint64_t GetFiberId();
 
+    /**
+     * @brief 当前协程是否应该让出
+     * @details 当前时间片超过scheduler.slice_budget后为true, 直到协程让出.
+     *          长时间计算的代码可以定期检查, 为true时YieldToReady
+     */
+    static bool ShouldYield();
+
+    /**
+     * @brief 设置当前线程的时间片标记(SliceFlag), 由调度器在调度线程里设置
+     */
+    static void SetSliceFlags(std::atomic<int>* flags);
+
+    /**
+     * @brief 入口为profile的协程应该用的栈大小
+     * @details fiber.stack_adaptive时按入口的栈统计从fiber.stack_classes里选, 否则为fiber.stack_size
+     */
+    static size_t StackSizeFor(const StackProfile* profile);
+
 public:
 
     // 设置当前线程的运行协程
@@ -109,15 +172,54 @@ public:
      */
     static void CallerMainFunc();
 
+private:
+    /**
+     * @brief swapIn/swapOut切换的主协程, 调度器的调度协程, 没有调度器时为线程的主协程
+     */
+    static Fiber* MainFiber();
+
+    /**
+     * @brief 一个线程的共享栈, 定义在fiber.cpp
+     */
+    struct SharedStack;
+
+    /**
+     * @brief 共享栈协程执行前, 保存占用共享栈的协程, 拷回自己的栈
+     * @param[in] fresh 是否第一次执行(或reset之后), 是则在共享栈上初始化上下文
+     */
+    void acquireSharedStack(bool fresh);
+
+    /**
+     * @brief 把共享栈上用到的部分保存到m_saveBuffer
+     */
+    void saveSharedStack();
+
+    /**
+     * @brief 协程结束切回来之后记录栈的使用量并重新填充用过的部分(fiber.stack_profile)
+     */
+    void recordStackUsage();
+
 private:
     uint64_t m_id = 0;  // 协程id
     uint32_t m_stacksize = 0;  // 协程运行栈大小
     State m_state = INIT;   // 协程状态
+    int m_priority = -1;    // 调度优先级
+    bool m_recyclable = false;  // 调度器为回调创建的协程, 结束后放回调度线程的协程池复用
 
-    ucontext_t m_ctx;   // 协程上下文
+    FiberContext m_ctx;   // 协程上下文
     void* m_stack = nullptr;    // 协程运行栈指针
 
     std::function<void()> m_cb; // 协程运行函数
+
+    bool m_shared = false;      // 是否使用共享栈
+    std::shared_ptr<SharedStack> m_sharedStack; // 绑定的共享栈, 第一次执行时绑定, 线程退出后也不会释放
+    int m_stackThread = -1;     // 共享栈所在的线程
+    char* m_saveBuffer = nullptr;   // 让出后栈上内容的保存区
+    size_t m_saveSize = 0;      // 保存的大小
+    size_t m_saveCapacity = 0;  // 保存区的容量
+
+    StackProfile* m_stackProfile = nullptr; // 入口的栈统计, 统计或者按统计选栈大小时才有
+    bool m_stackPainted = false;    // 栈是否填充过, 是才能统计使用量
 };
 
 };
@@ -0,0 +1,157 @@
+//
+// 协程上下文切换
+//
+
+#include "fiber_context.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef SYLAR_FIBER_UCONTEXT
+
+#if defined(__x86_64__)
+// void sylar_swap_context(void** from_sp, void* to_sp)
+// 按System V ABI只需要保存callee-saved寄存器rbx, rbp, r12-r15, 以及MXCSR和x87控制字.
+// 栈上从低到高: [mxcsr, x87cw] r12 r13 r14 r15 rbx rbp 返回地址
+asm(R"(
+    .pushsection .text
+    .globl sylar_swap_context
+    .type sylar_swap_context, @function
+    .p2align 4
+sylar_swap_context:
+    pushq %rbp
+    pushq %rbx
+    pushq %r15
+    pushq %r14
+    pushq %r13
+    pushq %r12
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r12
+    popq %r13
+    popq %r14
+    popq %r15
+    popq %rbx
+    popq %rbp
+    ret
+    .size sylar_swap_context, .-sylar_swap_context
+
+    .type sylar_context_exit, @function
+    .p2align 4
+sylar_context_exit:
+    call abort@PLT
+    hlt
+    .size sylar_context_exit, .-sylar_context_exit
+    .popsection
+)");
+
+extern "C" void sylar_context_exit();
+#elif defined(__aarch64__)
+// void sylar_swap_context(void** from_sp, void* to_sp)
+// 按AAPCS64只需要保存x19-x28, fp(x29), lr(x30)和d8-d15
+// 栈上从低到高: d8-d15 x19-x28 x29 x30
+asm(R"(
+    .pushsection .text
+    .globl sylar_swap_context
+    .type sylar_swap_context, %function
+    .p2align 4
+sylar_swap_context:
+    sub sp, sp, #0xa0
+    stp d8, d9, [sp, #0x00]
+    stp d10, d11, [sp, #0x10]
+    stp d12, d13, [sp, #0x20]
+    stp d14, d15, [sp, #0x30]
+    stp x19, x20, [sp, #0x40]
+    stp x21, x22, [sp, #0x50]
+    stp x23, x24, [sp, #0x60]
+    stp x25, x26, [sp, #0x70]
+    stp x27, x28, [sp, #0x80]
+    stp x29, x30, [sp, #0x90]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp d8, d9, [sp, #0x00]
+    ldp d10, d11, [sp, #0x10]
+    ldp d12, d13, [sp, #0x20]
+    ldp d14, d15, [sp, #0x30]
+    ldp x19, x20, [sp, #0x40]
+    ldp x21, x22, [sp, #0x50]
+    ldp x23, x24, [sp, #0x60]
+    ldp x25, x26, [sp, #0x70]
+    ldp x27, x28, [sp, #0x80]
+    ldp x29, x30, [sp, #0x90]
+    add sp, sp, #0xa0
+    ret
+    .size sylar_swap_context, .-sylar_swap_context
+
+    .type sylar_context_entry, %function
+    .p2align 4
+sylar_context_entry:
+    blr x19
+    bl abort
+    .size sylar_context_entry, .-sylar_context_entry
+    .popsection
+)");
+
+extern "C" void sylar_context_entry();
+#endif
+
+#endif
+
+namespace sylar {
+
+#ifdef SYLAR_FIBER_UCONTEXT
+    bool MakeContext(FiberContext* ctx, void* stack, size_t size, void (*fn)()) {
+        // 该函数初始化ucp所指向的结构体ucontext_t(用来保存前执行状态上下文)，填充当前有效的上下文
+        if (getcontext(ctx)) {
+            return false;
+        }
+        ctx->uc_link = nullptr;    // 指向当前的上下文结束时要恢复到的上下文
+        // 该上下文中使用的栈
+        ctx->uc_stack.ss_sp = stack;
+        ctx->uc_stack.ss_size = size;
+        makecontext(ctx, fn, 0);   // 用于将一个新函数和堆栈，绑定到指定context中
+        return true;
+    }
+
+    const char* FiberContextImpl() {
+        return "ucontext";
+    }
+#else
+    bool MakeContext(FiberContext* ctx, void* stack, size_t size, void (*fn)()) {
+        // 栈顶16字节对齐, 按sylar_swap_context恢复时的布局摆好初始寄存器
+        uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+        // ret跳到fn时rsp为top - 8, 和call进来一样满足(rsp + 8) % 16 == 0, fn返回时跳到sylar_context_exit
+        uint64_t* sp = (uint64_t*)(top - 72);
+        memset(sp, 0, 72);
+        uint32_t mxcsr = 0;
+        uint16_t cw = 0;
+        __asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+        __asm__ volatile("fnstcw %0" : "=m"(cw));
+        memcpy(sp, &mxcsr, sizeof(mxcsr));
+        memcpy((char*)sp + 4, &cw, sizeof(cw));
+        sp[7] = (uint64_t)fn;
+        sp[8] = (uint64_t)&sylar_context_exit;
+#elif defined(__aarch64__)
+        // ret到sylar_context_entry, 它从x19调用fn, fn返回时abort
+        uint64_t* sp = (uint64_t*)(top - 0xa0);
+        memset(sp, 0, 0xa0);
+        sp[8] = (uint64_t)fn;                       // x19
+        sp[19] = (uint64_t)&sylar_context_entry;    // x30
+#endif
+        ctx->sp = sp;
+        return true;
+    }
+
+    const char* FiberContextImpl() {
+        return "asm";
+    }
+#endif
+}
@@ -0,0 +1,78 @@
+//
+// 协程上下文切换
+//
+
+#ifndef MYSYLAR_FIBER_CONTEXT_H
+#define MYSYLAR_FIBER_CONTEXT_H
+
+#include <stddef.h>
+
+// 只有x86-64和aarch64有汇编实现, 其他平台或者配置了SYLAR_FIBER_CONTEXT=ucontext时用ucontext
+#if !defined(SYLAR_FIBER_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+#define SYLAR_FIBER_UCONTEXT
+#endif
+
+#ifdef SYLAR_FIBER_UCONTEXT
+#include <ucontext.h>
+#else
+extern "C" void sylar_swap_context(void** from_sp, void* to_sp);
+#endif
+
+namespace sylar {
+
+#ifdef SYLAR_FIBER_UCONTEXT
+    typedef ucontext_t FiberContext;
+#else
+    /**
+     * @brief 汇编实现的协程上下文
+     * @details callee-saved寄存器在切换时压到协程自己的栈上, 这里只保存栈顶.
+     *          不保存信号屏蔽字, 切换不需要系统调用
+     */
+    struct FiberContext {
+        void* sp = nullptr;
+    };
+#endif
+
+    /**
+     * @brief 初始化上下文, 第一次切换到ctx时在stack上执行fn
+     * @return 是否成功
+     * @attention fn不能返回, 返回会abort
+     */
+    bool MakeContext(FiberContext* ctx, void* stack, size_t size, void (*fn)());
+
+    /**
+     * @brief 保存当前上下文到from, 切换到to
+     * @return 是否成功, 切换回from之后才返回
+     */
+    inline bool SwapContext(FiberContext* from, FiberContext* to) {
+#ifdef SYLAR_FIBER_UCONTEXT
+        return swapcontext(from, to) == 0;
+#else
+        sylar_swap_context(&from->sp, to->sp);
+        return true;
+#endif
+    }
+
+    /**
+     * @brief 已经切换出去的上下文的栈顶, 共享栈据此保存用到的部分
+     * @return 不支持的平台返回nullptr
+     */
+    inline void* ContextStackPointer(const FiberContext* ctx) {
+#ifndef SYLAR_FIBER_UCONTEXT
+        return ctx->sp;
+#elif defined(__x86_64__)
+        return (void*)ctx->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+        return (void*)ctx->uc_mcontext.sp;
+#else
+        return nullptr;
+#endif
+    }
+
+    /**
+     * @brief 编译选用的实现, "asm"或"ucontext"
+     */
+    const char* FiberContextImpl();
+}
+
+#endif //MYSYLAR_FIBER_CONTEXT_H
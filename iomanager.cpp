@@ -9,6 +9,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <algorithm>
 #include <string.h>
 #include <unistd.h>
 
@@ -35,12 +38,19 @@ namespace sylar {
     }
 
     // 触发事件
-    void IOManager::FdContext::triggerEvent(sylar::IOManager::Event event)
+    void IOManager::FdContext::triggerEvent(sylar::IOManager::Event event, Scheduler* owner, TaskBatch* batch)
     {
         SYLAR_ASSERT(event & events);
         events = (Event)(events & ~event);  // 取消事件
         EventContext& ctx = getContext(event);
-        if (ctx.cb) {
+        if (batch && ctx.scheduler == owner) {
+            if (ctx.cb) {
+                batch->add(std::move(ctx.cb));
+                ctx.cb = nullptr;
+            } else {
+                batch->add(std::move(ctx.fiber));
+            }
+        } else if (ctx.cb) {
             ctx.scheduler->schedule(&ctx.cb);
         } else
         {
@@ -56,19 +66,24 @@ namespace sylar {
         m_epfd = epoll_create(5000);
         SYLAR_ASSERT(m_epfd > 0);
 
-        int rt = pipe(m_tickleFds); // 调用pipe()函数就已将管道打开
-        SYLAR_ASSERT(!rt);
+        m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        SYLAR_ASSERT(m_tickleFd >= 0);
 
         epoll_event event;
         memset(&event, 0, sizeof(epoll_event));
-        event.data.fd = m_tickleFds[0];
+        event.data.fd = m_tickleFd;
         event.events = EPOLLIN | EPOLLET;   // 输入 + 边缘触发
 
-        rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
+        int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
         SYLAR_ASSERT(!rt);
 
-        rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-        SYLAR_ASSERT(!rt);
+        for (size_t i = 0; i < getWorkerCount(); ++i) {
+            std::unique_ptr<Waker> waker(new Waker);
+            waker->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            SYLAR_ASSERT(waker->fd >= 0);
+            m_wakers.push_back(std::move(waker));
+        }
+        m_idleWorkers.reserve(m_wakers.size());
 
         contextResize(32);
 
@@ -78,8 +93,10 @@ namespace sylar {
     IOManager::~IOManager() {
         stop();
         close(m_epfd);
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
+        close(m_tickleFd);
+        for (auto& i : m_wakers) {
+            close(i->fd);
+        }
 
         for (size_t i = 0; i < m_fdContexts.size(); ++i)
         {
@@ -132,10 +149,10 @@ namespace sylar {
 
         int rt = epoll_ctl(m_epfd, op, fd, &epevent);
         if(rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                      << op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ") fd_ctx->events="
-                                      << (EPOLL_EVENTS)fd_ctx->events;
+            SYLAR_LOG_EVERY_MS(g_logger, sylar::LogLevel::ERROR, 1000) << "epoll_ctl(" << m_epfd << ", "
+                                                                       << op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                                                                       << rt << " (" << errno << ") (" << strerror(errno) << ") fd_ctx->events="
+                                                                       << (EPOLL_EVENTS)fd_ctx->events;
             return -1;
         }
 
@@ -178,9 +195,9 @@ namespace sylar {
 
         int rt = epoll_ctl(m_epfd, op, fd, &epevent);
         if(rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                      << op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            SYLAR_LOG_EVERY_MS(g_logger, sylar::LogLevel::ERROR, 1000) << "epoll_ctl(" << m_epfd << ", "
+                                                                       << op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                                                                       << rt << " (" << errno << ") (" << strerror(errno) << ")";
             return false;
         }
 
@@ -213,9 +230,9 @@ namespace sylar {
 
         int rt = epoll_ctl(m_epfd, op, fd, &epevent);
         if(rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                      << op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            SYLAR_LOG_EVERY_MS(g_logger, sylar::LogLevel::ERROR, 1000) << "epoll_ctl(" << m_epfd << ", "
+                                                                       << op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                                                                       << rt << " (" << errno << ") (" << strerror(errno) << ")";
             return false;
         }
 
@@ -246,9 +263,9 @@ namespace sylar {
 
         int rt = epoll_ctl(m_epfd, op, fd, &epevent);
         if (rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                      << op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            SYLAR_LOG_EVERY_MS(g_logger, sylar::LogLevel::ERROR, 1000) << "epoll_ctl(" << m_epfd << ", "
+                                                                       << op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                                                                       << rt << " (" << errno << ") (" << strerror(errno) << ")";
             return false;
         }
 
@@ -275,8 +292,136 @@ namespace sylar {
         if (!hasIdleThreads()) {   // 如果没有空闲事件，因为发送需要闲置线程来处理
             return ;
         }
-        int rt = write(m_tickleFds[1], "T", 1); // 通过写数据来触发
-        SYLAR_ASSERT(rt == 1);
+        // 已经有线程在醒来的路上, 它醒来后看到还有任务会接着唤醒下一个
+        if (m_waking > 0) {
+            return;
+        }
+        // 唤醒空闲栈顶的线程, 没有休眠的线程再唤醒epoll_wait的线程
+        if (!wakeParked()) {
+            tickleEpoll();
+        }
+    }
+
+    void IOManager::tickleIdle(size_t count)
+    {
+        // 在醒来路上的线程也会取任务, 算在count里
+        count = std::min<size_t>(count, m_idleThreadCount);
+        for (size_t i = m_waking; i < count; ++i) {
+            if (!wakeParked()) {
+                tickleEpoll();
+                break;
+            }
+        }
+    }
+
+    bool IOManager::wakeParked()
+    {
+        while (true) {
+            size_t index = 0;
+            {
+                Spinlock::Lock lock(m_idleMutex);
+                if (m_idleWorkers.empty()) {
+                    return false;
+                }
+                index = m_idleWorkers.back();
+                m_idleWorkers.pop_back();
+            }
+            // 出栈后线程可能刚好超时醒来, 换下一个
+            if (notify(*m_wakers[index], Waker::PARKED)) {
+                return true;
+            }
+        }
+    }
+
+    void IOManager::tickleWorker(size_t index)
+    {
+        Waker& waker = *m_wakers[index];
+        int state = waker.state;
+        if (state == Waker::PARKED) {
+            {
+                Spinlock::Lock lock(m_idleMutex);
+                auto it = std::find(m_idleWorkers.begin(), m_idleWorkers.end(), index);
+                if (it == m_idleWorkers.end()) {    // 已经被别人出栈唤醒了
+                    return;
+                }
+                m_idleWorkers.erase(it);
+            }
+            notify(waker, Waker::PARKED);
+        } else if (state == Waker::POLLING) {
+            notify(waker, Waker::POLLING);
+        }
+        // 在执行任务的线程下一轮调度就会看到自己的mailbox
+    }
+
+    bool IOManager::notify(Waker& waker, int from)
+    {
+        // 先计数再改状态, 对方醒来减计数时一定已经加过
+        ++m_waking;
+        if (!waker.state.compare_exchange_strong(from, Waker::NOTIFIED)) {
+            --m_waking;
+            return false;
+        }
+        int rt = eventfd_write(from == Waker::POLLING ? m_tickleFd : waker.fd, 1);
+        SYLAR_ASSERT(rt == 0);
+        statTickleSent();
+        return true;
+    }
+
+    void IOManager::tickleEpoll()
+    {
+        int index = m_poller;
+        if (index >= 0) {
+            notify(*m_wakers[index], Waker::POLLING);
+        }
+    }
+
+    void IOManager::park(Waker& waker, size_t index)
+    {
+        static const int MAX_TIMEOUT = 3000;
+        {
+            Spinlock::Lock lock(m_idleMutex);
+            m_idleWorkers.push_back(index);
+            waker.state = Waker::PARKED;
+        }
+        // 先入栈再检查, 和schedule的先入队再看空闲栈配对, 不会漏掉唤醒
+        int rt = 0;
+        if (!hasPendingTasks() && !stopping()) {
+            pollfd pfd;
+            pfd.fd = waker.fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            uint64_t begin = GetCurrentUS();
+            rt = poll(&pfd, 1, MAX_TIMEOUT);
+            uint64_t end = GetCurrentUS();
+            statPollTime(end > begin ? end - begin : 0);
+        }
+        eventfd_t value;
+        if (waker.state.exchange(Waker::RUNNING) == Waker::NOTIFIED) {
+            // 通知方已经把自己出栈了
+            eventfd_read(waker.fd, &value);
+            onWakeUp();
+        } else {
+            // 上一轮通知方写得晚, 计数留到了这一轮
+            if (rt > 0) {
+                eventfd_read(waker.fd, &value);
+            }
+            // 超时或者没有阻塞, 自己出栈
+            Spinlock::Lock lock(m_idleMutex);
+            auto it = std::find(m_idleWorkers.begin(), m_idleWorkers.end(), index);
+            if (it != m_idleWorkers.end()) {
+                m_idleWorkers.erase(it);
+            }
+        }
+    }
+
+    void IOManager::onWakeUp()
+    {
+        --m_waking;
+        statTickleReceived();
+        // 自己会取走一个, 还有多的再唤醒一个
+        if (getPendingTaskCount() > 1) {
+            tickle();
+        }
     }
 
     bool IOManager::stopping(uint64_t& timeout)
@@ -295,6 +440,8 @@ namespace sylar {
     void IOManager::idle()
     {
         SYLAR_LOG_DEBUG(g_logger) << "idle";
+        size_t index = getWorkerIndex();
+        Waker& waker = *m_wakers[index];
         const uint64_t MAX_EVENTS = 256;
         epoll_event* events = new epoll_event[MAX_EVENTS]();
         std::shared_ptr<epoll_event> shared_events(events, [](epoll_event* ptr) {   // 析构方法
@@ -309,6 +456,21 @@ namespace sylar {
                 break;
             }
 
+            // 已经有线程在epoll_wait, 自己休眠等待唤醒
+            int expected = -1;
+            if (!m_poller.compare_exchange_strong(expected, (int)index)) {
+                park(waker, index);
+                Fiber::ptr cur = Fiber::GetThis();
+                auto raw_ptr = cur.get();
+                cur.reset();
+
+                raw_ptr->swapOut();
+                continue;
+            }
+            waker.state = Waker::POLLING;
+            // 置POLLING之后再取一次定时器, 和onTimerInsertedAtFront配对
+            next_timeout = getNextTimer();
+
             int rt = 0;
             do {
                 static const int MAX_TIMEOUT = 3000;    // 超时时间
@@ -318,27 +480,39 @@ namespace sylar {
                 } else {
                     next_timeout = MAX_TIMEOUT;
                 }
+                if (hasPendingTasks()) {    // 计入空闲线程前入队的任务不会tickle, 不能阻塞
+                    next_timeout = 0;
+                }
+                uint64_t begin = GetCurrentUS();
                 rt = epoll_wait(m_epfd, events, MAX_EVENTS, (int)next_timeout);
+                uint64_t end = GetCurrentUS();
+                statPollTime(end > begin ? end - begin : 0);
                 if(rt < 0 && errno == EINTR) {  // 如果没有协程需要执行， 则循环
                 } else {
                     break;  // 有事件返回
                 }
             } while (true);
+            bool notified = waker.state.exchange(Waker::RUNNING) == Waker::NOTIFIED;
+            m_poller = -1;
+            if (notified) {
+                onWakeUp();
+            }
 
+            // 到期的定时器和这一轮的IO事件攒成一批, 处理完一起提交
+            TaskBatch batch;
             std::vector<std::function<void()> > cbs;
             listExpiredCb(cbs); // 获取超时任务
-            if (!cbs.empty()) {
-                schedule(cbs.begin(), cbs.end());   // 函数添加到调度器中
-                cbs.clear();
+            for (auto& cb : cbs) {
+                batch.add(std::move(cb));
             }
+            cbs.clear();
 
+            size_t triggered = 0;
             for (int i = 0; i < rt; ++i) {
                 epoll_event& event = events[i];
-                if (event.data.fd == m_tickleFds[0]) {  // 唤醒
-                    uint8_t dummy[256];
-                    while (read(m_tickleFds[0], dummy, sizeof(dummy)) > 0) {
-
-                    }
+                if (event.data.fd == m_tickleFd) {  // 唤醒
+                    eventfd_t value;
+                    eventfd_read(m_tickleFd, &value);
                     continue;
                 }
 
@@ -365,22 +539,27 @@ namespace sylar {
 
                 int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
                 if (rt2) {
-                    SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                              << op << ", " << fd_ctx->fd << ", " << (EPOLL_EVENTS)event.events << "):"
-                                              << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
+                    SYLAR_LOG_EVERY_MS(g_logger, sylar::LogLevel::ERROR, 1000) << "epoll_ctl(" << m_epfd << ", "
+                                                                               << op << ", " << fd_ctx->fd << ", " << (EPOLL_EVENTS)event.events << "):"
+                                                                               << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
                     continue;
                 }
 
                 // 触发事件
                 if(real_events & READ) {
-                    fd_ctx->triggerEvent(READ);
-                    --m_pendingEventCount;
+                    fd_ctx->triggerEvent(READ, this, &batch);
+                    ++triggered;
                 }
                 if(real_events & WRITE) {
-                    fd_ctx->triggerEvent(WRITE);
-                    --m_pendingEventCount;
+                    fd_ctx->triggerEvent(WRITE, this, &batch);
+                    ++triggered;
                 }
             }
+            if (!batch.empty()) {
+                schedule(batch);    // 函数添加到调度器中
+            }
+            // 任务入队之后再减, stopping()不会在中间看到既没有事件也没有任务
+            m_pendingEventCount -= triggered;
 
             // 让出执行时间cpu
             Fiber::ptr cur = Fiber::GetThis();  // idle
@@ -392,7 +571,8 @@ namespace sylar {
     }
 
     void IOManager::onTimerInsertedAtFront() {
-        tickle();
+        // 只有epoll_wait的线程按定时器算超时时间
+        tickleEpoll();
     }
 
 }
@@ -60,8 +60,10 @@ namespace sylar {
             /**
              * @brief 触发事件
              * @param[in] event 事件类型
+             * @param[in] owner batch所属的调度器
+             * @param[in] batch 不为空时, 由owner执行的事件放进batch一起提交, 其他的直接调度
              */
-            void triggerEvent(Event event);
+            void triggerEvent(Event event, Scheduler* owner = nullptr, TaskBatch* batch = nullptr);
 
             /// 读事件上下文
             EventContext read;
@@ -127,6 +129,8 @@ namespace sylar {
 
     protected:
         void tickle() override; // 触发
+        void tickleWorker(size_t index) override;   // 只唤醒指定的调度线程
+        void tickleIdle(size_t count) override;     // 唤醒最多count个空闲线程
         bool stopping() override;   // 是否应该终止
         void idle() override;   // 
         void onTimerInsertedAtFront() override;
@@ -144,11 +148,64 @@ namespace sylar {
          */
         bool stopping(uint64_t& timeout);
 
+    private:
+        /**
+         * @brief 调度线程的唤醒eventfd
+         * @details 空闲线程同一时刻只有一个在epoll_wait上等IO事件(poller),
+         *          其他的压入空闲栈, 阻塞在自己的eventfd上, 这样可以精确唤醒某一个线程
+         */
+        struct Waker {
+            enum State {
+                RUNNING = 0,    // 在执行任务或者正准备休眠
+                PARKED = 1,     // 阻塞在自己的eventfd上
+                NOTIFIED = 2,   // 已经通知过, 还没醒
+                POLLING = 3,    // 阻塞在epoll_wait上
+            };
+            int fd = -1;
+            std::atomic<int> state = {RUNNING};
+        };
+
+        /**
+         * @brief 通知处于from状态的线程, PARKED写自己的eventfd, POLLING写m_tickleFd
+         * @return 线程不在from状态返回false
+         */
+        bool notify(Waker& waker, int from);
+
+        /**
+         * @brief 唤醒空闲栈顶的线程
+         * @return 没有休眠的线程返回false
+         */
+        bool wakeParked();
+
+        /**
+         * @brief 唤醒正在epoll_wait的线程
+         */
+        void tickleEpoll();
+
+        /**
+         * @brief 压入空闲栈, 阻塞在自己的eventfd上, 直到被唤醒或者超时
+         */
+        void park(Waker& waker, size_t index);
+
+        /**
+         * @brief 被唤醒的线程醒来后调用, 还有多余的任务就接着唤醒下一个
+         */
+        void onWakeUp();
+
     private:
         // epoll 文件句柄
         int m_epfd = 0;
-        // pipe 文件句柄
-        int m_tickleFds[2];
+        // eventfd 文件句柄, 用来唤醒epoll_wait
+        int m_tickleFd = -1;
+        // 每个调度线程的唤醒eventfd, 下标为getWorkerIndex()
+        std::vector<std::unique_ptr<Waker> > m_wakers;
+        // 休眠线程的下标, 后休眠的先唤醒(栈上的缓存还是热的)
+        Spinlock m_idleMutex;
+        std::vector<size_t> m_idleWorkers;
+        // 在epoll_wait的线程下标, 没有为-1
+        std::atomic<int> m_poller = {-1};
+        // 已经通知但还没醒来的线程数, 不为0时新任务不再唤醒别的线程, 由醒来的线程接力唤醒
+        std::atomic<size_t> m_waking = {0};
         // 当前等待执行的事件数量
         std::atomic<size_t> m_pendingEventCount = {0};
         /// IOManager的Mutex
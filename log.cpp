@@ -9,146 +9,131 @@
 #include <map>
 #include <time.h>
 #include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <unordered_map>
+#include <set>
+#include <algorithm>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <zlib.h>
 #include <yaml-cpp/yaml.h>
 
 namespace sylar {
 
-    class MessageFormatItem : public LogFormatter::FormatItem {
-    public:
-        MessageFormatItem(const std::string& str = "") {}
-        // 格式化日志到流
-        void format(std::ostream& os, std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << event->getContent();
-        }
-    };
-
-    class LevelFormatItem : public LogFormatter::FormatItem {
-    public:
-        LevelFormatItem(const std::string& str = "") {}
-        // 格式化日志到流
-        void format(std::ostream& os, std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << LogLevel::ToString(level);
-        }
-    };
-
-    class ElapseFormatItem : public LogFormatter::FormatItem {
-    public:
-        ElapseFormatItem(const std::string& str = "") {}
-        // 格式化日志到流
-        void format(std::ostream& os, std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << event->getElapse();
-        }
-    };
-
-    class NameFormatItem : public LogFormatter::FormatItem {
-    public:
-        NameFormatItem(const std::string& str = "") {}
-        // 格式化日志到流
-        void format(std::ostream& os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override {
-            if (event->getLogger())
-                os << event->getLogger()->getName();
-            else
-                os << logger->getName();
-        }
-    };
-
-    class ThreadIdFormatItem : public LogFormatter::FormatItem {
-    public:
-        ThreadIdFormatItem(const std::string& str = "") {}
-        // 格式化日志到流
-        void format(std::ostream& os, std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << event->getThreadId();
+    static const char s_digits[] =
+            "00010203040506070809"
+            "10111213141516171819"
+            "20212223242526272829"
+            "30313233343536373839"
+            "40414243444546474849"
+            "50515253545556575859"
+            "60616263646566676869"
+            "70717273747576777879"
+            "80818283848586878889"
+            "90919293949596979899";
+
+    // 整数转十进制文本追加到out, 每次处理两位
+    static void AppendUInt(std::string& out, uint64_t v)
+    {
+        char buf[24];
+        char* p = buf + sizeof(buf);
+        while (v >= 100)
+        {
+            unsigned idx = (v % 100) * 2;
+            v /= 100;
+            *--p = s_digits[idx + 1];
+            *--p = s_digits[idx];
         }
-    };
-
-    class FiberIdFormatItem : public LogFormatter::FormatItem {
-    public:
-        FiberIdFormatItem(const std::string& str = "") {}
-        // 格式化日志到流
-        void format(std::ostream& os, std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << event->getFiberId();
+        if (v < 10)
+        {
+            *--p = (char)('0' + v);
         }
-    };
-
-    class DateTimeFormatItem : public LogFormatter::FormatItem {
-    public:
-        DateTimeFormatItem(const std::string& format = "%Y-%m-%d %H:%M:%S")
-                :m_format(format) {
-            if(m_format.empty()) {
-                m_format = "%Y-%m-%d %H:%M:%S";
-            }
+        else
+        {
+            unsigned idx = v * 2;
+            *--p = s_digits[idx + 1];
+            *--p = s_digits[idx];
         }
+        out.append(p, buf + sizeof(buf) - p);
+    }
 
-        // 格式化日志到流
-        void format(std::ostream& os, std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event) override {
-            struct tm tm;
-            time_t time = event->getTime();
-            localtime_r(&time, &tm);
-            char buf[64];
-            strftime(buf, sizeof buf, m_format.c_str(), &tm);
-            os << buf;
+    static void AppendInt(std::string& out, int64_t v)
+    {
+        if (v < 0)
+        {
+            out.push_back('-');
+            AppendUInt(out, 0 - (uint64_t)v);
         }
-
-    private:
-        std::string m_format;
-    };
-
-    class FilenameFormatItem : public LogFormatter::FormatItem {
-    public:
-        FilenameFormatItem(const std::string& str = "") {}
-        // 格式化日志到流
-        void format(std::ostream& os, std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << event->getFile();
+        else
+        {
+            AppendUInt(out, v);
         }
-    };
+    }
 
-    class ThreadNameFormatItem : public LogFormatter::FormatItem {
-    public:
-        ThreadNameFormatItem(const std::string& str = "") {}
-        void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << event->getThreadName();
-        }
-    };
+    void LogMessageBuffer::clear()
+    {
+        m_overflow.clear();
+        m_spilled = false;
+        setp(m_inline, m_inline + INLINE_SIZE);
+    }
 
-    class LineFormatItem : public LogFormatter::FormatItem {
-    public:
-        LineFormatItem(const std::string& str = "") {}
-        // 格式化日志到流
-        void format(std::ostream& os, std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << event->getLine();
+    void LogMessageBuffer::spill()
+    {
+        if (!m_spilled)
+        {
+            m_overflow.append(pbase(), pptr() - pbase());
+            setp(nullptr, nullptr);     // 之后的写入都走overflow/xsputn
+            m_spilled = true;
         }
-    };
+    }
 
-    class NewLineFormatItem : public LogFormatter::FormatItem {
-    public:
-        NewLineFormatItem(const std::string& str = "") {}
-        // 格式化日志到流
-        void format(std::ostream& os, std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << std::endl;
+    LogMessageBuffer::int_type LogMessageBuffer::overflow(int_type c)
+    {
+        spill();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            m_overflow.push_back(traits_type::to_char_type(c));
         }
-    };
+        return traits_type::not_eof(c);
+    }
 
-    class StringFormatItem : public LogFormatter::FormatItem {
-    public:
-        StringFormatItem(const std::string& str) : FormatItem(str), m_string(str){ }
-        // 格式化日志到流
-        void format(std::ostream& os, std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << m_string;
+    std::streamsize LogMessageBuffer::xsputn(const char* str, std::streamsize len)
+    {
+        if (!m_spilled)
+        {
+            if (epptr() - pptr() >= len)
+            {
+                memcpy(pptr(), str, len);
+                pbump((int)len);
+                return len;
+            }
+            spill();
         }
+        m_overflow.append(str, len);
+        return len;
+    }
 
-    private:
-        std::string m_string;
-    };
-
-    class TabFormatItem : public LogFormatter::FormatItem {
-    public:
-        TabFormatItem(const std::string& str = "") {}
-        void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << "\t";
-        }
-    };
+    static const std::string s_empty_thread_name;
 
+    void LogEvent::renderLazy() const
+    {
+        // 内容缓冲只在产生日志的线程内使用, 读取时补上延迟的格式化
+        LogEvent* self = const_cast<LogEvent*>(this);
+        auto cb = m_lazyRender;
+        self->m_lazyRender = nullptr;
+        cb(self);
+    }
 
+    LogEvent::LogEvent()
+            :m_threadName(&s_empty_thread_name)
+            ,m_ss(&m_buf)
+            ,m_level(LogLevel::UNKNOW) {
+    }
 
     LogEvent::LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level
             ,const char* file, int32_t line, uint32_t elapse
@@ -160,7 +145,9 @@ namespace sylar {
             ,m_threadId(thread_id)
             ,m_fiberId(fiber_id)
             ,m_time(time)
-            ,m_threadName(thread_name)
+            ,m_threadName(&m_threadNameStorage)
+            ,m_threadNameStorage(thread_name)
+            ,m_ss(&m_buf)
             ,m_logger(logger)
             ,m_level(level) {
     }
@@ -174,6 +161,9 @@ namespace sylar {
             ,m_threadId(thread_id)
             ,m_fiberId(fiber_id)
             ,m_time(time)
+            ,m_threadName(&s_empty_thread_name)
+            ,m_ss(&m_buf)
+            ,m_level(LogLevel::UNKNOW)
             {
     }
 
@@ -186,10 +176,121 @@ namespace sylar {
             ,m_threadId(thread_id)
             ,m_fiberId(fiber_id)
             ,m_time(time)
+            ,m_threadName(&s_empty_thread_name)
+            ,m_ss(&m_buf)
             ,m_logger(logger)
             ,m_level(level) {
     }
 
+    void LogEvent::reset(std::shared_ptr<Logger> logger, LogLevel::Level level
+            ,const char* file, int32_t line, uint32_t elapse
+            ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+            ,const std::string& thread_name)
+    {
+        m_file = file;
+        m_line = line;
+        m_elapse = elapse;
+        m_threadId = thread_id;
+        m_fiberId = fiber_id;
+        m_time = time;
+        m_threadName = &thread_name;
+        m_logger.swap(logger);
+        m_level = level;
+
+        m_buf.clear();
+        m_lazyRender = nullptr;
+        m_lazyStrings.clear();
+        // 上一次使用者可能修改过流的状态(std::hex等), 恢复默认值
+        m_ss.clear();
+        m_ss.flags(std::ios_base::dec | std::ios_base::skipws);
+        m_ss.precision(6);
+        m_ss.width(0);
+        m_ss.fill(' ');
+    }
+
+    bool LogFormatSite::CheckLazyStrings(const char* fmt, uint64_t strings)
+    {
+        size_t arg = 0;     // 下一个转换说明使用的参数序号
+        auto is_string = [strings](size_t i) {
+            return i < 64 && ((strings >> i) & 1);
+        };
+        for (const char* p = fmt; *p; ++p)
+        {
+            if (*p != '%')
+            {
+                continue;
+            }
+            ++p;
+            if (*p == '%')
+            {
+                continue;
+            }
+            while (*p && strchr("-+ #0'I", *p))
+            {
+                ++p;
+            }
+            // 宽度, *从参数取
+            if (*p == '*')
+            {
+                if (is_string(arg++))
+                {
+                    return false;
+                }
+                ++p;
+            }
+            while (isdigit((unsigned char)*p))
+            {
+                ++p;
+            }
+            if (*p == '$')
+            {
+                // %n$按位置取参数, 不解析
+                return false;
+            }
+            // 精度, 有精度的%s不一定读到字符串结尾
+            bool precision = false;
+            if (*p == '.')
+            {
+                precision = true;
+                ++p;
+                if (*p == '*')
+                {
+                    if (is_string(arg++))
+                    {
+                        return false;
+                    }
+                    ++p;
+                }
+                while (isdigit((unsigned char)*p))
+                {
+                    ++p;
+                }
+            }
+            bool length = false;
+            while (*p && strchr("hlLqjzt", *p))
+            {
+                length = true;
+                ++p;
+            }
+            if (!*p)
+            {
+                break;
+            }
+            if (*p == 'm')
+            {
+                // %m输出strerror(errno), 不使用参数
+                continue;
+            }
+            if (is_string(arg) && (*p != 's' || precision || length))
+            {
+                return false;
+            }
+            ++arg;
+        }
+        // 没有转换说明使用的C字符串原来的printf不会读, 也不能strlen
+        return arg >= 64 || (strings >> arg) == 0;
+    }
+
     // https://www.cnblogs.com/yongssu/p/4677556.html
     void LogEvent::format(const char* fmt, ...) {
         va_list al;
@@ -200,26 +301,118 @@ namespace sylar {
 
     void LogEvent::format(const char* fmt, va_list al)
     {
+        render();
+        // 先尝试格式化到栈上, 放不下时才分配内存
+        char stack_buf[512];
+        va_list al2;
+        va_copy(al2, al);
+        int len = vsnprintf(stack_buf, sizeof(stack_buf), fmt, al2);
+        va_end(al2);
+        if (len < 0)
+        {
+            return;
+        }
+        if ((size_t)len < sizeof(stack_buf))
+        {
+            m_buf.append(stack_buf, len);
+            return;
+        }
+
         char* buf = nullptr;
-        int len = vasprintf(&buf, fmt, al);
+        len = vasprintf(&buf, fmt, al);
         if (len != -1)
         {
-            m_ss << std::string(buf, len);
+            m_buf.append(buf, len);
             free(buf);
         }
     }
 
+    // 线程本地的LogEvent对象池, 日志宏展开时从这里取事件, 避免每条日志都分配内存
+    // 用池而不是单个对象, 是因为输出日志的过程中可能再次输出日志(嵌套)
+    class LogEventPool {
+    public:
+        static const size_t MAX_FREE = 16;
+
+        ~LogEventPool()
+        {
+            for (auto i : m_free)
+            {
+                delete i;
+            }
+            m_free.clear();
+            s_dead = true;
+        }
+
+        LogEvent* acquire()
+        {
+            if (m_free.empty())
+            {
+                return new LogEvent();
+            }
+            LogEvent* e = m_free.back();
+            m_free.pop_back();
+            return e;
+        }
+
+        void release(LogEvent* e)
+        {
+            e->m_logger.reset();
+            if (m_free.size() >= MAX_FREE)
+            {
+                delete e;
+                return;
+            }
+            if (m_free.capacity() < MAX_FREE)
+            {
+                m_free.reserve(MAX_FREE);
+            }
+            m_free.push_back(e);
+        }
+
+        // 线程退出过程中池已经析构, 之后的日志直接new/delete
+        static thread_local bool s_dead;
+    private:
+        std::vector<LogEvent*> m_free;
+    };
+
+    thread_local bool LogEventPool::s_dead = false;
+    static thread_local LogEventPool t_event_pool;
+
     LogEventWrap::LogEventWrap(LogEvent::ptr e)
         : m_event(e)
     {
 
     }
+
+    LogEventWrap::LogEventWrap(std::shared_ptr<Logger> logger, LogLevel::Level level
+            ,const char* file, int32_t line, uint32_t elapse
+            ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+            ,const std::string& thread_name)
+    {
+        m_pooled = LogEventPool::s_dead ? new LogEvent() : t_event_pool.acquire();
+        m_pooled->reset(logger, level, file, line, elapse, thread_id, fiber_id, time, thread_name);
+        // 不持有所有权的shared_ptr(没有控制块), 生命周期由本对象管理
+        m_event = LogEvent::ptr(LogEvent::ptr(), m_pooled);
+    }
+
     LogEventWrap::~LogEventWrap()
     {
         m_event->getLogger()->log(m_event->getLevel(), m_event);    // 重点
+        if (m_pooled)
+        {
+            m_event.reset();
+            if (LogEventPool::s_dead)
+            {
+                delete m_pooled;
+            }
+            else
+            {
+                t_event_pool.release(m_pooled);
+            }
+        }
     }
 
-    std::stringstream& LogEventWrap::getSS()
+    std::ostream& LogEventWrap::getSS()
     {
         return m_event->getSS();
     }
@@ -266,8 +459,10 @@ namespace sylar {
 #undef XX
     }
 
+    std::atomic<uint64_t> Logger::s_levelVersion = {1};
+
     Logger::Logger(const std::string &name)
-            : m_name(name), m_level(LogLevel::DEBUG){
+            : m_name(name), m_level(LogLevel::DEBUG), m_appenders(new AppenderList){
         //m_formatter.reset(new LogFormatter("%d  [%p] %f %l %n"));
         m_formatter.reset(new LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"));
         // %m 输出代码中指定的消息
@@ -280,23 +475,71 @@ namespace sylar {
         // %l 输出日志事件的发生位置，包括类目名、发生的线程，以及在代码中的行数。举例：Testlog4.main(TestLog4.java:10)
     }
 
-    void Logger::log(LogLevel::Level level, LogEvent::ptr event) {
-        if (level >= m_level) {
-            auto self = shared_from_this();
-            MutexType::Lock lock(m_mutex);
-            if (!m_appenders.empty())
+    void Logger::log(LogLevel::Level level, const LogEvent::ptr& event) {
+        if (level >= getLevel()) {
             {
-                for (auto &i : m_appenders) {   // 分别输出到各个日志输出地
-                    i->log(self, level, event);
+                RCUPointer<AppenderList>::ReadGuard appenders(m_appenders);
+                if (!appenders->empty())
+                {
+                    // 事件一般就是由本日志器产生的, 直接复用它持有的指针, 避免每次shared_from_this
+                    const Logger::ptr* self = &event->getLogger();
+                    Logger::ptr holder;
+                    if (self->get() != this)
+                    {
+                        holder = shared_from_this();
+                        self = &holder;
+                    }
+                    for (auto &i : *appenders) {   // 分别输出到各个日志输出地
+                        i->log(*self, level, event);
+                    }
+                    return;
                 }
             }
-            else if (m_root)
+            if (m_root)
             {
                 m_root->log(level, event);  // 输出目的地是LogManager构造函数中的 stdout
             }
         }
     }
 
+    void LogAppender::setLevel(LogLevel::Level val)
+    {
+        m_level = val;
+        Logger::InvalidateEffectiveLevel();
+    }
+
+    void Logger::setLevel(LogLevel::Level val)
+    {
+        m_level.store(val, std::memory_order_relaxed);
+        InvalidateEffectiveLevel();
+    }
+
+    LogLevel::Level Logger::updateEffectiveLevel()
+    {
+        // 先取版本号再计算, 计算期间再有变化时下次调用会重新计算
+        uint64_t version = s_levelVersion.load(std::memory_order_acquire);
+        LogLevel::Level level = getLevel();
+        {
+            RCUPointer<AppenderList>::ReadGuard appenders(m_appenders);
+            if (!appenders->empty())
+            {
+                LogLevel::Level min_level = appenders->front()->getLevel();
+                for (auto& i : *appenders)
+                {
+                    min_level = std::min(min_level, i->getLevel());
+                }
+                level = std::max(level, min_level);
+            }
+            else if (m_root && m_root.get() != this)
+            {
+                level = std::max(level, m_root->getEffectiveLevel());
+            }
+        }
+        m_effectiveLevel.store(level, std::memory_order_relaxed);
+        m_levelVersion.store(version, std::memory_order_release);
+        return level;
+    }
+
     void Logger::debug(LogEvent::ptr event)
     {
         log(LogLevel::DEBUG, event);
@@ -313,112 +556,1239 @@ namespace sylar {
     {
         log(LogLevel::ERROR, event);
     }
-    void Logger::fatal(LogEvent::ptr event)
+    void Logger::fatal(LogEvent::ptr event)
+    {
+        log(LogLevel::FATAL, event);
+    }
+
+    void Logger::addAppender(LogAppender::ptr appender)
+    {
+        MutexType::Lock lock(m_mutex);
+        if (!appender->getFormatter())
+        {
+            MutexType::Lock ll(appender->m_mutex);
+            // appender->setFormatter(m_formatter);
+            appender->m_formatter = m_formatter;    // 因为这个不是appender自己设置的，所以LogAppender::m_hasFormatter不能设置为true
+        }
+        AppenderList* list = new AppenderList(*m_appenders.unsafeGet());
+        list->push_back(appender);
+        m_appenders.update(list);
+        InvalidateEffectiveLevel();
+    }
+    void Logger::delAppender(LogAppender::ptr appender)
+    {
+        MutexType::Lock lock(m_mutex);
+        const AppenderList* cur = m_appenders.unsafeGet();
+        for (auto it = cur->begin(); it != cur->end(); ++it)
+        {
+            if (*it == appender)
+            {
+                AppenderList* list = new AppenderList(*cur);
+                list->erase(list->begin() + (it - cur->begin()));
+                m_appenders.update(list);
+                InvalidateEffectiveLevel();
+                break;
+            }
+        }
+    }
+
+    void Logger::clearAppenders()
+    {
+        MutexType::Lock lock(m_mutex);
+        m_appenders.update(new AppenderList);
+        InvalidateEffectiveLevel();
+    }
+
+    void Logger::setFormatter(LogFormatter::ptr val)
+    {
+        MutexType::Lock lock(m_mutex);
+        m_formatter = val;
+
+        for (auto& i : *m_appenders.unsafeGet())
+        {
+            MutexType::Lock ll(i->m_mutex);
+            if (!i->m_hasFormatter)
+            {
+                i->m_formatter = m_formatter;
+            }
+        }
+    }
+
+    void Logger::setFormatter(const std::string& val)
+    {
+        std::cout << "---" << val << std::endl;
+        sylar::LogFormatter::ptr new_val(new sylar::LogFormatter(val));
+        if (new_val->isError())
+        {
+            std::cout << "Logger setFormatter name=" << m_name
+                      << " value=" << val << " invalid formatter"
+                      << std::endl;
+            return;
+        }
+        setFormatter(new_val);
+    }
+
+    std::string Logger::toYamlString()
+    {
+        MutexType::Lock lock(m_mutex);
+        YAML::Node node;
+        node["name"] = m_name;
+        if (getLevel() != LogLevel::UNKNOW)
+        {
+            node["level"] = LogLevel::ToString(getLevel());
+        }
+        if (m_formatter)
+        {
+            node["formatter"] = m_formatter->getPattern();
+        }
+
+        for(auto& i : *m_appenders.unsafeGet()) {
+            node["appenders"].push_back(YAML::Load(i->toYamlString()));
+        }
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+    LogFormatter::ptr Logger::getFormatter()
+    {
+        MutexType::Lock lock(m_mutex);
+        return m_formatter;
+    }
+
+
+    void StdoutLogAppender::log(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) {
+        if (level >= m_level)
+        {
+            static thread_local std::string t_buf;
+            t_buf.clear();
+            MutexType::Lock lock(m_mutex);
+            m_formatter->format(t_buf, logger, level, event);
+            std::cout.write(t_buf.data(), t_buf.size());
+        }
+    }
+
+    std::string StdoutLogAppender::toYamlString()
+    {
+        MutexType::Lock lock(m_mutex);
+        YAML::Node node;
+        node["type"] = "StdoutLogAppender";
+        if(m_level != LogLevel::UNKNOW) {
+            node["level"] = LogLevel::ToString(m_level);
+        }
+        if(m_hasFormatter && m_formatter) {
+            node["formatter"] = m_formatter->getPattern();
+        }
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+    const char* LogRotateConfig::IntervalToString(Interval v)
+    {
+        switch (v)
+        {
+            case HOUR:
+                return "hour";
+            case DAY:
+                return "day";
+            default:
+                return "none";
+        }
+    }
+
+    LogRotateConfig::Interval LogRotateConfig::IntervalFromString(const std::string& str)
+    {
+        if (str == "hour" || str == "HOUR")
+        {
+            return HOUR;
+        }
+        if (str == "day" || str == "DAY")
+        {
+            return DAY;
+        }
+        return NONE;
+    }
+
+    // 下一个整点/零点(本地时间)
+    static uint64_t NextRotateTime(LogRotateConfig::Interval interval, uint64_t now)
+    {
+        if (interval == LogRotateConfig::NONE)
+        {
+            return 0;
+        }
+        time_t t = now;
+        struct tm tm;
+        localtime_r(&t, &tm);
+        tm.tm_min = 0;
+        tm.tm_sec = 0;
+        if (interval == LogRotateConfig::HOUR)
+        {
+            tm.tm_hour += 1;
+        }
+        else
+        {
+            tm.tm_hour = 0;
+            tm.tm_mday += 1;
+        }
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+    }
+
+    static void RotateToYaml(YAML::Node& node, const LogRotateConfig& conf)
+    {
+        if (conf.max_size)
+        {
+            node["max_size"] = conf.max_size;
+        }
+        if (conf.interval != LogRotateConfig::NONE)
+        {
+            node["rotate"] = LogRotateConfig::IntervalToString(conf.interval);
+        }
+        if (conf.max_files)
+        {
+            node["max_files"] = conf.max_files;
+        }
+        if (conf.compress)
+        {
+            node["compress"] = true;
+        }
+    }
+
+    // 把历史文件压缩为 path.gz, 成功后删除原文件
+    static bool CompressFile(const std::string& path)
+    {
+        std::ifstream ifs(path, std::ios::in | std::ios::binary);
+        if (!ifs)
+        {
+            return false;
+        }
+        std::string gz = path + ".gz";
+        gzFile out = gzopen(gz.c_str(), "wb");
+        if (!out)
+        {
+            return false;
+        }
+        char buf[64 * 1024];
+        bool ok = true;
+        while (ifs)
+        {
+            ifs.read(buf, sizeof(buf));
+            if (ifs.gcount() > 0 && gzwrite(out, buf, ifs.gcount()) != ifs.gcount())
+            {
+                ok = false;
+                break;
+            }
+        }
+        if (gzclose(out) != Z_OK)
+        {
+            ok = false;
+        }
+        if (!ok)
+        {
+            unlink(gz.c_str());
+            return false;
+        }
+        unlink(path.c_str());
+        return true;
+    }
+
+    // 只保留最新的max_files个历史文件
+    static void RemoveOldFiles(const std::string& filename, uint32_t max_files)
+    {
+        std::string dir = ".";
+        std::string base = filename;
+        size_t pos = filename.rfind('/');
+        if (pos != std::string::npos)
+        {
+            dir = pos ? filename.substr(0, pos) : "/";
+            base = filename.substr(pos + 1);
+        }
+        base.push_back('.');
+
+        DIR* d = opendir(dir.c_str());
+        if (!d)
+        {
+            return;
+        }
+        std::vector<std::string> files;
+        while (struct dirent* e = readdir(d))
+        {
+            // 历史文件: 文件名.YYYYmmdd-HHMMSS...
+            if (strncmp(e->d_name, base.c_str(), base.size()) == 0
+                && isdigit((unsigned char)e->d_name[base.size()]))
+            {
+                files.push_back(e->d_name);
+            }
+        }
+        closedir(d);
+        if (files.size() <= max_files)
+        {
+            return;
+        }
+        // 时间戳定长, 按名字排序即按时间排序
+        std::sort(files.begin(), files.end());
+        for (size_t i = 0; i < files.size() - max_files; ++i)
+        {
+            unlink((dir + "/" + files[i]).c_str());
+        }
+    }
+
+    /**
+     * @brief 文件日志的后台维护线程
+     * @details 所有FileLogAppender构造时注册, 析构时注销. 线程每秒检查一次, 或者在写日志线程
+     *          发现达到滚动条件时被唤醒. 进程内只有一个, 不析构, 避免与日志器的析构顺序冲突
+     */
+    class LogRotator {
+    public:
+        static LogRotator* GetInstance()
+        {
+            static LogRotator* s_rotator = new LogRotator;
+            return s_rotator;
+        }
+
+        void add(FileLogAppender* appender)
+        {
+            Mutex::Lock lock(m_mutex);
+            m_appenders.insert(appender);
+            if (!m_thread)
+            {
+                m_thread.reset(new Thread(std::bind(&LogRotator::run, this), "log_rotate"));
+            }
+        }
+
+        // 返回后后台线程不会再访问该appender
+        void del(FileLogAppender* appender)
+        {
+            Mutex::Lock lock(m_mutex);
+            m_appenders.erase(appender);
+        }
+
+        void notify()
+        {
+            {
+                Mutex::Lock lock(m_condMutex);
+                m_notified = true;
+            }
+            m_cond.notify_one();
+        }
+    private:
+        // 一次滚动之后的善后工作
+        struct Job {
+            std::string filename;   // 日志文件
+            std::string rotated;    // 滚动产生的历史文件
+            LogRotateConfig conf;
+        };
+
+        void run()
+        {
+            while (true)
+            {
+                {
+                    Mutex::Lock lock(m_condMutex);
+                    if (!m_notified)
+                    {
+                        m_cond.wait_for(lock, std::chrono::seconds(1));
+                    }
+                    m_notified = false;
+                }
+
+                std::vector<Job> jobs;
+                {
+                    Mutex::Lock lock(m_mutex);
+                    uint64_t now = time(0);
+                    std::vector<std::string> rotated;
+                    for (auto i : m_appenders)
+                    {
+                        rotated.clear();
+                        i->checkRotate(now, rotated);
+                        if (rotated.empty())
+                        {
+                            continue;
+                        }
+                        LogRotateConfig conf = i->getRotateConfig();
+                        for (auto& r : rotated)
+                        {
+                            jobs.push_back({i->m_filename, r, conf});
+                        }
+                    }
+                }
+
+                // 压缩和清理不再访问appender, 在锁外完成, 不影响appender析构
+                for (auto& j : jobs)
+                {
+                    if (j.conf.compress && !CompressFile(j.rotated))
+                    {
+                        std::cout << "LogRotator compress error file=" << j.rotated << std::endl;
+                    }
+                    if (j.conf.max_files)
+                    {
+                        RemoveOldFiles(j.filename, j.conf.max_files);
+                    }
+                }
+            }
+        }
+    private:
+        Mutex m_mutex;                              // 保护m_appenders, 检查期间持有
+        std::set<FileLogAppender*> m_appenders;
+        Mutex m_condMutex;
+        std::condition_variable_any m_cond;
+        bool m_notified = false;
+        Thread::ptr m_thread;
+    };
+
+    FileLogAppender::FileLogAppender(const std::string& filename) : m_filename(filename) {
+        switchFile(time(0));
+        LogRotator::GetInstance()->add(this);
+    }
+
+    FileLogAppender::FileLogAppender(const std::string& filename, std::ios::openmode mode)
+        : m_filename(filename)
+        , m_openMode(mode) {
+        switchFile(time(0));
+        LogRotator::GetInstance()->add(this);
+    }
+
+    FileLogAppender::~FileLogAppender() {
+        LogRotator::GetInstance()->del(this);
+    }
+
+    void FileLogAppender::log(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) {
+        if (level >= m_level)
+        {
+            // 格式化放在锁外
+            static thread_local std::string t_msg;
+            t_msg.clear();
+            LogFormatter::ptr formatter = getFormatter();
+            formatter->format(t_msg, logger, level, event);
+
+            MutexType::Lock lock(m_mutex);
+            writeLocked(t_msg.data(), t_msg.size(), event->getTime());
+            // 同原来std::endl一样逐行刷新; 格式里没有%n时ERROR以上也要刷新, 崩溃前的日志不能留在缓冲里
+            if (formatter->hasNewLine() || level >= LogLevel::ERROR)
+            {
+                m_filestream.flush();
+            }
+        }
+    }
+
+    void FileLogAppender::writeLocked(const char* data, size_t len, uint64_t now) {
+        m_filestream.write(data, len);
+        m_size += len;
+        if (((m_rotate.max_size && m_size >= m_rotate.max_size)
+                || (m_nextRotate && now >= m_nextRotate))
+            && !m_rotatePending.load(std::memory_order_relaxed)
+            && !m_rotatePending.exchange(true)) {
+            // 只通知, 滚动由后台线程完成
+            LogRotator::GetInstance()->notify();
+        }
+    }
+
+    // 重新打开日志文件
+    bool FileLogAppender::reopen() {
+        return switchFile(time(0));
+    }
+
+    bool FileLogAppender::switchFile(uint64_t now) {
+        std::ofstream ofs(m_filename, m_openMode);
+        if (!ofs)
+        {
+            // 保留原来的文件流, 后台线程下一次检查时重试
+            return false;
+        }
+        struct stat st;
+        uint64_t size = 0;
+        uint64_t inode = 0;
+        if (stat(m_filename.c_str(), &st) == 0)
+        {
+            size = st.st_size;
+            inode = st.st_ino;
+        }
+        {
+            MutexType::Lock lock(m_mutex);
+            m_filestream.swap(ofs);
+            m_size = size;
+            m_inode = inode;
+            m_nextRotate = NextRotateTime(m_rotate.interval, now);
+            ++m_fileGen;
+        }
+        ofs.close();    // 旧文件在锁外关闭
+        return true;
+    }
+
+    void FileLogAppender::checkRotate(uint64_t now, std::vector<std::string>& rotated) {
+        m_rotatePending = false;
+        uint64_t size = 0;
+        uint64_t next = 0;
+        uint64_t inode = 0;
+        uint64_t max_size = 0;
+        {
+            MutexType::Lock lock(m_mutex);
+            size = m_size;
+            next = m_nextRotate;
+            inode = m_inode;
+            max_size = m_rotate.max_size;
+        }
+
+        bool timeout = next && now >= next;
+        if (size && ((max_size && size >= max_size) || timeout))
+        {
+            // 先改名再打开新文件, 改名期间的写入仍然落在旧文件里
+            char ts[32];
+            time_t t = now;
+            struct tm tm;
+            localtime_r(&t, &tm);
+            strftime(ts, sizeof(ts), "%Y%m%d-%H%M%S", &tm);
+            std::string base = m_filename + "." + ts;
+            std::string target = base;
+            for (int n = 1; access(target.c_str(), F_OK) == 0
+                    || access((target + ".gz").c_str(), F_OK) == 0; ++n)
+            {
+                target = base + "." + std::to_string(n);
+            }
+            if (rename(m_filename.c_str(), target.c_str()) == 0)
+            {
+                rotated.push_back(target);
+            }
+            else
+            {
+                std::cout << "FileLogAppender rotate error file=" << m_filename
+                          << " errno=" << errno << " errstr=" << strerror(errno) << std::endl;
+            }
+            switchFile(now);
+            return;
+        }
+
+        if (timeout)
+        {
+            // 整个周期都没有日志, 不产生空的历史文件
+            MutexType::Lock lock(m_mutex);
+            m_nextRotate = NextRotateTime(m_rotate.interval, now);
+        }
+
+        // 日志文件被删除或替换之后重新打开
+        struct stat st;
+        if (stat(m_filename.c_str(), &st) != 0 || (uint64_t)st.st_ino != inode)
+        {
+            switchFile(now);
+        }
+    }
+
+    void FileLogAppender::setRotateConfig(const LogRotateConfig& conf) {
+        MutexType::Lock lock(m_mutex);
+        m_rotate = conf;
+        m_nextRotate = NextRotateTime(conf.interval, time(0));
+    }
+
+    LogRotateConfig FileLogAppender::getRotateConfig() {
+        MutexType::Lock lock(m_mutex);
+        return m_rotate;
+    }
+
+    std::string FileLogAppender::toYamlString()
+    {
+        MutexType::Lock lock(m_mutex);
+        YAML::Node node;
+        node["type"] = "FileLogAppender";
+        node["file"] = m_filename;
+        RotateToYaml(node, m_rotate);
+        if(m_level != LogLevel::UNKNOW) {
+            node["level"] = LogLevel::ToString(m_level);
+        }
+        if(m_hasFormatter && m_formatter) {
+            node["formatter"] = m_formatter->getPattern();
+        }
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+    AsyncFileLogAppender::AsyncFileLogAppender(const std::string& filename
+                                              ,size_t buffer_size
+                                              ,size_t max_buffers
+                                              ,uint32_t flush_interval
+                                              ,OverflowPolicy policy)
+        : FileLogAppender(filename)
+        , m_bufferSize(buffer_size ? buffer_size : 4096)
+        , m_maxBuffers(max_buffers < 2 ? 2 : max_buffers)
+        , m_flushInterval(flush_interval ? flush_interval : 1000)
+        , m_policy(policy)
+    {
+        m_current.reserve(m_bufferSize);
+        m_thread.reset(new Thread(std::bind(&AsyncFileLogAppender::flushThread, this), "log_flush"));
+    }
+
+    AsyncFileLogAppender::~AsyncFileLogAppender()
+    {
+        {
+            BufferMutexType::Lock lock(m_bufMutex);
+            m_running = false;
+        }
+        m_cond.notify_one();
+        m_thread->join();   // 刷盘线程退出前会把剩余日志全部写入
+    }
+
+    void AsyncFileLogAppender::log(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event)
+    {
+        if (level < m_level)
+        {
+            return;
+        }
+        // 格式化放在锁外, 业务线程之间只竞争一次内存拷贝
+        static thread_local std::string t_msg;
+        t_msg.clear();
+        getFormatter()->format(t_msg, logger, level, event);
+        const std::string& msg = t_msg;
+
+        BufferMutexType::Lock lock(m_bufMutex);
+        if (m_current.size() + msg.size() > m_bufferSize && !m_current.empty())
+        {
+            // 当前缓冲 + 待刷盘缓冲 + 正在刷盘的缓冲 不能超过上限
+            while (m_full.size() + m_flushing + 1 >= m_maxBuffers)
+            {
+                if (m_policy == DROP || !m_running)
+                {
+                    ++m_dropped;
+                    return;
+                }
+                m_cond.notify_one();
+                m_notFull.wait(lock);
+            }
+            m_full.push_back(std::move(m_current));
+            nextBuffer();
+            m_cond.notify_one();
+        }
+        m_current.append(msg);
+
+        if (level >= LogLevel::FATAL)
+        {
+            // FATAL 之后进程很可能退出, 同步落盘
+            lock.unlock();
+            flush();
+        }
+    }
+
+    void AsyncFileLogAppender::nextBuffer()
+    {
+        if (!m_spare.empty())
+        {
+            m_current.swap(m_spare.back());
+            m_spare.pop_back();
+        }
+        else
+        {
+            m_current = std::string();
+            m_current.reserve(m_bufferSize);
+        }
+    }
+
+    void AsyncFileLogAppender::flush()
+    {
+        drain();
+    }
+
+    void AsyncFileLogAppender::drain()
+    {
+        BufferMutexType::Lock wlock(m_writeMutex);
+        std::vector<std::string> bufs;
+        {
+            BufferMutexType::Lock lock(m_bufMutex);
+            if (!m_current.empty())
+            {
+                m_full.push_back(std::move(m_current));
+                nextBuffer();
+            }
+            bufs.swap(m_full);
+            m_flushing = bufs.size();
+        }
+        if (bufs.empty())
+        {
+            return;
+        }
+
+        {
+            uint64_t now = time(0);
+            MutexType::Lock lock(m_mutex);
+            for (auto& i : bufs)
+            {
+                writeLocked(i.data(), i.size(), now);
+            }
+            m_filestream.flush();
+            if (!m_filestream)
+            {
+                std::cout << "AsyncFileLogAppender write error file=" << m_filename << std::endl;
+            }
+        }
+
+        BufferMutexType::Lock lock(m_bufMutex);
+        m_flushing = 0;
+        for (auto& i : bufs)
+        {
+            if (m_spare.size() + 1 >= m_maxBuffers)
+            {
+                break;
+            }
+            i.clear();
+            m_spare.push_back(std::move(i));
+        }
+        m_notFull.notify_all();
+    }
+
+    void AsyncFileLogAppender::flushThread()
+    {
+        while (true)
+        {
+            bool running = true;
+            {
+                BufferMutexType::Lock lock(m_bufMutex);
+                if (m_full.empty() && m_running)
+                {
+                    m_cond.wait_for(lock, std::chrono::milliseconds(m_flushInterval));
+                }
+                running = m_running;
+            }
+
+            drain();
+
+            if (!running)
+            {
+                break;
+            }
+        }
+    }
+
+    std::string AsyncFileLogAppender::toYamlString()
+    {
+        MutexType::Lock lock(m_mutex);
+        YAML::Node node;
+        node["type"] = "FileLogAppender";
+        node["file"] = m_filename;
+        RotateToYaml(node, m_rotate);
+        node["async"] = true;
+        node["buffer_size"] = m_bufferSize;
+        node["max_buffers"] = m_maxBuffers;
+        node["flush_interval"] = m_flushInterval;
+        node["overflow"] = PolicyToString(m_policy);
+        if(m_level != LogLevel::UNKNOW) {
+            node["level"] = LogLevel::ToString(m_level);
+        }
+        if(m_hasFormatter && m_formatter) {
+            node["formatter"] = m_formatter->getPattern();
+        }
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+    const char* AsyncFileLogAppender::PolicyToString(OverflowPolicy policy)
+    {
+        return policy == DROP ? "drop" : "block";
+    }
+
+    AsyncFileLogAppender::OverflowPolicy AsyncFileLogAppender::PolicyFromString(const std::string& str)
+    {
+        if (str == "drop" || str == "DROP")
+        {
+            return DROP;
+        }
+        return BLOCK;
+    }
+
+    LogRateLimiter::Ticket LogRateLimiter::pass()
+    {
+        return Ticket(true, m_suppressed.exchange(0, std::memory_order_relaxed));
+    }
+
+    LogRateLimiter::Ticket LogRateLimiter::everyN(uint64_t n)
+    {
+        if (m_count.fetch_add(1, std::memory_order_relaxed) % (n ? n : 1) == 0)
+        {
+            return pass();
+        }
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return Ticket(false, 0);
+    }
+
+    LogRateLimiter::Ticket LogRateLimiter::everyMs(uint64_t ms)
+    {
+        // 粗粒度时钟只读vdso中的变量, 日志风暴时每次调用的开销只有几纳秒
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        uint64_t now = ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+        uint64_t last = m_last.load(std::memory_order_relaxed);
+        if ((last == 0 || now - last >= ms)
+            && m_last.compare_exchange_strong(last, now, std::memory_order_relaxed))
+        {
+            return pass();
+        }
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return Ticket(false, 0);
+    }
+
+    LogEvent::ptr LogRateLimiter::Ticket::apply(LogEvent::ptr event) const
+    {
+        event->getSS() << *this;
+        return event;
+    }
+
+    std::ostream& operator<<(std::ostream& os, const LogRateLimiter::Ticket& ticket)
+    {
+        if (ticket.getSuppressed())
+        {
+            os << "[suppressed " << ticket.getSuppressed() << "] ";
+        }
+        return os;
+    }
+
+    namespace {
+        struct CallSiteKey {
+            const char* file;
+            int32_t line;
+            bool operator==(const CallSiteKey& oth) const {
+                return file == oth.file && line == oth.line;
+            }
+        };
+
+        struct CallSiteKeyHash {
+            size_t operator()(const CallSiteKey& k) const {
+                return std::hash<const void*>()(k.file) ^ ((size_t)k.line * 0x9e3779b97f4a7c15ULL);
+            }
+        };
+
+        struct CallSiteStore {
+            Mutex mutex;
+            std::vector<std::pair<const char*, int32_t> > sites;
+            std::map<std::pair<std::string, int32_t>, uint32_t> ids;
+        };
+
+        CallSiteStore& GetCallSiteStore() {
+            static CallSiteStore s_store;
+            return s_store;
+        }
+    }
+
+    static thread_local std::unordered_map<CallSiteKey, uint32_t, CallSiteKeyHash> t_site_cache;
+
+    uint32_t LogCallSiteRegistry::GetId(const char* file, int32_t line)
+    {
+        CallSiteKey key{file, line};
+        auto it = t_site_cache.find(key);
+        if (it != t_site_cache.end())
+        {
+            return it->second;
+        }
+        // 同一个文件在不同编译单元里__FILE__地址可能不同, 全局表按内容去重
+        CallSiteStore& store = GetCallSiteStore();
+        uint32_t id = 0;
+        {
+            Mutex::Lock lock(store.mutex);
+            auto r = store.ids.insert(std::make_pair(std::make_pair(std::string(file), line)
+                                                    , (uint32_t)store.sites.size()));
+            if (r.second)
+            {
+                store.sites.push_back(std::make_pair(file, line));
+            }
+            id = r.first->second;
+        }
+        t_site_cache[key] = id;
+        return id;
+    }
+
+    bool LogCallSiteRegistry::Get(uint32_t id, const char*& file, int32_t& line)
+    {
+        CallSiteStore& store = GetCallSiteStore();
+        Mutex::Lock lock(store.mutex);
+        if (id >= store.sites.size())
+        {
+            return false;
+        }
+        file = store.sites[id].first;
+        line = store.sites[id].second;
+        return true;
+    }
+
+    static void PutVarint(std::string& out, uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            out.push_back((char)(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back((char)v);
+    }
+
+    static void PutString(std::string& out, const char* str, size_t len)
+    {
+        PutVarint(out, len);
+        out.append(str, len);
+    }
+
+    static uint64_t ZigZagEncode(int64_t v)
+    {
+        return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+    }
+
+    static int64_t ZigZagDecode(uint64_t v)
+    {
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+
+    const char BinaryFileLogAppender::MAGIC[4] = {'S', 'Y', 'L', 'B'};
+
+    // 追加写入, 每次打开都写入新的文件头
+    BinaryFileLogAppender::BinaryFileLogAppender(const std::string& filename)
+        : FileLogAppender(filename, std::ios::out | std::ios::app | std::ios::binary)
+    {
+    }
+
+    uint32_t BinaryFileLogAppender::nameId(const std::string& name)
+    {
+        auto it = m_names.find(name);
+        if (it != m_names.end())
+        {
+            return it->second;
+        }
+        uint32_t id = m_names.size();
+        m_names[name] = id;
+        m_buf.push_back((char)RECORD_NAME);
+        PutVarint(m_buf, id);
+        PutString(m_buf, name.c_str(), name.size());
+        return id;
+    }
+
+    void BinaryFileLogAppender::log(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event)
+    {
+        if (level < m_level)
+        {
+            return;
+        }
+        uint64_t now = event->getTime();
+        uint32_t site = LogCallSiteRegistry::GetId(event->getFile(), event->getLine());
+
+        MutexType::Lock lock(m_mutex);
+        m_buf.clear();
+        if (m_gen != m_fileGen)
+        {
+            // 文件被替换(滚动或重新打开), 写文件头并重新开始定义调用点和名称
+            m_gen = m_fileGen;
+            m_sites.clear();
+            m_names.clear();
+            m_prevTime = 0;
+            m_buf.append(MAGIC, sizeof(MAGIC));
+            m_buf.push_back((char)VERSION);
+            const std::string& pattern = m_formatter ? m_formatter->getPattern() : s_empty_thread_name;
+            PutString(m_buf, pattern.c_str(), pattern.size());
+        }
+        if (site >= m_sites.size())
+        {
+            m_sites.resize(site + 1, false);
+        }
+        if (!m_sites[site])
+        {
+            m_sites[site] = true;
+            m_buf.push_back((char)RECORD_SITE);
+            PutVarint(m_buf, site);
+            PutVarint(m_buf, ZigZagEncode(event->getLine()));
+            PutString(m_buf, event->getFile(), strlen(event->getFile()));
+        }
+        uint32_t thread_name = nameId(event->getThreadName());
+        uint32_t logger_name = nameId(logger->getName());
+
+        m_buf.push_back((char)RECORD_EVENT);
+        m_buf.push_back((char)level);
+        PutVarint(m_buf, site);
+        PutVarint(m_buf, ZigZagEncode((int64_t)(now - m_prevTime)));
+        m_prevTime = now;
+        PutVarint(m_buf, event->getElapse());
+        PutVarint(m_buf, event->getThreadId());
+        PutVarint(m_buf, event->getFiberId());
+        PutVarint(m_buf, thread_name);
+        PutVarint(m_buf, logger_name);
+        PutString(m_buf, event->getContentData(), event->getContentSize());
+
+        writeLocked(m_buf.data(), m_buf.size(), now);
+        if (level == LogLevel::FATAL)
+        {
+            m_filestream.flush();
+        }
+    }
+
+    void BinaryFileLogAppender::flush()
+    {
+        MutexType::Lock lock(m_mutex);
+        m_filestream.flush();
+    }
+
+    std::string BinaryFileLogAppender::toYamlString()
+    {
+        MutexType::Lock lock(m_mutex);
+        YAML::Node node;
+        node["type"] = "BinaryFileLogAppender";
+        node["file"] = m_filename;
+        RotateToYaml(node, m_rotate);
+        if(m_level != LogLevel::UNKNOW) {
+            node["level"] = LogLevel::ToString(m_level);
+        }
+        if(m_hasFormatter && m_formatter) {
+            node["formatter"] = m_formatter->getPattern();
+        }
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+    BinaryLogReader::BinaryLogReader(std::istream& is)
+        : m_is(is)
+    {
+    }
+
+    bool BinaryLogReader::readVarint(uint64_t& v)
+    {
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            int c = m_is.get();
+            if (c == EOF)
+            {
+                return false;
+            }
+            v |= (uint64_t)(c & 0x7f) << shift;
+            if (!(c & 0x80))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool BinaryLogReader::readString(std::string& str)
     {
-        log(LogLevel::FATAL, event);
+        uint64_t len = 0;
+        if (!readVarint(len) || len > (64u << 20))
+        {
+            return false;
+        }
+        str.resize(len);
+        if (len && !m_is.read(&str[0], len))
+        {
+            return false;
+        }
+        return true;
     }
 
-    void Logger::addAppender(LogAppender::ptr appender)
+    bool BinaryLogReader::readHeader()
     {
-        MutexType::Lock lock(m_mutex);
-        if (!appender->getFormatter())
+        char magic[sizeof(BinaryFileLogAppender::MAGIC) - 1];
+        if (!m_is.read(magic, sizeof(magic))
+            || memcmp(magic, BinaryFileLogAppender::MAGIC + 1, sizeof(magic)) != 0)
         {
-            MutexType::Lock ll(appender->m_mutex);
-            // appender->setFormatter(m_formatter);
-            appender->m_formatter = m_formatter;    // 因为这个不是appender自己设置的，所以LogAppender::m_hasFormatter不能设置为true
+            return false;
+        }
+        if (m_is.get() != BinaryFileLogAppender::VERSION)
+        {
+            return false;
         }
-        m_appenders.push_back(appender);
+        // 新的文件头, 之前的字典作废
+        m_sites.clear();
+        m_names.clear();
+        m_prevTime = 0;
+        return readString(m_pattern);
     }
-    void Logger::delAppender(LogAppender::ptr appender)
+
+    bool BinaryLogReader::next(LogEvent::ptr& event, std::string& logger_name)
     {
-        MutexType::Lock lock(m_mutex);
-        for (auto it = m_appenders.begin(); it != m_appenders.end(); ++it)
+        while (true)
         {
-            if (*it == appender)
+            int tag = m_is.get();
+            if (tag == EOF)
             {
-                m_appenders.erase(it);
-                break;
+                return false;
+            }
+            if (tag == BinaryFileLogAppender::MAGIC[0])
+            {
+                if (!readHeader())
+                {
+                    m_error = true;
+                    return false;
+                }
+            }
+            else if (tag == BinaryFileLogAppender::RECORD_SITE)
+            {
+                uint64_t id = 0, line = 0;
+                std::string file;
+                if (!readVarint(id) || !readVarint(line) || !readString(file))
+                {
+                    m_error = true;
+                    return false;
+                }
+                m_sites[id] = std::make_pair(file, (int32_t)ZigZagDecode(line));
+            }
+            else if (tag == BinaryFileLogAppender::RECORD_NAME)
+            {
+                uint64_t id = 0;
+                std::string name;
+                if (!readVarint(id) || !readString(name))
+                {
+                    m_error = true;
+                    return false;
+                }
+                m_names[id] = name;
+            }
+            else if (tag == BinaryFileLogAppender::RECORD_EVENT)
+            {
+                int level = m_is.get();
+                uint64_t site = 0, delta = 0, elapse = 0, tid = 0, fid = 0, thread_name = 0, logger = 0;
+                std::string msg;
+                if (level == EOF || !readVarint(site) || !readVarint(delta) || !readVarint(elapse)
+                    || !readVarint(tid) || !readVarint(fid) || !readVarint(thread_name)
+                    || !readVarint(logger) || !readString(msg))
+                {
+                    m_error = true;
+                    return false;
+                }
+                m_prevTime += ZigZagDecode(delta);
+                auto sit = m_sites.find(site);
+                auto tit = m_names.find(thread_name);
+                auto lit = m_names.find(logger);
+                if (sit == m_sites.end() || tit == m_names.end() || lit == m_names.end())
+                {
+                    m_error = true;
+                    return false;
+                }
+                // 文件名指向m_sites中的字符串, 事件不能比reader活得长
+                event.reset(new LogEvent(nullptr, (LogLevel::Level)level, sit->second.first.c_str()
+                        , sit->second.second, elapse, tid, fid, m_prevTime, tit->second));
+                event->getSS().write(msg.data(), msg.size());
+                logger_name = lit->second;
+                return true;
+            }
+            else
+            {
+                m_error = true;
+                return false;
             }
         }
     }
 
-    void Logger::clearAppenders()
+    const char MmapRingLogAppender::MAGIC[4] = {'S', 'Y', 'L', 'R'};
+
+    static inline uint64_t RingAlign(uint64_t v)
     {
-        MutexType::Lock lock(m_mutex);
-        m_appenders.clear();
+        return (v + MmapRingLogAppender::ALIGN - 1) & ~(uint64_t)(MmapRingLogAppender::ALIGN - 1);
     }
 
-    void Logger::setFormatter(LogFormatter::ptr val)
+    MmapRingLogAppender::MmapRingLogAppender(const std::string& filename, size_t size)
+        : m_filename(filename)
     {
-        MutexType::Lock lock(m_mutex);
-        m_formatter = val;
+        m_capacity = RingAlign(size < 64 * 1024 ? 64 * 1024 : size);
+        size_t total = HEADER_SIZE + m_capacity;
 
-        for (auto& i : m_appenders)
+        int fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
         {
-            MutexType::Lock ll(i->m_mutex);
-            if (!i->m_hasFormatter)
-            {
-                i->m_formatter = m_formatter;
-            }
+            std::cout << "MmapRingLogAppender open error file=" << filename
+                      << " errno=" << errno << " errstr=" << strerror(errno) << std::endl;
+            return;
         }
-    }
-
-    void Logger::setFormatter(const std::string& val)
-    {
-        std::cout << "---" << val << std::endl;
-        sylar::LogFormatter::ptr new_val(new sylar::LogFormatter(val));
-        if (new_val->isError())
+        struct stat st;
+        bool reuse = fstat(fd, &st) == 0 && (size_t)st.st_size == total;
+        // 大小不对的旧文件清空后重新分配
+        if (!reuse && ftruncate(fd, 0) != 0)
         {
-            std::cout << "Logger setFormatter name=" << m_name
-                      << " value=" << val << " invalid formatter"
-                      << std::endl;
+            std::cout << "MmapRingLogAppender ftruncate error file=" << filename
+                      << " errno=" << errno << " errstr=" << strerror(errno) << std::endl;
+            close(fd);
             return;
         }
-        setFormatter(new_val);
-    }
-
-    std::string Logger::toYamlString()
-    {
-        MutexType::Lock lock(m_mutex);
-        YAML::Node node;
-        node["name"] = m_name;
-        if (m_level != LogLevel::UNKNOW)
+        // 预先分配磁盘空间, 避免写映射内存时因磁盘满收到SIGBUS
+        int rt = posix_fallocate(fd, 0, total);
+        if (rt != 0)
         {
-            node["level"] = LogLevel::ToString(m_level);
+            std::cout << "MmapRingLogAppender fallocate error file=" << filename
+                      << " errno=" << rt << " errstr=" << strerror(rt) << std::endl;
+            close(fd);
+            return;
         }
-        if (m_formatter)
+        void* addr = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
         {
-            node["formatter"] = m_formatter->getPattern();
+            std::cout << "MmapRingLogAppender mmap error file=" << filename
+                      << " errno=" << errno << " errstr=" << strerror(errno) << std::endl;
+            return;
         }
 
-        for(auto& i : m_appenders) {
-            node["appenders"].push_back(YAML::Load(i->toYamlString()));
+        m_header = (Header*)addr;
+        m_data = (char*)addr + HEADER_SIZE;
+        if (reuse && memcmp(m_header->magic, MAGIC, sizeof(MAGIC)) == 0
+            && m_header->version == VERSION && m_header->capacity == m_capacity)
+        {
+            // 接着上次的游标写, 保留崩溃前的日志
+            return;
         }
-        std::stringstream ss;
-        ss << node;
-        return ss.str();
+        if (reuse)
+        {
+            memset(addr, 0, total);
+        }
+        m_header->version = VERSION;
+        m_header->capacity = m_capacity;
+        m_header->cursor.store(0);
+        memcpy(m_header->magic, MAGIC, sizeof(MAGIC));
     }
 
-    LogFormatter::ptr Logger::getFormatter()
+    MmapRingLogAppender::~MmapRingLogAppender()
     {
-        MutexType::Lock lock(m_mutex);
-        return m_formatter;
+        if (m_header)
+        {
+            munmap(m_header, HEADER_SIZE + m_capacity);
+        }
     }
 
+    void MmapRingLogAppender::log(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event)
+    {
+        if (level < m_level || !m_header)
+        {
+            return;
+        }
+        static thread_local std::string t_msg;
+        t_msg.clear();
+        getFormatter()->format(t_msg, logger, level, event);
+
+        // 单条记录不超过数据区的一半, 超出部分截断
+        size_t len = std::min(t_msg.size(), m_capacity / 2 - sizeof(Record));
+        uint64_t pos = m_header->cursor.fetch_add(RingAlign(sizeof(Record) + len), std::memory_order_relaxed);
+
+        // 记录按ALIGN对齐, 记录头不会跨过数据区末尾, 内容可能需要分两段拷贝
+        size_t off = pos % m_capacity;
+        Record* rec = (Record*)(m_data + off);
+        rec->pos.store(0, std::memory_order_relaxed);
+        rec->len = len;
+        off += sizeof(Record);
+        if (off == m_capacity)
+        {
+            off = 0;
+        }
+        size_t first = std::min(len, m_capacity - off);
+        memcpy(m_data + off, t_msg.data(), first);
+        memcpy(m_data, t_msg.data() + first, len - first);
+        rec->pos.store(pos + 1, std::memory_order_release);
+    }
 
-    void StdoutLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
-        if (level >= m_level)
+    void MmapRingLogAppender::sync()
+    {
+        if (m_header)
         {
-            MutexType::Lock lock(m_mutex);
-            std::cout << m_formatter->format(logger, level, event);
+            msync(m_header, HEADER_SIZE + m_capacity, MS_SYNC);
         }
     }
 
-    std::string StdoutLogAppender::toYamlString()
+    std::string MmapRingLogAppender::toYamlString()
     {
         MutexType::Lock lock(m_mutex);
         YAML::Node node;
-        node["type"] = "StdoutLogAppender";
+        node["type"] = "MmapRingLogAppender";
+        node["file"] = m_filename;
+        node["size"] = m_capacity;
         if(m_level != LogLevel::UNKNOW) {
             node["level"] = LogLevel::ToString(m_level);
         }
@@ -430,75 +1800,196 @@ namespace sylar {
         return ss.str();
     }
 
-    FileLogAppender::FileLogAppender(const std::string& filename) : m_filename(filename) {
-        reopen();
+    MmapRingLogReader::MmapRingLogReader(const std::string& filename)
+    {
+        std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+        if (!ifs)
+        {
+            return;
+        }
+        std::string header(MmapRingLogAppender::HEADER_SIZE, '\0');
+        if (!ifs.read(&header[0], header.size()))
+        {
+            return;
+        }
+        const MmapRingLogAppender::Header* h = (const MmapRingLogAppender::Header*)header.data();
+        if (memcmp(h->magic, MmapRingLogAppender::MAGIC, sizeof(MmapRingLogAppender::MAGIC)) != 0
+            || h->version != MmapRingLogAppender::VERSION
+            || h->capacity == 0 || h->capacity % MmapRingLogAppender::ALIGN)
+        {
+            return;
+        }
+        m_capacity = h->capacity;
+        m_end = h->cursor.load();
+        m_data.resize(m_capacity);
+        if (!ifs.read(&m_data[0], m_capacity))
+        {
+            return;
+        }
+        m_valid = true;
+        // 数据区只保存了最后capacity字节
+        m_pos = m_end > m_capacity ? m_end - m_capacity : 0;
     }
 
-    void FileLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
-        if (level >= m_level)
+    bool MmapRingLogReader::readRecord(uint64_t pos, std::string* record, uint64_t& next)
+    {
+        const MmapRingLogAppender::Record* rec =
+                (const MmapRingLogAppender::Record*)(m_data.data() + pos % m_capacity);
+        if (rec->pos.load() != pos + 1 || rec->len > m_capacity / 2)
         {
-            uint64_t now = event->getTime();
-            if(now >= (m_lastTime + 3)) {   // 考虑到日志输出过程中日志文件被删除的情况
-                reopen();
-                m_lastTime = now;
-            }
-
-            MutexType::Lock lock(m_mutex);
-            //m_filestream << m_formatter->format(logger, level, event);  // 调用日志格式器输出日志
-            if(!m_formatter->format(m_filestream, logger, level, event)) {
-                std::cout << "error" << std::endl;
-            }
+            return false;
+        }
+        next = pos + RingAlign(sizeof(MmapRingLogAppender::Record) + rec->len);
+        if (next > m_end)
+        {
+            return false;
+        }
+        if (record)
+        {
+            size_t off = (pos + sizeof(MmapRingLogAppender::Record)) % m_capacity;
+            size_t first = std::min((size_t)rec->len, (size_t)(m_capacity - off));
+            record->assign(m_data.data() + off, first);
+            record->append(m_data.data(), rec->len - first);
         }
+        return true;
     }
 
-    // 重新打开日志文件
-    bool FileLogAppender::reopen() {
-        MutexType::Lock lock(m_mutex);
-        if (m_filestream)
+    bool MmapRingLogReader::seek()
+    {
+        uint64_t next = 0;
+        while (m_pos < m_end)
         {
-            m_filestream.close();
+            if (readRecord(m_pos, nullptr, next))
+            {
+                return true;
+            }
+            m_pos += MmapRingLogAppender::ALIGN;
+            m_skipped += MmapRingLogAppender::ALIGN;
         }
-        m_filestream.open(m_filename);
-        return !!m_filestream;
+        return false;
     }
 
-    std::string FileLogAppender::toYamlString()
+    bool MmapRingLogReader::next(std::string& record)
     {
-        MutexType::Lock lock(m_mutex);
-        YAML::Node node;
-        node["type"] = "FileLogAppender";
-        node["file"] = m_filename;
-        if(m_level != LogLevel::UNKNOW) {
-            node["level"] = LogLevel::ToString(m_level);
+        if (!m_valid)
+        {
+            return false;
         }
-        if(m_hasFormatter && m_formatter) {
-            node["formatter"] = m_formatter->getPattern();
+        uint64_t next = 0;
+        // 开头的记录可能已被覆盖一部分, 中间的记录可能在崩溃时没写完, 都跳到下一条完整的记录
+        if (!readRecord(m_pos, &record, next))
+        {
+            if (!seek())
+            {
+                return false;
+            }
+            readRecord(m_pos, &record, next);
         }
-        std::stringstream ss;
-        ss << node;
-        return ss.str();
+        m_pos = next;
+        return true;
     }
 
     LogFormatter::LogFormatter(const std::string& pattern) : m_pattern(pattern) {
         init();
     }
 
-    std::string LogFormatter::format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
-        std::stringstream ss;
-        for (auto& i : m_items) // 依次调用日志格式解析后格式将日志内容输出到ss流中
+    std::string LogFormatter::format(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) {
+        std::string str;
+        format(str, logger, level, event);
+        return str;
+    }
+
+    std::ostream& LogFormatter::format(std::ostream& ofs, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event)
+    {
+        static thread_local std::string t_buf;
+        t_buf.clear();
+        format(t_buf, logger, level, event);
+        ofs.write(t_buf.data(), t_buf.size());
+        if (m_hasNewLine)
         {
-            i->format(ss, logger, level, event);
+            ofs.flush();
         }
-        return ss.str();
+        return ofs;
     }
 
-    std::ostream& LogFormatter::format(std::ostream& ofs, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)
+    // 每个线程缓存最近几个(时间格式, 秒)的格式化结果, 同一秒内的日志不再调用localtime_r/strftime
+    struct TimeCacheEntry {
+        uint64_t id = 0;
+        time_t time = 0;
+        size_t length = 0;
+        char buf[64];
+    };
+    static const size_t TIME_CACHE_SIZE = 4;
+    static thread_local TimeCacheEntry t_time_cache[TIME_CACHE_SIZE];
+    static std::atomic<uint64_t> s_time_format_id {0};
+
+    void LogFormatter::appendTime(std::string& out, const TimeFormat& tf, time_t time) const
     {
-        for (auto& i : m_items)
+        TimeCacheEntry& e = t_time_cache[tf.id % TIME_CACHE_SIZE];
+        if (e.id != tf.id || e.time != time)
         {
-            i->format(ofs, logger, level, event);
+            struct tm tm;
+            localtime_r(&time, &tm);
+            e.length = strftime(e.buf, sizeof e.buf, tf.format.c_str(), &tm);
+            e.id = tf.id;
+            e.time = time;
+        }
+        out.append(e.buf, e.length);
+    }
+
+    void LogFormatter::format(std::string& out, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event)
+    {
+        const LogEvent& ev = *event;
+        for (auto& op : m_ops)
+        {
+            switch (op.code) {
+                case OP_STRING:
+                    out.append(m_strings, op.offset, op.length);
+                    break;
+                case OP_MESSAGE:
+                    out.append(ev.getContentData(), ev.getContentSize());
+                    break;
+                case OP_LEVEL:
+                    out.append(LogLevel::ToString(level));
+                    break;
+                case OP_ELAPSE:
+                    AppendUInt(out, ev.getElapse());
+                    break;
+                case OP_NAME:
+                    if (ev.getLogger())
+                        out.append(ev.getLogger()->getName());
+                    else if (logger)
+                        out.append(logger->getName());
+                    break;
+                case OP_THREAD_ID:
+                    AppendUInt(out, ev.getThreadId());
+                    break;
+                case OP_NEWLINE:
+                    out.push_back('\n');
+                    break;
+                case OP_DATETIME:
+                    appendTime(out, m_timeFormats[op.offset], ev.getTime());
+                    break;
+                case OP_FILENAME:
+                    if (ev.getFile())
+                        out.append(ev.getFile());
+                    break;
+                case OP_LINE:
+                    AppendInt(out, ev.getLine());
+                    break;
+                case OP_TAB:
+                    out.push_back('\t');
+                    break;
+                case OP_FIBER_ID:
+                    AppendUInt(out, ev.getFiberId());
+                    break;
+                case OP_THREAD_NAME:
+                    out.append(ev.getThreadName());
+                    break;
+                default:
+                    break;
+            }
         }
-        return ofs;
     }
 
 
@@ -578,41 +2069,67 @@ namespace sylar {
             vec.push_back(std::make_tuple(nstr, "", 0));
         }
 
-        static std::map<std::string, std::function<FormatItem::ptr(const std::string& str)> > s_format_items = {
+        static std::map<std::string, OpCode> s_format_items = {
 #define XX(str, C) \
-        {#str, [](const std::string& fmt) { return FormatItem::ptr(new C(fmt));}}
-
-                XX(m, MessageFormatItem),           //m:消息
-                XX(p, LevelFormatItem),             //p:日志级别
-                XX(r, ElapseFormatItem),            //r:累计毫秒数
-                XX(c, NameFormatItem),              //c:日志名称
-                XX(t, ThreadIdFormatItem),          //t:线程id
-                XX(n, NewLineFormatItem),           //n:换行
-                XX(d, DateTimeFormatItem),          //d:时间
-                XX(f, FilenameFormatItem),          //f:文件名
-                XX(l, LineFormatItem),              //l:行号
-                XX(T, TabFormatItem),               //T:Tab
-                XX(F, FiberIdFormatItem),           //F:协程id
-                XX(N, ThreadNameFormatItem),        //N:线程名称
+        {#str, C}
+
+                XX(m, OP_MESSAGE),          //m:消息
+                XX(p, OP_LEVEL),            //p:日志级别
+                XX(r, OP_ELAPSE),           //r:累计毫秒数
+                XX(c, OP_NAME),             //c:日志名称
+                XX(t, OP_THREAD_ID),        //t:线程id
+                XX(n, OP_NEWLINE),          //n:换行
+                XX(d, OP_DATETIME),         //d:时间
+                XX(f, OP_FILENAME),         //f:文件名
+                XX(l, OP_LINE),             //l:行号
+                XX(T, OP_TAB),              //T:Tab
+                XX(F, OP_FIBER_ID),         //F:协程id
+                XX(N, OP_THREAD_NAME),      //N:线程名称
 #undef XX
         };
 
+        m_ops.clear();
+        m_strings.clear();
+        m_timeFormats.clear();
+        m_hasNewLine = false;
+        auto add_string = [this](const std::string& str) {
+            // 相邻的常量字符串合并成一条指令
+            if (!m_ops.empty() && m_ops.back().code == OP_STRING
+                    && m_ops.back().offset + m_ops.back().length == m_strings.size()) {
+                m_ops.back().length += str.size();
+            } else {
+                m_ops.push_back(Op{OP_STRING, (uint32_t)m_strings.size(), (uint32_t)str.size()});
+            }
+            m_strings.append(str);
+        };
+
         for(auto& i : vec) {
             if(std::get<2>(i) == 0) {
-                m_items.push_back(FormatItem::ptr(new StringFormatItem(std::get<0>(i))));
-            } else {
-                auto it = s_format_items.find(std::get<0>(i));
-                if(it == s_format_items.end()) {
-                    m_items.push_back(FormatItem::ptr(new StringFormatItem("<<error_format %" + std::get<0>(i) + ">>")));
-                    m_error = true;
-                } else {
-                    m_items.push_back(it->second(std::get<1>(i)));
+                add_string(std::get<0>(i));
+                continue;
+            }
+            auto it = s_format_items.find(std::get<0>(i));
+            if(it == s_format_items.end()) {
+                add_string("<<error_format %" + std::get<0>(i) + ">>");
+                m_error = true;
+                continue;
+            }
+            Op op{(uint32_t)it->second, 0, 0};
+            if (it->second == OP_DATETIME) {
+                std::string fmt = std::get<1>(i);
+                if (fmt.empty()) {
+                    fmt = "%Y-%m-%d %H:%M:%S";
                 }
+                op.offset = m_timeFormats.size();
+                m_timeFormats.push_back(TimeFormat{fmt, ++s_time_format_id});
+            } else if (it->second == OP_NEWLINE) {
+                m_hasNewLine = true;
             }
+            m_ops.push_back(op);
 
             // std::cout << "(" << std::get<0>(i) << ") - (" << std::get<1>(i) << ") - (" << std::get<2>(i) << ")" << std::endl;
         }
-        // std::cout << m_items.size() << std::endl;
+        // std::cout << m_ops.size() << std::endl;
     }
 
     LoggerManager::LoggerManager()
@@ -659,16 +2176,30 @@ namespace sylar {
     }
 
     struct LogAppenderDefine {
-        int type = 0;   // 1 File, 2 Stdout
+        int type = 0;   // 1 File, 2 Stdout, 3 BinaryFile, 4 MmapRing
         LogLevel::Level level = LogLevel::UNKNOW;
         std::string formatter;
         std::string file;
+        bool async = false;             // FileLogAppender是否使用异步刷盘
+        size_t buffer_size = 1024 * 1024;   // 异步模式单个缓冲大小
+        size_t max_buffers = 16;        // 异步模式最多缓冲个数
+        uint32_t flush_interval = 1000; // 异步模式刷盘间隔(毫秒)
+        std::string overflow = "block"; // 异步模式缓冲写满策略 block/drop
+        LogRotateConfig rotate;         // 文件滚动配置(FileLogAppender/BinaryFileLogAppender)
+        size_t size = 8 * 1024 * 1024;  // MmapRingLogAppender数据区大小
 
         bool operator==(const LogAppenderDefine& oth) const {
             return type == oth.type
             && level == oth.level
             && formatter == oth.formatter
-            && file == oth.file;
+            && file == oth.file
+            && async == oth.async
+            && buffer_size == oth.buffer_size
+            && max_buffers == oth.max_buffers
+            && flush_interval == oth.flush_interval
+            && overflow == oth.overflow
+            && rotate == oth.rotate
+            && size == oth.size;
         }
     };
 
@@ -682,7 +2213,7 @@ namespace sylar {
             return name == oth.name
                     && level == oth.level
                     && formatter == oth.formatter
-                    && appenders == appenders;
+                    && appenders == oth.appenders;
         }
 
         bool operator< (const LogDefine& oth) const {
@@ -694,6 +2225,27 @@ namespace sylar {
         }
     };
 
+    // 解析文件滚动配置
+    static void RotateFromYaml(const YAML::Node& a, LogRotateConfig& conf)
+    {
+        if (a["max_size"].IsDefined())
+        {
+            conf.max_size = a["max_size"].as<uint64_t>();
+        }
+        if (a["rotate"].IsDefined())
+        {
+            conf.interval = LogRotateConfig::IntervalFromString(a["rotate"].as<std::string>());
+        }
+        if (a["max_files"].IsDefined())
+        {
+            conf.max_files = a["max_files"].as<uint32_t>();
+        }
+        if (a["compress"].IsDefined())
+        {
+            conf.compress = a["compress"].as<bool>();
+        }
+    }
+
     template<>
     class LexicalCast<std::string, LogDefine> {
     public:
@@ -740,6 +2292,60 @@ namespace sylar {
                         {
                             lad.formatter = a["formatter"].as<std::string>();
                         }
+                        if (a["async"].IsDefined())
+                        {
+                            lad.async = a["async"].as<bool>();
+                        }
+                        if (a["buffer_size"].IsDefined())
+                        {
+                            lad.buffer_size = a["buffer_size"].as<size_t>();
+                        }
+                        if (a["max_buffers"].IsDefined())
+                        {
+                            lad.max_buffers = a["max_buffers"].as<size_t>();
+                        }
+                        if (a["flush_interval"].IsDefined())
+                        {
+                            lad.flush_interval = a["flush_interval"].as<uint32_t>();
+                        }
+                        if (a["overflow"].IsDefined())
+                        {
+                            lad.overflow = a["overflow"].as<std::string>();
+                        }
+                        RotateFromYaml(a, lad.rotate);
+                    }
+                    else if (type == "BinaryFileLogAppender")
+                    {
+                        lad.type = 3;
+                        if (!a["file"].IsDefined())
+                        {
+                            std::cout << "log config error: binaryfileappender file is null, " << a << std::endl;
+                            continue;
+                        }
+                        lad.file = a["file"].as<std::string>();
+                        if (a["formatter"].IsDefined())
+                        {
+                            lad.formatter = a["formatter"].as<std::string>();
+                        }
+                        RotateFromYaml(a, lad.rotate);
+                    }
+                    else if (type == "MmapRingLogAppender")
+                    {
+                        lad.type = 4;
+                        if (!a["file"].IsDefined())
+                        {
+                            std::cout << "log config error: mmapringappender file is null, " << a << std::endl;
+                            continue;
+                        }
+                        lad.file = a["file"].as<std::string>();
+                        if (a["size"].IsDefined())
+                        {
+                            lad.size = a["size"].as<size_t>();
+                        }
+                        if (a["formatter"].IsDefined())
+                        {
+                            lad.formatter = a["formatter"].as<std::string>();
+                        }
                     }
                     else if (type == "StdoutLogAppender")
                     {
@@ -785,11 +2391,32 @@ namespace sylar {
                 {
                     na["type"] = "FileLogAppender";
                     na["file"] = a.file;
+                    RotateToYaml(na, a.rotate);
+                    if (a.async)
+                    {
+                        na["async"] = true;
+                        na["buffer_size"] = a.buffer_size;
+                        na["max_buffers"] = a.max_buffers;
+                        na["flush_interval"] = a.flush_interval;
+                        na["overflow"] = a.overflow;
+                    }
                 }
                 else if (a.type == 2)
                 {
                     na["type"] = "StdoutLogAppender";
                 }
+                else if (a.type == 3)
+                {
+                    na["type"] = "BinaryFileLogAppender";
+                    na["file"] = a.file;
+                    RotateToYaml(na, a.rotate);
+                }
+                else if (a.type == 4)
+                {
+                    na["type"] = "MmapRingLogAppender";
+                    na["file"] = a.file;
+                    na["size"] = a.size;
+                }
                 if (a.level != LogLevel::UNKNOW)
                 {
                     na["level"] = LogLevel::ToString(a.level);
@@ -850,12 +2477,31 @@ namespace sylar {
                         sylar::LogAppender::ptr ap;
                         if (a.type == 1)
                         {
-                            ap.reset(new FileLogAppender(a.file));
+                            if (a.async)
+                            {
+                                ap.reset(new AsyncFileLogAppender(a.file, a.buffer_size, a.max_buffers
+                                        , a.flush_interval, AsyncFileLogAppender::PolicyFromString(a.overflow)));
+                            }
+                            else
+                            {
+                                ap.reset(new FileLogAppender(a.file));
+                            }
+                            std::static_pointer_cast<FileLogAppender>(ap)->setRotateConfig(a.rotate);
                         }
                         else if (a.type == 2)
                         {
                             ap.reset(new StdoutLogAppender);
                         }
+                        else if (a.type == 3)
+                        {
+                            BinaryFileLogAppender::ptr bap(new BinaryFileLogAppender(a.file));
+                            bap->setRotateConfig(a.rotate);
+                            ap = bap;
+                        }
+                        else if (a.type == 4)
+                        {
+                            ap.reset(new MmapRingLogAppender(a.file, a.size));
+                        }
 
                         ap->setLevel(a.level);
                         if(!a.formatter.empty()) {
@@ -13,18 +13,35 @@
 #include <vector>
 #include <sstream>
 #include <map>
+#include <atomic>
+#include <condition_variable>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <string.h>
 #include "util.h"
 #include "singleton.h"
 #include "mutex.h"
 #include "thread.h"
 
+/**
+ * @brief 编译期最低日志级别(LogLevel::Level的数值), 低于该级别的日志语句条件恒为假, 由编译器整个去掉
+ * @details 由CMake选项 SYLAR_LOG_MIN_LEVEL(DEBUG/INFO/WARN/ERROR/FATAL) 定义, 默认不裁剪
+ */
+#ifndef SYLAR_LOG_MIN_LEVEL
+#define SYLAR_LOG_MIN_LEVEL 0
+#endif
+
+// 日志级别level是否在编译期被保留
+#define SYLAR_LOG_ENABLED(level) ((int)(level) >= SYLAR_LOG_MIN_LEVEL)
+
 // 使用流式方式将日志级别level的日志写入到logger
-// 如果当前logger的日志级别小于参数level，那么重新创建一个LogEvent，并用LogEventWrap包装
+// 如果level不低于logger的有效级别(日志器和所有Appender级别的汇总)，那么从线程本地的事件池取出一个LogEvent，并用LogEventWrap包装
 #define SYLAR_LOG_LEVEL(logger, level)\
-    if (logger->getLevel() <= level) \
-        sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger, level, \
+    if (SYLAR_LOG_ENABLED(level) && logger->getEffectiveLevel() <= level) \
+        sylar::LogEventWrap(logger, level, \
                 __FILE__, __LINE__, 0, sylar::GetThreadId(),\
-                sylar::GetFiberId(), time(0), sylar::Thread::GetName()))).getSS()
+                sylar::GetFiberId(), time(0), sylar::Thread::GetName()).getSS()
 
 /**
  * @brief 使用流式方式将日志级别debug的日志写入到logger
@@ -53,12 +70,13 @@
 
 /**
  * @brief 使用格式化方式将日志级别level的日志写入到logger
+ * @details 只保存格式串和参数, 有Appender真正输出时才格式化
  */
 #define SYLAR_LOG_FMT_LEVEL(logger, level, fmt, ...) \
-    if(logger->getLevel() <= level) \
-        sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger, level, \
+    if(SYLAR_LOG_ENABLED(level) && logger->getEffectiveLevel() <= level) \
+        sylar::LogEventWrap(logger, level, \
                         __FILE__, __LINE__, 0, sylar::GetThreadId(),\
-                sylar::GetFiberId(), time(0), sylar::Thread::GetName(), sylar::Thread::GetName()))).getEvent()->format(fmt, __VA_ARGS__)
+                sylar::GetFiberId(), time(0), sylar::Thread::GetName()).getEvent()->formatLazy(SYLAR_LOG_FMT_SITE(), fmt, __VA_ARGS__)
 
 /**
  * @brief 使用格式化方式将日志级别debug的日志写入到logger
@@ -85,6 +103,55 @@
  */
 #define SYLAR_LOG_FMT_FATAL(logger, fmt, ...) SYLAR_LOG_FMT_LEVEL(logger, sylar::LogLevel::FATAL, fmt, __VA_ARGS__)
 
+// 当前调用点独有的限流器, 每次宏展开是一个不同的lambda, 各自有一个静态对象
+#define SYLAR_LOG_SITE_LIMITER() \
+    ([]() -> sylar::LogRateLimiter& { static sylar::LogRateLimiter s_limiter; return s_limiter; }())
+
+// 当前调用点独有的格式串检查结果, 同SYLAR_LOG_SITE_LIMITER
+#define SYLAR_LOG_FMT_SITE() \
+    ([]() -> sylar::LogFormatSite& { static sylar::LogFormatSite s_site; return s_site; }())
+
+/**
+ * @brief 限流的流式日志, 该调用点每n次只输出1次
+ * @details 被跳过的条数会在下一次输出时以 "[suppressed N] " 前缀报告
+ */
+#define SYLAR_LOG_EVERY_N(logger, level, n) \
+    if (SYLAR_LOG_ENABLED(level) && logger->getEffectiveLevel() <= level) \
+        if (sylar::LogRateLimiter::Ticket sylar_log_ticket = SYLAR_LOG_SITE_LIMITER().everyN(n)) \
+            sylar::LogEventWrap(logger, level, \
+                    __FILE__, __LINE__, 0, sylar::GetThreadId(),\
+                    sylar::GetFiberId(), time(0), sylar::Thread::GetName()).getSS() << sylar_log_ticket
+
+/**
+ * @brief 限流的流式日志, 该调用点每ms毫秒最多输出1次
+ */
+#define SYLAR_LOG_EVERY_MS(logger, level, ms) \
+    if (SYLAR_LOG_ENABLED(level) && logger->getEffectiveLevel() <= level) \
+        if (sylar::LogRateLimiter::Ticket sylar_log_ticket = SYLAR_LOG_SITE_LIMITER().everyMs(ms)) \
+            sylar::LogEventWrap(logger, level, \
+                    __FILE__, __LINE__, 0, sylar::GetThreadId(),\
+                    sylar::GetFiberId(), time(0), sylar::Thread::GetName()).getSS() << sylar_log_ticket
+
+/**
+ * @brief 限流的格式化日志, 该调用点每n次只输出1次
+ */
+#define SYLAR_LOG_FMT_EVERY_N(logger, level, n, fmt, ...) \
+    if (SYLAR_LOG_ENABLED(level) && logger->getEffectiveLevel() <= level) \
+        if (sylar::LogRateLimiter::Ticket sylar_log_ticket = SYLAR_LOG_SITE_LIMITER().everyN(n)) \
+            sylar_log_ticket.apply(sylar::LogEventWrap(logger, level, \
+                    __FILE__, __LINE__, 0, sylar::GetThreadId(),\
+                    sylar::GetFiberId(), time(0), sylar::Thread::GetName()).getEvent())->formatLazy(SYLAR_LOG_FMT_SITE(), fmt, __VA_ARGS__)
+
+/**
+ * @brief 限流的格式化日志, 该调用点每ms毫秒最多输出1次
+ */
+#define SYLAR_LOG_FMT_EVERY_MS(logger, level, ms, fmt, ...) \
+    if (SYLAR_LOG_ENABLED(level) && logger->getEffectiveLevel() <= level) \
+        if (sylar::LogRateLimiter::Ticket sylar_log_ticket = SYLAR_LOG_SITE_LIMITER().everyMs(ms)) \
+            sylar_log_ticket.apply(sylar::LogEventWrap(logger, level, \
+                    __FILE__, __LINE__, 0, sylar::GetThreadId(),\
+                    sylar::GetFiberId(), time(0), sylar::Thread::GetName()).getEvent())->formatLazy(SYLAR_LOG_FMT_SITE(), fmt, __VA_ARGS__)
+
 // 获取主日志器
 #define SYLAR_LOG_ROOT() sylar::LoggerMgr::GetInstance()->getRoot()
 
@@ -117,8 +184,63 @@ namespace sylar {
 
     };
 
+    // 日志内容缓冲, 内容较短时写入对象内部的定长数组, 超出后转存到std::string
+    class LogMessageBuffer : public std::streambuf {
+    public:
+        static const size_t INLINE_SIZE = 512;
+
+        LogMessageBuffer() { setp(m_inline, m_inline + INLINE_SIZE); }
+
+        const char* data() const { return m_spilled ? m_overflow.data() : m_inline; }
+        size_t size() const { return m_spilled ? m_overflow.size() : (size_t)(pptr() - pbase()); }
+
+        // 清空内容, 已经分配的m_overflow容量保留下来复用
+        void clear();
+
+        void append(const char* str, size_t len) { xsputn(str, len); }
+    protected:
+        int_type overflow(int_type c) override;
+        std::streamsize xsputn(const char* str, std::streamsize len) override;
+    private:
+        // 把定长数组中的内容转存到m_overflow
+        void spill();
+    private:
+        char m_inline[INLINE_SIZE];
+        std::string m_overflow;
+        bool m_spilled = false;
+    };
+
+    /**
+     * @brief 延迟格式化的调用点, 缓存格式串的检查结果, 由SYLAR_LOG_FMT_*宏为每个调用点静态创建
+     * @details C字符串参数只有对应不带精度和长度修饰的%s时才拷贝内容延迟格式化;
+     *          %p要的是调用方的指针, %.*s和未结束的缓冲区不能strlen, 这些情况立即格式化
+     */
+    class LogFormatSite {
+    public:
+        /**
+         * @brief fmt里strings标记的参数(第i位对应第i个参数)是否都能按%s延迟格式化, 每个调用点只解析一次
+         */
+        bool lazyStrings(const char* fmt, uint64_t strings) {
+            int v = m_lazyStrings.load(std::memory_order_relaxed);
+            if (v < 0) {
+                v = CheckLazyStrings(fmt, strings) ? 1 : 0;
+                m_lazyStrings.store(v, std::memory_order_relaxed);
+            }
+            return v;
+        }
+
+        /**
+         * @brief 解析printf格式串, 检查strings标记的参数是否都被普通的%s使用
+         */
+        static bool CheckLazyStrings(const char* fmt, uint64_t strings);
+    private:
+        std::atomic<int> m_lazyStrings = {-1};  // -1未检查, 0立即格式化, 1可以延迟
+    };
+
     // 日志事件的封装
     class LogEvent {
+    friend class LogEventPool;
+    friend class LogEventWrap;
     public:
         typedef std::shared_ptr<LogEvent> ptr;
         /**
@@ -153,17 +275,53 @@ namespace sylar {
         uint32_t getThreadId() const { return m_threadId; }
         uint32_t getFiberId() const { return m_fiberId; }
         uint64_t getTime() const { return m_time; }
-        const std::string getContent() const { return m_ss.str(); }
-        std::stringstream& getSS() { return m_ss;}  // 返回日志内容字符串流
-        const std::string getThreadName() { return m_threadName; }
+        // 读取内容时才执行延迟的格式化
+        const std::string getContent() const { render(); return std::string(m_buf.data(), m_buf.size()); }
+        const char* getContentData() const { render(); return m_buf.data(); }
+        size_t getContentSize() const { render(); return m_buf.size(); }
+        std::ostream& getSS() { render(); return m_ss;}  // 返回日志内容流
+        const std::string& getThreadName() const { return *m_threadName; }
         LogLevel::Level  getLevel() const { return m_level; }
-        std::shared_ptr<Logger> getLogger() { return m_logger; }
+        const std::shared_ptr<Logger>& getLogger() const { return m_logger; }
 
         // 格式化写入日志内容
         void format(const char* fmt, ...);
 
         // 格式化写入日志内容
         void format(const char* fmt, va_list al);
+
+        /**
+         * @brief 延迟格式化: 只保存格式串和参数, 第一次读取内容时才格式化
+         * @details 参数必须是平凡可拷贝类型, 按值保存; 对应%s的C字符串立即拷贝一份, 不依赖调用方临时对象的生命周期,
+         *          其他用法的C字符串(见LogFormatSite)或者参数放不下时退化为立即格式化.
+         *          fmt必须是字符串常量, 同一个site只能用同一个fmt
+         */
+        template<class... Args>
+        void formatLazy(LogFormatSite& site, const char* fmt, Args... args);
+    private:
+        LogEvent();
+
+        void render() const {
+            if (m_lazyRender) {
+                renderLazy();
+            }
+        }
+        void renderLazy() const;
+
+        template<class... Args>
+        struct LazyFormat;
+
+        // 参数放得下时保存参数, 否则立即格式化
+        template<class... Args>
+        void formatLazyImpl(std::true_type, const char* fmt, Args... args);
+        template<class... Args>
+        void formatLazyImpl(std::false_type, const char* fmt, Args... args);
+
+        // 事件池复用时重新设置事件, thread_name只保存引用, 调用方保证其生命周期
+        void reset(std::shared_ptr<Logger> logger, LogLevel::Level level
+                ,const char* file, int32_t line, uint32_t elapse
+                ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+                ,const std::string& thread_name);
     private:
         const char* m_file = nullptr;   // 文件名
         int32_t m_line = 0;             // 行号
@@ -171,28 +329,183 @@ namespace sylar {
         uint32_t m_threadId = 0;        // 线程id
         uint32_t m_fiberId = 0;         // 协成id;
         uint64_t m_time = 0;            // 时间戳
-        std::string m_threadName;       // 线程名称
-        //std::string m_content;
-        std::stringstream m_ss;         // 日志内容留
+        const std::string* m_threadName;    // 线程名称
+        std::string m_threadNameStorage;    // 通过构造函数传入的线程名称副本
+        LogMessageBuffer m_buf;         // 日志内容缓冲
+        std::ostream m_ss;              // 日志内容流, 写入m_buf
         std::shared_ptr<Logger> m_logger;  // 日志器
         LogLevel::Level m_level;        // 日志等级
+
+        static const size_t LAZY_ARGS_SIZE = 128;
+        void (*m_lazyRender)(LogEvent*) = nullptr;  // 延迟格式化函数, 为空表示没有待格式化的内容
+        const char* m_lazyFmt = nullptr;            // 延迟格式化的格式串
+        alignas(16) char m_lazyArgs[LAZY_ARGS_SIZE];    // 延迟格式化保存的参数
+        std::string m_lazyStrings;                  // 延迟格式化参数中C字符串的副本
+    };
+
+    namespace detail {
+        // 延迟格式化参数的保存方式: 默认按值保存
+        template<class T>
+        struct LogLazyArg {
+            static_assert(std::is_trivially_copyable<T>::value, "lazy log argument must be trivially copyable");
+            typedef T type;
+            static type Capture(T v, std::string&) { return v; }
+            static T Get(const type& v, const char*) { return v; }
+        };
+
+        // C字符串: 内容拷贝到事件中, 保存偏移
+        template<>
+        struct LogLazyArg<const char*> {
+            typedef size_t type;
+            static type Capture(const char* v, std::string& strings) {
+                if (!v) {
+                    return (size_t)-1;
+                }
+                size_t off = strings.size();
+                strings.append(v, strlen(v) + 1);
+                return off;
+            }
+            static const char* Get(type off, const char* strings) {
+                return off == (size_t)-1 ? nullptr : strings + off;
+            }
+        };
+
+        template<>
+        struct LogLazyArg<char*> : public LogLazyArg<const char*> {
+        };
+
+        template<class T>
+        struct IsLogCString : public std::false_type {};
+        template<>
+        struct IsLogCString<const char*> : public std::true_type {};
+        template<>
+        struct IsLogCString<char*> : public std::true_type {};
+
+        // 参数里C字符串的位置, 第i个参数是C字符串时第i位为1
+        template<class... Args>
+        constexpr uint64_t LogCStringArgs() {
+            const bool is_string[] = {false, IsLogCString<Args>::value...};
+            uint64_t mask = 0;
+            for (size_t i = 0; i < sizeof...(Args) && i < 64; ++i) {
+                if (is_string[i + 1]) {
+                    mask |= (uint64_t)1 << i;
+                }
+            }
+            return mask;
+        }
+    }
+
+    template<class... Args>
+    struct LogEvent::LazyFormat {
+        typedef std::tuple<typename detail::LogLazyArg<Args>::type...> Store;
+
+        static void Render(LogEvent* event) {
+            RenderImpl(event, std::index_sequence_for<Args...>());
+        }
+
+        template<size_t... I>
+        static void RenderImpl(LogEvent* event, std::index_sequence<I...>) {
+            const Store& store = *reinterpret_cast<const Store*>(event->m_lazyArgs);
+            event->format(event->m_lazyFmt
+                    , detail::LogLazyArg<Args>::Get(std::get<I>(store), event->m_lazyStrings.data())...);
+        }
     };
 
+    template<class... Args>
+    void LogEvent::formatLazy(LogFormatSite& site, const char* fmt, Args... args) {
+        typedef typename LazyFormat<Args...>::Store Store;
+        static_assert(std::is_trivially_destructible<Store>::value, "lazy log arguments must be trivially destructible");
+        render();   // 同一事件多次格式化时保持先后顺序
+        const uint64_t strings = detail::LogCStringArgs<Args...>();
+        if (sizeof...(Args) > 64 || (strings && !site.lazyStrings(fmt, strings))) {
+            format(fmt, args...);
+            return;
+        }
+        formatLazyImpl<Args...>(std::integral_constant<bool
+                , sizeof(Store) <= LAZY_ARGS_SIZE && alignof(Store) <= 16>(), fmt, args...);
+    }
+
+    template<class... Args>
+    void LogEvent::formatLazyImpl(std::true_type, const char* fmt, Args... args) {
+        typedef typename LazyFormat<Args...>::Store Store;
+        new (m_lazyArgs) Store(detail::LogLazyArg<Args>::Capture(args, m_lazyStrings)...);
+        m_lazyFmt = fmt;
+        m_lazyRender = &LazyFormat<Args...>::Render;
+    }
+
+    template<class... Args>
+    void LogEvent::formatLazyImpl(std::false_type, const char* fmt, Args... args) {
+        format(fmt, args...);
+    }
+
     // 日志事件包装器
     class LogEventWrap {
     public:
         LogEventWrap(LogEvent::ptr e);
+
+        /**
+         * @brief 从线程本地的事件池取一个LogEvent, 不分配内存
+         * @details 参数含义同LogEvent构造函数, thread_name只保存引用
+         */
+        LogEventWrap(std::shared_ptr<Logger> logger, LogLevel::Level level
+                ,const char* file, int32_t line, uint32_t elapse
+                ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+                ,const std::string& thread_name);
+
         // 析构的时候进行日志输出
         ~LogEventWrap();
 
         LogEvent::ptr getEvent() const { return m_event; }
-        std::stringstream& getSS();
+        std::ostream& getSS();
+
+    private:
+        LogEventWrap(const LogEventWrap&) = delete;
+        LogEventWrap& operator=(const LogEventWrap&) = delete;
 
     private:
         LogEvent::ptr m_event;  // 日志事件
+        LogEvent* m_pooled = nullptr;   // 来自事件池的事件, 析构时归还
+    };
+
+    /**
+     * @brief 单个日志调用点的限流器, 由SYLAR_LOG_EVERY_N/SYLAR_LOG_EVERY_MS宏为每个调用点静态创建
+     * @details 只用原子变量, 多线程共用同一个调用点时不加锁
+     */
+    class LogRateLimiter {
+    public:
+        // 限流判断结果, 允许输出时带上此前被跳过的条数
+        class Ticket {
+        public:
+            Ticket(bool pass, uint64_t suppressed)
+                :m_pass(pass)
+                ,m_suppressed(suppressed) {
+            }
+            explicit operator bool() const { return m_pass; }
+            uint64_t getSuppressed() const { return m_suppressed; }
+
+            // 把被跳过的条数写到事件内容的开头, 返回事件本身
+            LogEvent::ptr apply(LogEvent::ptr event) const;
+        private:
+            bool m_pass;
+            uint64_t m_suppressed;
+        };
+
+        // 每n次放行1次, n为0或1时全部放行
+        Ticket everyN(uint64_t n);
+        // 每ms毫秒最多放行1次
+        Ticket everyMs(uint64_t ms);
+    private:
+        Ticket pass();
+    private:
+        std::atomic<uint64_t> m_count = {0};        // 经过该调用点的次数
+        std::atomic<uint64_t> m_suppressed = {0};   // 上次放行之后被跳过的次数
+        std::atomic<uint64_t> m_last = {0};         // 上次放行的时间(毫秒)
     };
 
+    std::ostream& operator<<(std::ostream& os, const LogRateLimiter::Ticket& ticket);
+
     // 日志格式器
+    // 构造时把模版编译成一段指令序列, 格式化时顺序执行指令, 直接写入连续的字符缓冲
     class LogFormatter {
     public:
         typedef std::shared_ptr<LogFormatter> ptr;
@@ -201,20 +514,10 @@ namespace sylar {
         LogFormatter(const std::string& pattern);
 
         // 将LogEvent格式化为字符串
-        std::string format(std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event);
-        std::ostream& format(std::ostream& ofs, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
-
-    public:
-        // 具体日志内容项格式化
-        class FormatItem {
-        public:
-            typedef std::shared_ptr<FormatItem> ptr;
-
-            FormatItem(const std::string& fmt = "") {};
-            virtual ~FormatItem() {}
-            // 格式化日志到流
-            virtual void format(std::ostream& os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) = 0;
-        };
+        std::string format(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event);
+        std::ostream& format(std::ostream& ofs, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event);
+        // 将LogEvent格式化后追加到out末尾
+        void format(std::string& out, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event);
 
         void init();    // 初始化, 进行日志格式解析
 
@@ -223,11 +526,50 @@ namespace sylar {
          */
         bool isError() const { return m_error;}
 
+        /**
+         * @brief 格式里是否有%n, 有则输出到文件时每条日志刷新一次(原来std::endl的行为)
+         */
+        bool hasNewLine() const { return m_hasNewLine; }
+
         std::string getPattern() { return m_pattern; }
+    private:
+        // 格式指令
+        enum OpCode {
+            OP_STRING = 0,      // 常量字符串
+            OP_MESSAGE,         // %m 消息
+            OP_LEVEL,           // %p 日志级别
+            OP_ELAPSE,          // %r 累计毫秒数
+            OP_NAME,            // %c 日志名称
+            OP_THREAD_ID,       // %t 线程id
+            OP_NEWLINE,         // %n 换行
+            OP_DATETIME,        // %d 时间
+            OP_FILENAME,        // %f 文件名
+            OP_LINE,            // %l 行号
+            OP_TAB,             // %T Tab
+            OP_FIBER_ID,        // %F 协程id
+            OP_THREAD_NAME      // %N 线程名称
+        };
+
+        struct Op {
+            uint32_t code;      // OpCode
+            uint32_t offset;    // OP_STRING: 在m_strings中的偏移; OP_DATETIME: m_timeFormats下标
+            uint32_t length;    // OP_STRING: 长度
+        };
+
+        // %d 的时间格式, id全局唯一, 作为线程本地时间缓存的key
+        struct TimeFormat {
+            std::string format;
+            uint64_t id;
+        };
+
+        void appendTime(std::string& out, const TimeFormat& tf, time_t time) const;
     private:
         MutexType m_mutex;
         std::string m_pattern;              // 日志格式模版
-        std::vector<FormatItem::ptr> m_items;    // 日志格式解析后格式
+        std::vector<Op> m_ops;              // 日志格式编译后的指令
+        std::string m_strings;              // 常量字符串池
+        std::vector<TimeFormat> m_timeFormats;  // 时间格式
+        bool m_hasNewLine = false;          // 是否有%n, 输出到流时保持原来std::endl的刷新行为
         bool m_error = false;               // 是否有错误
     };
 
@@ -241,7 +583,8 @@ namespace sylar {
         virtual ~LogAppender() {}
 
         // 将日志输出到对应的落地点
-        virtual void log(std::shared_ptr<Logger> loger, LogLevel::Level level, LogEvent::ptr event) = 0;   // 纯虚函数
+        // event 可能来自线程本地的事件池, 只在本次调用期间有效, 不能保存
+        virtual void log(const std::shared_ptr<Logger>& loger, LogLevel::Level level, const LogEvent::ptr& event) = 0;   // 纯虚函数
 
         void setFormatter(LogFormatter::ptr val) {
             MutexType::Lock lock(m_mutex);
@@ -262,7 +605,8 @@ namespace sylar {
         }
 
         LogLevel::Level getLevel() const { return m_level; }
-        void setLevel(LogLevel::Level val) { m_level = val; }
+        // 修改级别后通知所有日志器重新计算有效级别
+        void setLevel(LogLevel::Level val);
 
         /**
          * @brief 将日志输出目标的配置转成YAML String
@@ -282,9 +626,12 @@ class Logger : public std::enable_shared_from_this<Logger>{
         typedef std::shared_ptr<Logger> ptr;
         typedef Spinlock MutexType;
 
+        typedef std::vector<LogAppender::ptr> AppenderList;
+
         Logger(const std::string& name = "root");
         // 写入日志，指定日志级别
-        void log(LogLevel::Level level, LogEvent::ptr event);
+        // 读端不加锁: 遍历的是RCU发布的Appender快照
+        void log(LogLevel::Level level, const LogEvent::ptr& event);
 
         void debug(LogEvent::ptr event);
         void info(LogEvent::ptr event);
@@ -292,15 +639,31 @@ class Logger : public std::enable_shared_from_this<Logger>{
         void error(LogEvent::ptr event);
         void fatal(LogEvent::ptr event);
 
+        // 修改Appender集合: 拷贝当前快照, 修改后发布新快照
         void addAppender(LogAppender::ptr appender);
         void delAppender(LogAppender::ptr appender);
         void clearAppenders();
         LogLevel::Level getLevel() const
         {
-            return m_level;
+            return m_level.load(std::memory_order_relaxed);
         }
-        void setLevel(LogLevel::Level val) {
-            m_level = val;
+        void setLevel(LogLevel::Level val);
+
+        /**
+         * @brief 有效日志级别: 日志器级别和所有Appender中最低级别的较大者, 没有Appender时汇总主日志器的
+         * @details 日志宏用它过滤, 所有Appender都不会输出的日志在取事件和保存参数之前就被丢弃.
+         *          任何日志器或Appender的级别、Appender集合变化时全局版本号加一, 这里发现版本号变化才重新计算
+         */
+        LogLevel::Level getEffectiveLevel() {
+            if (m_levelVersion.load(std::memory_order_acquire) != s_levelVersion.load(std::memory_order_acquire)) {
+                return updateEffectiveLevel();
+            }
+            return m_effectiveLevel.load(std::memory_order_relaxed);
+        }
+
+        // 使所有日志器缓存的有效级别失效
+        static void InvalidateEffectiveLevel() {
+            s_levelVersion.fetch_add(1, std::memory_order_acq_rel);
         }
 
         const std::string& getName() const {
@@ -323,37 +686,326 @@ class Logger : public std::enable_shared_from_this<Logger>{
          */
         Logger::ptr getRoot() const { return m_root;}
 
+    private:
+        LogLevel::Level updateEffectiveLevel();
     private:
         std::string m_name;                         // 日志名称
-        LogLevel::Level m_level;                    // 日志级别
-        std::list<LogAppender::ptr> m_appenders;    // Appender集合
+        std::atomic<LogLevel::Level> m_level;       // 日志级别
+        std::atomic<LogLevel::Level> m_effectiveLevel = {LogLevel::DEBUG};  // 有效日志级别
+        std::atomic<uint64_t> m_levelVersion = {0};     // m_effectiveLevel对应的全局版本号
+        static std::atomic<uint64_t> s_levelVersion;    // 全局级别版本号
+        RCUPointer<AppenderList> m_appenders;       // Appender集合快照
         LogFormatter::ptr m_formatter;              // 日志格式器
         Logger::ptr m_root;                         // 主日志器
-        MutexType m_mutex;
+        MutexType m_mutex;                          // 串行化写端(修改Appender/格式器)
     };
 
     // 输出到控制台的Appender
     class StdoutLogAppender : public LogAppender {
     public:
         typedef std::shared_ptr<StdoutLogAppender> ptr;
-        void log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override;
+        void log(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) override;
         std::string toYamlString() override;
     };
 
-    // 定义输出到文件Appender
+    // 日志文件滚动配置
+    struct LogRotateConfig {
+        // 按时间滚动的周期
+        enum Interval {
+            NONE = 0,
+            HOUR = 1,
+            DAY = 2
+        };
+
+        uint64_t max_size = 0;      // 单个文件最大字节数, 0表示不按大小滚动
+        Interval interval = NONE;   // 按时间滚动的周期
+        uint32_t max_files = 0;     // 保留的历史文件个数, 0表示不清理
+        bool compress = false;      // 历史文件是否gzip压缩
+
+        bool operator==(const LogRotateConfig& oth) const {
+            return max_size == oth.max_size
+                && interval == oth.interval
+                && max_files == oth.max_files
+                && compress == oth.compress;
+        }
+
+        static const char* IntervalToString(Interval v);
+        static Interval IntervalFromString(const std::string& str);
+    };
+
+    class LogRotator;
+
+    /**
+     * @brief 定义输出到文件Appender
+     * @details 文件以追加方式打开. 滚动、压缩、清理历史文件以及文件被删除后的重新打开
+     *          都由后台线程(log_rotate)完成, 写日志的线程只负责写入和判断是否达到滚动条件,
+     *          不会在open/rename上阻塞. 历史文件命名为 文件名.YYYYmmdd-HHMMSS[.N][.gz]
+     */
     class FileLogAppender : public LogAppender {
+    friend class LogRotator;
     public:
         typedef std::shared_ptr<FileLogAppender> ptr;
         FileLogAppender(const std::string& filename);
-        void log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override;
+        ~FileLogAppender();
+        void log(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) override;
         std::string toYamlString() override;
 
         // 重新打开日志文件
         bool reopen();
+
+        void setRotateConfig(const LogRotateConfig& conf);
+        LogRotateConfig getRotateConfig();
+    protected:
+        // 指定打开方式, 供需要二进制写入的子类使用
+        FileLogAppender(const std::string& filename, std::ios::openmode mode);
+
+        /**
+         * @brief 写入文件, 调用者需持有m_mutex
+         * @details 累计文件大小, 达到滚动条件时通知后台线程
+         * @param[in] now 当前时间(秒), 用于判断按时间滚动
+         */
+        void writeLocked(const char* data, size_t len, uint64_t now);
+
     private:
+        /**
+         * @brief 后台线程调用, 检查滚动条件和文件是否被删除
+         * @param[out] rotated 本次滚动产生的历史文件, 由后台线程在锁外压缩和清理
+         */
+        void checkRotate(uint64_t now, std::vector<std::string>& rotated);
+        // 打开新文件并替换当前文件流, 文件系统操作都在锁外完成
+        bool switchFile(uint64_t now);
+    protected:
         std::string m_filename;     // 文件路径
         std::ofstream m_filestream;  // 文件流
-        uint64_t m_lastTime = 0;    // 上次重新打开的时间
+        std::ios::openmode m_openMode = std::ios::out | std::ios::app;  // 文件打开方式
+        uint64_t m_fileGen = 0;     // 文件每被替换一次加一, 子类据此重置和文件相关的状态
+        LogRotateConfig m_rotate;   // 滚动配置
+    private:
+        uint64_t m_size = 0;        // 当前文件大小
+        uint64_t m_nextRotate = 0;  // 下一次按时间滚动的时间点, 0表示不按时间滚动
+        uint64_t m_inode = 0;       // 当前文件的inode, 用于发现文件被删除或替换
+        std::atomic<bool> m_rotatePending = {false};  // 已通知后台线程滚动
+    };
+
+    // 异步输出到文件的Appender
+    // 业务线程只把格式化好的日志追加到内存缓冲, 写满的缓冲交给后台刷盘线程批量写入文件
+    class AsyncFileLogAppender : public FileLogAppender {
+    public:
+        typedef std::shared_ptr<AsyncFileLogAppender> ptr;
+        typedef Mutex BufferMutexType;
+
+        // 缓冲全部写满时的处理策略
+        enum OverflowPolicy {
+            BLOCK = 0,  // 阻塞写日志的线程, 直到有缓冲被刷盘
+            DROP = 1    // 直接丢弃日志, 并计数
+        };
+
+        /**
+         * @brief 构造函数
+         * @param[in] filename 文件路径
+         * @param[in] buffer_size 单个缓冲大小(字节)
+         * @param[in] max_buffers 最多同时存在的缓冲个数, 内存上限为 buffer_size * max_buffers
+         * @param[in] flush_interval 刷盘间隔(毫秒), 缓冲未写满时也会按此间隔落盘
+         * @param[in] policy 缓冲写满时的处理策略
+         */
+        AsyncFileLogAppender(const std::string& filename
+                            ,size_t buffer_size = 1024 * 1024
+                            ,size_t max_buffers = 16
+                            ,uint32_t flush_interval = 1000
+                            ,OverflowPolicy policy = BLOCK);
+        ~AsyncFileLogAppender();
+
+        void log(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) override;
+        std::string toYamlString() override;
+
+        // 把所有缓冲中的日志立即写入文件(调用线程中完成)
+        void flush();
+
+        // 因缓冲写满被丢弃的日志条数
+        uint64_t getDropped() const { return m_dropped; }
+
+        static const char* PolicyToString(OverflowPolicy policy);
+        static OverflowPolicy PolicyFromString(const std::string& str);
+    private:
+        // 后台刷盘线程执行函数
+        void flushThread();
+        // 取出已有的缓冲并写入文件
+        void drain();
+        // 取一个空闲缓冲作为当前缓冲(需持有m_bufMutex)
+        void nextBuffer();
+    private:
+        BufferMutexType m_bufMutex;             // 保护下面的缓冲
+        std::condition_variable_any m_cond;     // 通知刷盘线程
+        std::condition_variable_any m_notFull;  // 通知被阻塞的写日志线程
+        std::string m_current;                  // 当前写入的缓冲
+        std::vector<std::string> m_full;        // 写满等待刷盘的缓冲
+        std::vector<std::string> m_spare;       // 刷盘后回收的空闲缓冲
+        size_t m_flushing = 0;                  // 正在刷盘的缓冲个数
+        size_t m_bufferSize;
+        size_t m_maxBuffers;
+        uint32_t m_flushInterval;
+        OverflowPolicy m_policy;
+        bool m_running = true;
+        std::atomic<uint64_t> m_dropped = {0};
+        BufferMutexType m_writeMutex;           // 串行化文件写入, 保证日志顺序
+        Thread::ptr m_thread;                   // 刷盘线程
+    };
+
+    // 日志调用点(文件名 + 行号)注册表, 为每个调用点分配进程内唯一的紧凑id
+    class LogCallSiteRegistry {
+    public:
+        // 获取调用点id, 线程本地缓存命中时不加锁
+        static uint32_t GetId(const char* file, int32_t line);
+        // 根据id查询调用点
+        static bool Get(uint32_t id, const char*& file, int32_t& line);
+    };
+
+    /**
+     * @brief 二进制格式输出到文件的Appender, 不在运行时把日志转换成文本
+     * @details 文件格式(整数均为LEB128变长编码, 时间为与上一条日志差值的zigzag编码):
+     *          文件头:   "SYLB" 版本(1字节) 格式模版长度 格式模版
+     *          调用点:   0x01 调用点id 行号 文件名长度 文件名
+     *          名称:     0x02 名称id 长度 名称(日志器名称/线程名称)
+     *          日志事件: 0x03 级别(1字节) 调用点id 时间差 elapse 线程id 协程id 线程名称id 日志器名称id 消息长度 消息
+     *          每次打开文件都会写入文件头, 之后的调用点和名称定义重新开始, 解码时遇到文件头要清空字典
+     *          使用 sylar_logcat 把文件还原成格式模版对应的文本
+     */
+    class BinaryFileLogAppender : public FileLogAppender {
+    public:
+        typedef std::shared_ptr<BinaryFileLogAppender> ptr;
+
+        enum RecordType {
+            RECORD_SITE = 0x01,
+            RECORD_NAME = 0x02,
+            RECORD_EVENT = 0x03
+        };
+
+        static const char MAGIC[4];
+        static const uint8_t VERSION = 1;
+
+        BinaryFileLogAppender(const std::string& filename);
+        void log(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) override;
+        std::string toYamlString() override;
+
+        void flush();
+    private:
+        // 名称id, 第一次出现时写入名称定义
+        uint32_t nameId(const std::string& name);
+    private:
+        std::string m_buf;                          // 编码缓冲
+        std::vector<bool> m_sites;                  // 当前文件已经定义过的调用点
+        std::map<std::string, uint32_t> m_names;    // 当前文件已经定义过的名称
+        uint64_t m_prevTime = 0;                    // 上一条日志的时间
+        uint64_t m_gen = 0;                         // 字典对应的文件, 与m_fileGen不同时需要重新写文件头
+    };
+
+    // 读取BinaryFileLogAppender输出的文件
+    class BinaryLogReader {
+    public:
+        BinaryLogReader(std::istream& is);
+
+        /**
+         * @brief 读取下一条日志事件
+         * @param[out] event 日志事件(不关联日志器)
+         * @param[out] logger_name 日志器名称
+         * @return 文件结束或者格式错误返回false
+         */
+        bool next(LogEvent::ptr& event, std::string& logger_name);
+
+        // 最近一次读到的文件头中的格式模版
+        const std::string& getPattern() const { return m_pattern; }
+
+        bool isError() const { return m_error; }
+    private:
+        bool readVarint(uint64_t& v);
+        bool readString(std::string& str);
+        bool readHeader();
+    private:
+        std::istream& m_is;
+        std::string m_pattern;
+        std::map<uint64_t, std::pair<std::string, int32_t> > m_sites;
+        std::map<uint64_t, std::string> m_names;
+        uint64_t m_prevTime = 0;
+        bool m_error = false;
+    };
+
+    /**
+     * @brief 写入文件映射环形缓冲区的Appender, 用于进程崩溃后找回最近的日志
+     * @details 文件开头是一页文件头, 之后是capacity字节的环形数据区. 写日志时对游标做一次
+     *          fetch_add占位, 然后memcpy格式化好的内容, 不加锁也不发起系统调用; 数据写在
+     *          MAP_SHARED映射上, 进程崩溃后仍由内核写回文件. 每条记录按16字节对齐, 记录头中的
+     *          位置最后写入, 读取时据此识别出被覆盖或者没写完的记录. 用 sylar_ringcat 还原
+     */
+    class MmapRingLogAppender : public LogAppender {
+    public:
+        typedef std::shared_ptr<MmapRingLogAppender> ptr;
+
+        static const char MAGIC[4];
+        static const uint32_t VERSION = 1;
+        static const size_t HEADER_SIZE = 4096;     // 文件头占用的字节数
+        static const size_t ALIGN = 16;             // 记录对齐字节数
+
+        // 文件头
+        struct Header {
+            char magic[4];
+            uint32_t version;
+            uint64_t capacity;                      // 数据区大小
+            std::atomic<uint64_t> cursor;           // 累计写入的字节数, 对capacity取模为写入位置
+        };
+
+        // 记录头, 后面紧跟len字节的内容
+        struct Record {
+            std::atomic<uint64_t> pos;              // 记录的累计位置 + 1, 内容写完后才写入
+            uint32_t len;                           // 内容长度
+            uint32_t reserved;
+        };
+
+        /**
+         * @brief 构造函数
+         * @param[in] filename 文件路径, 已存在且容量相同时接着原来的游标写
+         * @param[in] size 数据区大小(字节)
+         */
+        MmapRingLogAppender(const std::string& filename, size_t size = 8 * 1024 * 1024);
+        ~MmapRingLogAppender();
+
+        void log(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) override;
+        std::string toYamlString() override;
+
+        // 映射是否成功
+        bool isValid() const { return m_header != nullptr; }
+        // 同步写回文件(正常运行不需要调用)
+        void sync();
+    private:
+        std::string m_filename;
+        size_t m_capacity = 0;
+        Header* m_header = nullptr;
+        char* m_data = nullptr;
+    };
+
+    // 从MmapRingLogAppender的文件中按顺序还原日志
+    class MmapRingLogReader {
+    public:
+        MmapRingLogReader(const std::string& filename);
+
+        // 文件是否是合法的环形日志文件
+        bool isValid() const { return m_valid; }
+
+        // 读取下一条日志, 没有时返回false
+        bool next(std::string& record);
+
+        // 因被覆盖或没写完而跳过的字节数
+        uint64_t getSkipped() const { return m_skipped; }
+    private:
+        // 从pos开始向后找到第一条完整的记录
+        bool seek();
+        bool readRecord(uint64_t pos, std::string* record, uint64_t& next);
+    private:
+        std::string m_data;         // 数据区
+        uint64_t m_capacity = 0;
+        uint64_t m_end = 0;         // 文件头中的游标
+        uint64_t m_pos = 0;         // 下一条记录的位置
+        uint64_t m_skipped = 0;
+        bool m_valid = false;
     };
 
     // 日志管理类
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <cstdint>
 #include <pthread.h>
+#include <sched.h>
 #include <atomic>
 
 namespace sylar
@@ -328,6 +329,13 @@ namespace sylar
             pthread_spin_lock(&m_mutex);
         }
 
+        /**
+         * @brief 尝试加锁, 锁被占用时立即返回false
+         */
+        bool tryLock() {
+            return pthread_spin_trylock(&m_mutex) == 0;
+        }
+
         void unlock() {
             pthread_spin_unlock(&m_mutex);
         }
@@ -335,6 +343,200 @@ namespace sylar
         pthread_spinlock_t m_mutex;
     };
 
+    /**
+     * @brief 读-拷贝-更新(RCU)方式保护的指针
+     * @details 读端只对计数器做一次原子加、一次原子减, 不加锁也不自旋等待;
+     *          写端发布新对象后等待宽限期(所有可能持有旧对象的读端退出)再释放旧对象.
+     *          读端计数按纪元分成两组, 写端等待其中一组时新的读端进入另一组, 写端不会被饿死.
+     * @attention 写端调用update需要由调用方串行化; 持有ReadGuard的线程不能调用update(会死锁)
+     */
+    template<class T>
+    class RCUPointer {
+    public:
+        // 读端临界区, 生命周期内get()返回的对象不会被释放
+        class ReadGuard {
+        public:
+            ReadGuard(RCUPointer& rcu)
+                : m_rcu(rcu)
+            {
+                m_index = m_rcu.m_epoch.load() & 1;
+                m_rcu.m_readers[m_index].count.fetch_add(1);
+                m_ptr = m_rcu.m_ptr.load();
+            }
+
+            ~ReadGuard()
+            {
+                m_rcu.m_readers[m_index].count.fetch_sub(1, std::memory_order_release);
+            }
+
+            const T* get() const { return m_ptr; }
+            const T* operator->() const { return m_ptr; }
+            const T& operator*() const { return *m_ptr; }
+        private:
+            ReadGuard(const ReadGuard&) = delete;
+            ReadGuard& operator=(const ReadGuard&) = delete;
+        private:
+            RCUPointer& m_rcu;
+            const T* m_ptr;
+            uint32_t m_index;
+        };
+
+        RCUPointer(T* val = nullptr)
+            : m_ptr(val)
+        {
+        }
+
+        ~RCUPointer()
+        {
+            delete m_ptr.load();
+        }
+
+        /**
+         * @brief 发布新对象, 等待宽限期后释放旧对象
+         */
+        void update(T* val)
+        {
+            T* old = m_ptr.exchange(val);
+            synchronize();
+            delete old;
+        }
+
+        /**
+         * @brief 写端直接读取当前对象(调用方已串行化写端)
+         */
+        const T* unsafeGet() const { return m_ptr.load(std::memory_order_relaxed); }
+    private:
+        // 等待两组读端计数依次归零
+        void synchronize()
+        {
+            for (int i = 0; i < 2; ++i)
+            {
+                uint32_t index = m_epoch.fetch_add(1) & 1;
+                while (m_readers[index].count.load(std::memory_order_acquire) != 0)
+                {
+                    sched_yield();
+                }
+            }
+        }
+    private:
+        RCUPointer(const RCUPointer&) = delete;
+        RCUPointer& operator=(const RCUPointer&) = delete;
+
+        // 两组计数放在不同的缓存行. 用填充而不用alignas(64), C++14下new不保证超出16字节的对齐
+        struct ReaderCount {
+            std::atomic<uint64_t> count = {0};
+            char pad[64 - sizeof(std::atomic<uint64_t>)];
+        };
+    private:
+        std::atomic<T*> m_ptr;
+        std::atomic<uint32_t> m_epoch = {0};
+        ReaderCount m_readers[2];
+    };
+
+    /**
+     * @brief 侵入式无锁队列的节点, 放入队列的对象继承它
+     */
+    struct MPSCNode {
+        std::atomic<MPSCNode*> next = {nullptr};
+    };
+
+    /**
+     * @brief 侵入式无锁多生产者单消费者队列(Vyukov)
+     * @details push只有一次原子交换, 不加锁不重试(wait-free), 队列本身不分配内存;
+     *          pop同一时刻只能有一个消费者调用.
+     *          生产者交换完队尾还没链上next时, pop会暂时返回nullptr, 稍后重试即可
+     */
+    class MPSCQueue {
+    public:
+        MPSCQueue()
+            : m_head(&m_stub)
+            , m_tail(&m_stub)
+        {
+        }
+
+        /**
+         * @brief 入队, 任意线程可调用
+         */
+        void push(MPSCNode* node)
+        {
+            node->next.store(nullptr, std::memory_order_relaxed);
+            MPSCNode* prev = m_head.exchange(node, std::memory_order_acq_rel);
+            prev->next.store(node, std::memory_order_release);
+        }
+
+        /**
+         * @brief 把first到last已经连好的一串节点一次入队, 任意线程可调用
+         * @pre 从first沿next能走到last
+         */
+        void pushChain(MPSCNode* first, MPSCNode* last)
+        {
+            last->next.store(nullptr, std::memory_order_relaxed);
+            MPSCNode* prev = m_head.exchange(last, std::memory_order_acq_rel);
+            prev->next.store(first, std::memory_order_release);
+        }
+
+        /**
+         * @brief 查看队头但不出队, 只能由消费者调用
+         * @return 队列为空时返回nullptr; 不为nullptr时随后的pop返回它或者nullptr(生产者正在入队)
+         */
+        MPSCNode* peek()
+        {
+            MPSCNode* tail = m_tail;
+            if (tail == &m_stub)
+            {
+                return tail->next.load(std::memory_order_acquire);
+            }
+            return tail;
+        }
+
+        /**
+         * @brief 出队, 只能由一个消费者调用
+         * @return 队列为空或者有生产者正在入队时返回nullptr
+         */
+        MPSCNode* pop()
+        {
+            MPSCNode* tail = m_tail;
+            MPSCNode* next = tail->next.load(std::memory_order_acquire);
+            if (tail == &m_stub)
+            {
+                if (!next)
+                {
+                    return nullptr;
+                }
+                m_tail = next;
+                tail = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+            if (next)
+            {
+                m_tail = next;
+                return tail;
+            }
+            if (tail != m_head.load(std::memory_order_acquire))
+            {
+                return nullptr;
+            }
+            // 只剩最后一个节点, 把stub放回队尾才能把它取出来
+            push(&m_stub);
+            next = tail->next.load(std::memory_order_acquire);
+            if (next)
+            {
+                m_tail = next;
+                return tail;
+            }
+            return nullptr;
+        }
+    private:
+        MPSCQueue(const MPSCQueue&) = delete;
+        MPSCQueue& operator=(const MPSCQueue&) = delete;
+    private:
+        // 生产者和消费者改的指针放在不同的缓存行, 用填充隔开(不用alignas, 见RCUPointer::ReaderCount)
+        std::atomic<MPSCNode*> m_head;
+        char m_pad[64 - sizeof(std::atomic<MPSCNode*>)];
+        MPSCNode* m_tail;
+        MPSCNode m_stub;
+    };
+
     // 原子锁
     class CASLock {
     public:
@@ -6,6 +6,13 @@
 #include "fiber.h"
 #include "log.h"
 #include "macro.h"
+#include "config.h"
+#include "util.h"
+#include "affinity.h"
+
+#include <algorithm>
+#include <sstream>
+#include <unistd.h>
 
 
 namespace sylar {
@@ -14,6 +21,143 @@ namespace sylar {
 
     static thread_local Scheduler* t_scheduler = nullptr;   // 当前调度器
     static thread_local Fiber* t_scheduler_fiber = nullptr; // 当前调度器对应的协程
+    static thread_local void* t_worker = nullptr;   // 当前线程的Scheduler::Worker
+    static thread_local Fiber* t_idle_fiber = nullptr;  // 当前线程调度器的idle协程
+
+    // 每取多少次任务优先看一次全局队列, 防止本地队列一直有任务时全局队列饿死
+    static const uint32_t GLOBAL_QUEUE_INTERVAL = 61;
+    // 从全局队列一次最多搬到本地队列的任务数
+    static const size_t GLOBAL_QUEUE_BATCH = 128;
+    // 每个线程最多缓存的空闲TaskNode, 超过后一半还给全局池
+    static const size_t NODE_CACHE_MAX = 256;
+    // 全局池最多保留的空闲TaskNode, 超过直接释放
+    static const size_t NODE_POOL_MAX = 64 * 1024;
+    // 各优先级步长的分子, 步长 = PRIORITY_STRIDE / 权重
+    static const uint64_t PRIORITY_STRIDE = 1 << 20;
+
+    static ConfigVar<std::vector<uint32_t> >::ptr g_priority_weights =
+            Config::Lookup("scheduler.priority_weights", std::vector<uint32_t>{8, 4, 1},
+                           "scheduler priority weights (high, normal, low)");
+
+    static ConfigVar<uint64_t>::ptr g_stats_interval =
+            Config::Lookup<uint64_t>("scheduler.stats_interval", 0,
+                                     "scheduler stats dump interval in ms, 0 means off");
+
+    static ConfigVar<std::string>::ptr g_stats_logger =
+            Config::Lookup<std::string>("scheduler.stats_logger", "system",
+                                        "logger name for scheduler stats dump");
+
+    static ConfigVar<uint64_t>::ptr g_slice_budget =
+            Config::Lookup<uint64_t>("scheduler.slice_budget", 0,
+                                     "max ms a fiber may run without yielding before the watchdog warns, 0 means off");
+
+    static ConfigVar<bool>::ptr g_slice_yield =
+            Config::Lookup<bool>("scheduler.slice_yield", true,
+                                 "set Fiber::ShouldYield when a fiber runs over scheduler.slice_budget");
+
+    static ConfigVar<uint32_t>::ptr g_fiber_pool_size =
+            Config::Lookup<uint32_t>("scheduler.fiber_pool_size", 32,
+                                     "finished callback fibers kept per scheduler thread for reuse");
+
+    static ConfigVar<bool>::ptr g_shared_stack =
+            Config::Lookup<bool>("scheduler.shared_stack", false,
+                                 "run scheduled callbacks in shared-stack fibers");
+
+    static ConfigVar<uint64_t>::ptr g_max_queue_depth =
+            Config::Lookup<uint64_t>("scheduler.max_queue_depth", 0,
+                                     "scheduler max pending tasks, 0 means unlimited");
+
+    static ConfigVar<std::string>::ptr g_overflow_policy =
+            Config::Lookup<std::string>("scheduler.overflow_policy", "reject",
+                                        "scheduler overflow policy: reject, block, drop_oldest");
+
+    // 只有一个线程写的计数, 不需要原子的读改写
+    static inline void StatAdd(std::atomic<uint64_t>& stat, uint64_t n) {
+        stat.store(stat.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // 耗时(us)落在哪个桶, 第i个桶为[2^(i-1), 2^i)
+    static inline size_t HistogramBucket(uint64_t us) {
+        size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+        return std::min(bucket, Scheduler::WorkerStats::HISTOGRAM_BUCKETS - 1);
+    }
+
+    // 分布的p分位数, 返回所在桶的上界
+    static uint64_t HistogramPercentile(const uint64_t* histogram, double p) {
+        uint64_t total = 0;
+        for (size_t i = 0; i < Scheduler::WorkerStats::HISTOGRAM_BUCKETS; ++i) {
+            total += histogram[i];
+        }
+        uint64_t sum = 0;
+        for (size_t i = 0; i < Scheduler::WorkerStats::HISTOGRAM_BUCKETS; ++i) {
+            sum += histogram[i];
+            if (total && sum >= total * p) {
+                return i == 0 ? 0 : 1ull << i;
+            }
+        }
+        return 0;
+    }
+
+    struct Scheduler::TaskNodeCache {
+        // 线程间共享的空闲节点池, 线程缓存空了或满了时批量存取
+        struct Pool {
+            Spinlock mutex;
+            std::vector<TaskNode*> nodes;
+        };
+
+        static Pool* GetPool() {
+            // 不析构, 线程退出时还能往里还节点
+            static Pool* s_pool = new Pool;
+            return s_pool;
+        }
+
+        // 从nodes尾部挪count个到pool, pool满了直接释放
+        void release(size_t count) {
+            Pool* pool = GetPool();
+            Spinlock::Lock lock(pool->mutex);
+            for (; count > 0 && !nodes.empty(); --count) {
+                if (pool->nodes.size() < NODE_POOL_MAX) {
+                    pool->nodes.push_back(nodes.back());
+                } else {
+                    delete nodes.back();
+                }
+                nodes.pop_back();
+            }
+        }
+
+        ~TaskNodeCache() {
+            release(nodes.size());
+        }
+
+        std::vector<TaskNode*> nodes;
+    };
+
+    thread_local Scheduler::TaskNodeCache Scheduler::s_nodeCache;
+
+    Scheduler::TaskNode* Scheduler::AllocTaskNode() {
+        std::vector<TaskNode*>& nodes = s_nodeCache.nodes;
+        if (nodes.empty()) {
+            TaskNodeCache::Pool* pool = TaskNodeCache::GetPool();
+            Spinlock::Lock lock(pool->mutex);
+            size_t count = std::min(pool->nodes.size(), NODE_CACHE_MAX / 2);
+            nodes.insert(nodes.end(), pool->nodes.end() - count, pool->nodes.end());
+            pool->nodes.resize(pool->nodes.size() - count);
+        }
+        if (nodes.empty()) {
+            return new TaskNode;
+        }
+        TaskNode* node = nodes.back();
+        nodes.pop_back();
+        return node;
+    }
+
+    void Scheduler::FreeTaskNode(TaskNode* node) {
+        node->task.reset();
+        s_nodeCache.nodes.push_back(node);
+        if (s_nodeCache.nodes.size() > NODE_CACHE_MAX) {
+            s_nodeCache.release(NODE_CACHE_MAX / 2);
+        }
+    }
 
     Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
         : m_name(name)
@@ -40,6 +184,23 @@ namespace sylar {
             m_rootThread = -1;
         }
         m_threadCount = threads;
+        for (int i = 0; i < PRIORITY_COUNT; ++i) {
+            m_priorityCount[i] = 0;
+            m_stride[i] = PRIORITY_STRIDE;
+        }
+
+        std::string policy = g_overflow_policy->getValue();
+        if (policy == "block") {
+            m_overflowPolicy = OVERFLOW_BLOCK;
+        } else if (policy == "drop_oldest") {
+            m_overflowPolicy = OVERFLOW_DROP_OLDEST;
+        } else if (policy != "reject") {
+            SYLAR_LOG_ERROR(g_logger) << m_name << " invalid scheduler.overflow_policy=" << policy
+                                      << ", use reject";
+        }
+        m_maxQueueDepth = g_max_queue_depth->getValue();
+        m_sharedStack = g_shared_stack->getValue();
+        m_fiberPoolSize = g_fiber_pool_size->getValue();
     }
 
     Scheduler::~Scheduler(){
@@ -73,12 +234,118 @@ namespace sylar {
         m_stopping = false;
         SYLAR_ASSERT(m_threads.empty());    // 保证线程池为空
 
-        // 创建线程
+        std::vector<uint32_t> weights = g_priority_weights->getValue();
+        for (int i = 0; i < PRIORITY_COUNT; ++i) {
+            uint32_t weight = i < (int)weights.size() ? weights[i] : 0;
+            if (weight == 0) {
+                SYLAR_LOG_ERROR(g_logger) << m_name << " invalid scheduler.priority_weights[" << i
+                                          << "], use 1";
+                weight = 1;
+            }
+            m_stride[i] = PRIORITY_STRIDE / weight;
+        }
+
+        // 每个调度线程一个本地队列, 主线程(use_caller)的放在最后
+        m_workers.clear();
+        m_workers.resize(getWorkerCount());
+        m_threadWorkers.clear();
+        if (m_rootFiber)
+        {
+            Worker* worker = new Worker;
+            worker->scheduler = this;
+            worker->index = m_workers.size() - 1;
+            worker->thread = m_rootThread;
+            m_workers.back().reset(worker);
+            m_threadWorkers[m_rootThread] = worker;
+        }
+
+        // 按fox_thread.placement绑核, 没有配置时不绑定, 只有一组
+        size_t group_count = 1;
+        std::vector<WorkerPlacement> placement = GetWorkerPlacement(m_name, m_threadCount, group_count);
+
+        // 创建线程, 线程绑核之后自己分配Worker, 按first touch落在本节点的内存上;
+        // 所有Worker就绪之后才开始调度
+        std::shared_ptr<Semaphore> ready(new Semaphore);
+        std::shared_ptr<Semaphore> gate(new Semaphore);
         m_threads.resize(m_threadCount);
         for (size_t i = 0; i < m_threadCount; ++i)
         {
-            m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this), m_name + "_" + std::to_string(i)));
-            m_threadIds.push_back(m_threads[i]->getId());
+            WorkerPlacement place;
+            if (i < placement.size())
+            {
+                place = placement[i];
+            }
+            m_threads[i].reset(new Thread([this, i, place, ready, gate]() {
+                if (!place.cpus.empty())
+                {
+                    SetThreadAffinity(place.cpus);
+                }
+                Worker* worker = new Worker;
+                worker->scheduler = this;
+                worker->index = i;
+                worker->group = place.group;
+                worker->thread = sylar::GetThreadId();
+                m_workers[i].reset(worker);
+                ready->notify();
+                gate->wait();
+                t_worker = worker;
+                run();
+            }, m_name + "_" + std::to_string(i)));
+            ready->wait();
+            Worker* worker = m_workers[i].get();
+            m_threadIds.push_back(worker->thread);
+            m_threadWorkers[worker->thread] = worker;
+        }
+
+        m_groups.clear();
+        m_groups.resize(group_count);
+        for (auto& i : m_workers)
+        {
+            m_groups[i->group].push_back(i.get());
+        }
+
+        // start之前指定了线程的任务分到对应线程的mailbox
+        for (auto it = m_fibers.begin(); it != m_fibers.end();)
+        {
+            if (it->thread == -1)
+            {
+                ++it;
+                continue;
+            }
+            auto wit = m_threadWorkers.find(it->thread);
+            if (wit == m_threadWorkers.end())
+            {
+                SYLAR_LOG_ERROR(g_logger) << m_name << " schedule to unknown thread " << it->thread
+                                          << ", run on any thread";
+                it->thread = -1;
+                TaskNode* node = AllocTaskNode();
+                node->task = std::move(*it);
+                m_injectQueue[node->task.priority].push(node);
+                ++m_priorityCount[node->task.priority];
+                m_fibers.erase(it++);
+                continue;
+            }
+            Worker* worker = wit->second;
+            TaskNode* node = AllocTaskNode();
+            node->task = std::move(*it);
+            worker->mailbox.push(node);
+            ++worker->pinned;
+            --m_taskCount;
+            m_fibers.erase(it++);
+        }
+        m_workersReady = true;
+        uint64_t interval = g_stats_interval->getValue();
+        m_nextDumpUs = interval ? GetCurrentUS() + interval * 1000 : 0;
+        m_sliceBudgetUs = g_slice_budget->getValue() * 1000;
+        m_sliceYield = g_slice_yield->getValue();
+        if (m_sliceBudgetUs)
+        {
+            m_watchdogStop = false;
+            m_watchdog.reset(new Thread(std::bind(&Scheduler::watchdog, this), m_name + "_watchdog"));
+        }
+        for (size_t i = 0; i < m_threadCount; ++i)
+        {
+            gate->notify();
         }
         lock.unlock();  // run函数里面有锁，所以只有这里释放了，其他线程才能run
 
@@ -100,6 +367,7 @@ namespace sylar {
             m_stopping = true;
 
             if(stopping()) {
+                stopWatchdog();
                 return;
             }
         }
@@ -144,6 +412,8 @@ namespace sylar {
         for(auto& i : thrs) {
             i->join();
         }
+        stopWatchdog();
+        m_workersReady = false;
         //if(exit_on_this_fiber) {
         //}
     }
@@ -161,7 +431,15 @@ namespace sylar {
             t_scheduler_fiber = Fiber::GetThis().get();
         }
 
+        // 调度线程在start里已经绑定了worker, 剩下的是use_caller的主线程
+        if (!t_worker) {
+            t_worker = m_workers.back().get();
+        }
+        Worker* worker = (Worker*)t_worker;
+        Fiber::SetSliceFlags(&worker->sliceFlags);
+
         Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
+        t_idle_fiber = idle_fiber.get();
         Fiber::ptr cb_fiber;
 
         FiberAndThread ft;
@@ -169,42 +447,21 @@ namespace sylar {
         while (true) {
             ft.reset();
             bool tickle_me = false;
-            bool is_active = false;
             // 从队列中取出一个应该要执行的消息任务
-            {
-                MutexType::Lock lock(m_mutex);
-                auto it = m_fibers.begin();
-                while (it != m_fibers.end())
-                {
-                    // 设置的id不等于当前线程id,不做该任务
-                    if (it->thread != -1 && it->thread != sylar::GetThreadId()) {
-                        ++it;
-                        tickle_me = true;   // 要通知其他线程
-                        continue;
-                    }
-
-                    SYLAR_ASSERT(it->fiber || it->cb);  // 有协程 或者 回调函数, 任务非空
-                    if (it->fiber && it->fiber->getState() == Fiber::EXEC) {    // 如果是协程，并且状态为执行完毕，则下一个
-                        ++it;
-                        continue;
-                    }
-
-                    ft = *it;
-                    m_fibers.erase(it++);
-                    ++m_activeThreadCount;
-                    is_active = true;
-                    break;
-                }
-                tickle_me |= it != m_fibers.end();
-            }
+            bool is_active = takeTask(worker, ft, tickle_me);
             if (tickle_me) {
                 tickle();
             }
 
             if (ft.fiber && (ft.fiber->getState() != Fiber::TERM
                          && ft.fiber->getState() != Fiber::EXCEPT)) {   // 调度器
+                BeginSlice(worker, ft.fiber.get());
                 ft.fiber->swapIn(); // 执行
                 --m_activeThreadCount;
+                uint64_t now = GetCurrentUS();
+                StatAdd(worker->stats.fibers, 1);
+                endSlice(worker, now);
+                maybeDumpStats(now);
 
                 if (ft.fiber->getState() == Fiber::READY) {
                     schedule(ft.fiber); // 再次执行
@@ -212,24 +469,27 @@ namespace sylar {
                 else if (ft.fiber->getState() != Fiber::TERM
                     && ft.fiber->getState() != Fiber::EXCEPT) {
                     ft.fiber->m_state = Fiber::HOLD;
+                } else {
+                    recycleFiber(worker, ft.fiber);    // 让出过的回调协程结束了
                 }
                 ft.reset();
             } else if (ft.cb) { // 回调函数
-                if (cb_fiber) {
-                    cb_fiber->reset(ft.cb);
-                }
-                else {
-                    cb_fiber.reset(new Fiber(ft.cb));   // 创建一个协程任务
-                }
+                cb_fiber = takeFiber(worker, ft.cb);
+                cb_fiber->setPriority(ft.priority);    // 回调里让出后按同样的优先级再调度
                 ft.reset();
+                BeginSlice(worker, cb_fiber.get());
                 cb_fiber->swapIn();
                 --m_activeThreadCount;
+                uint64_t now = GetCurrentUS();
+                StatAdd(worker->stats.callbacks, 1);
+                endSlice(worker, now);
+                maybeDumpStats(now);
                 if (cb_fiber->getState() == Fiber::READY) {
                     schedule(cb_fiber); // 再次执行
                     cb_fiber.reset();
-                } else if (cb_fiber->getState() != Fiber::TERM
-                           || cb_fiber->getState() != Fiber::EXCEPT) {
-                    cb_fiber->reset(nullptr);
+                } else if (cb_fiber->getState() == Fiber::TERM
+                           || cb_fiber->getState() == Fiber::EXCEPT) {
+                    recycleFiber(worker, cb_fiber);
                 } else {
                     cb_fiber->m_state = Fiber::HOLD;
                     cb_fiber.reset();
@@ -241,12 +501,19 @@ namespace sylar {
                 }
                 if(idle_fiber->getState() == Fiber::TERM) {
                     SYLAR_LOG_INFO(g_logger) << "idle fiber term";
+                    Fiber::SetSliceFlags(nullptr);
+                    t_worker = nullptr;
+                    t_idle_fiber = nullptr;
                     break;
                 }
 
                 ++m_idleThreadCount;
+                uint64_t idle_begin = GetCurrentUS();
                 idle_fiber->swapIn();
                 --m_idleThreadCount;
+                uint64_t now = GetCurrentUS();
+                StatAdd(worker->stats.idleUs, now > idle_begin ? now - idle_begin : 0);
+                maybeDumpStats(now);
                 if(idle_fiber->getState() != Fiber::TERM
                    && idle_fiber->getState() != Fiber::EXCEPT) {
                     idle_fiber->m_state = Fiber::HOLD;
@@ -255,14 +522,747 @@ namespace sylar {
         }
     }
 
+    void Scheduler::setMaxQueueDepth(size_t depth, OverflowPolicy policy) {
+        m_overflowPolicy = policy;
+        m_maxQueueDepth = depth;
+        // 放宽了上限, 等待的生产者重新检查
+        while (m_blockedCount > 0 && (depth == 0 || m_taskCount < depth)) {
+            wakeProducer();
+        }
+    }
+
+    bool Scheduler::admitSlow(FiberAndThread& ft, bool nonblock) {
+        // 执行过的协程重新入队(YieldToReady, IO事件, 等空位被唤醒)必须接受, 否则协程就丢了
+        if (ft.fiber && ft.fiber->getState() != Fiber::INIT) {
+            return true;
+        }
+        // 调度器自己派发的任务(到期的定时器, IO事件回调)不限制, 也不能在这里阻塞
+        Fiber* cur = Fiber::GetThis().get();
+        if (t_scheduler == this && (cur == t_scheduler_fiber || cur == t_idle_fiber)) {
+            return true;
+        }
+        while (true) {
+            size_t max_depth = m_maxQueueDepth;
+            if (max_depth == 0 || m_taskCount < max_depth) {
+                return true;
+            }
+            OverflowPolicy policy = getOverflowPolicy();
+            if (policy == OVERFLOW_DROP_OLDEST && dropOldest()) {
+                continue;
+            }
+            if (policy == OVERFLOW_BLOCK && !nonblock && waitForRoom(max_depth)) {
+                continue;
+            }
+            ++m_rejectedCount;
+            SYLAR_LOG_EVERY_MS(g_logger, sylar::LogLevel::WARN, 1000) << m_name << " queue full, max_queue_depth="
+                                                                      << max_depth << " rejected=" << m_rejectedCount;
+            return false;
+        }
+    }
+
+    bool Scheduler::waitForRoom(size_t max_depth) {
+        Fiber::ptr cur = Fiber::GetThis();
+        // 有栈的非调度协程可以挂起, 否则(线程的主协程, 别的调度器的调度协程)只能阻塞线程
+        bool park = t_scheduler && (cur->m_stack || cur->m_shared)
+                && cur.get() != t_scheduler_fiber && cur.get() != t_idle_fiber;
+        // 要有别的线程在执行任务才等得到空位. 本调度器的协程挂起后本线程继续调度;
+        // use_caller的主线程只在stop里执行任务, 它阻塞了就没人执行分给它的任务
+        bool drained = m_workersReady
+                && ((park && t_scheduler == this) || (m_threadCount > 0 && GetThreadId() != m_rootThread));
+        if (!drained) {
+            return false;
+        }
+        Semaphore sem;
+        {
+            Spinlock::Lock lock(m_blockedMutex);
+            // 先加计数再检查, 和takeTask里先减任务数再看计数配对, 不会漏掉唤醒
+            ++m_blockedCount;
+            if (m_taskCount < max_depth) {
+                --m_blockedCount;
+                return true;
+            }
+            BlockedProducer producer;
+            if (park) {
+                producer.fiber = cur;
+                producer.scheduler = t_scheduler;
+            } else {
+                producer.sem = &sem;
+            }
+            m_blocked.push_back(producer);
+        }
+        if (park) {
+            cur.reset();
+            Fiber::YieldToHold();
+        } else {
+            sem.wait();
+        }
+        return true;
+    }
+
+    void Scheduler::wakeProducer() {
+        BlockedProducer producer;
+        {
+            Spinlock::Lock lock(m_blockedMutex);
+            if (m_blocked.empty()) {
+                return;
+            }
+            producer = m_blocked.front();
+            m_blocked.pop_front();
+            --m_blockedCount;
+        }
+        if (producer.fiber) {
+            producer.scheduler->schedule(producer.fiber);
+        } else {
+            producer.sem->notify();
+        }
+    }
+
+    bool Scheduler::dropOldest() {
+        if (!m_workersReady) {
+            return false;
+        }
+        auto droppable = [](const FiberAndThread& ft) {
+            return !ft.fiber || ft.fiber->getState() == Fiber::INIT;
+        };
+        for (int priority = PRIORITY_COUNT - 1; priority >= 0; --priority) {
+            if (m_priorityCount[priority] == 0) {
+                continue;
+            }
+            bool dropped = false;
+            // 全局队列里的任务比本地队列里的早. 队头不能丢(恢复执行的协程)时不动全局队列,
+            // 放回队尾会让最早的任务一次次排到后面
+            if (m_injectLock[priority].tryLock()) {
+                TaskNode* node = static_cast<TaskNode*>(m_injectQueue[priority].peek());
+                if (node && droppable(node->task) && m_injectQueue[priority].pop() == node) {
+                    FreeTaskNode(node);
+                    dropped = true;
+                }
+                m_injectLock[priority].unlock();
+            }
+            for (size_t i = 0; !dropped && i < m_workers.size(); ++i) {
+                Worker* worker = m_workers[i].get();
+                Worker::MutexType::Lock lock(worker->mutex);
+                std::deque<FiberAndThread>& tasks = worker->tasks[priority];
+                if (!tasks.empty() && droppable(tasks.front())) {
+                    tasks.pop_front();
+                    dropped = true;
+                }
+            }
+            if (dropped) {
+                --m_priorityCount[priority];
+                --m_taskCount;
+                ++m_droppedCount;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Scheduler::TaskBatch::~TaskBatch() {
+        for (int i = 0; i < PRIORITY_COUNT; ++i) {
+            TaskNode* node = m_first[i];
+            while (node) {
+                TaskNode* next = node == m_last[i] ? nullptr
+                        : static_cast<TaskNode*>(node->next.load(std::memory_order_relaxed));
+                FreeTaskNode(node);
+                node = next;
+            }
+        }
+    }
+
+    void Scheduler::TaskBatch::push(FiberAndThread& ft) {
+        if (!ft.fiber && !ft.cb) {
+            return;
+        }
+        ++m_size;
+        if (ft.thread != -1 || ft.deadline) {
+            m_others.push_back(std::move(ft));
+            return;
+        }
+        if (m_createUs == 0) {
+            m_createUs = GetCurrentUS();
+        }
+        int priority = ft.priority;
+        TaskNode* node = AllocTaskNode();
+        node->task = std::move(ft);
+        node->task.enqueueUs = m_createUs;
+        if (m_last[priority]) {
+            m_last[priority]->next.store(node, std::memory_order_relaxed);
+        } else {
+            m_first[priority] = node;
+        }
+        m_last[priority] = node;
+        ++m_count[priority];
+    }
+
+    void Scheduler::schedule(TaskBatch& batch) {
+        size_t count = 0;
+        for (int i = 0; i < PRIORITY_COUNT; ++i) {
+            if (!batch.m_first[i]) {
+                continue;
+            }
+            m_injectQueue[i].pushChain(batch.m_first[i], batch.m_last[i]);
+            m_priorityCount[i] += batch.m_count[i];
+            m_taskCount += batch.m_count[i];
+            count += batch.m_count[i];
+            batch.m_first[i] = batch.m_last[i] = nullptr;
+            batch.m_count[i] = 0;
+        }
+        for (auto& i : batch.m_others) {
+            // 指定了线程的任务enqueue里已经通知了目标线程
+            if (enqueue(i)) {
+                ++count;
+            }
+        }
+        batch.m_others.clear();
+        batch.m_size = 0;
+        batch.m_createUs = 0;
+        if (count > 0 && hasIdleThreads()) {
+            tickleIdle(count);
+        }
+    }
+
+    bool Scheduler::enqueue(FiberAndThread& ft) {
+        ft.enqueueUs = GetCurrentUS();
+        if (ft.thread != -1) {
+            enqueuePinned(ft);
+            return false;
+        }
+        int priority = ft.priority;
+        Worker* worker = (Worker*)t_worker;
+        if (ft.deadline) {
+            DeadlineQueue& queue = m_deadlineQueue[priority];
+            Spinlock::Lock lock(queue.mutex);
+            queue.heap.push_back(std::move(ft));
+            std::push_heap(queue.heap.begin(), queue.heap.end(), DeadlineGreater);
+            ++queue.size;
+        } else if (worker && worker->scheduler == this) {
+            Worker::MutexType::Lock lock(worker->mutex);
+            worker->tasks[priority].push_back(std::move(ft));
+        } else {
+            TaskNode* node = AllocTaskNode();
+            node->task = std::move(ft);
+            m_injectQueue[priority].push(node);
+        }
+        ++m_priorityCount[priority];
+        ++m_taskCount;
+        return hasIdleThreads();
+    }
+
+    void Scheduler::enqueuePinned(FiberAndThread& ft) {
+        if (!m_workersReady) {
+            MutexType::Lock lock(m_mutex);
+            if (!m_workersReady) {  // 还没start, 先放全局队列, start时再分到mailbox
+                m_fibers.push_back(std::move(ft));
+                ++m_taskCount;
+                return;
+            }
+        }
+        auto it = m_threadWorkers.find(ft.thread);
+        if (it == m_threadWorkers.end()) {
+            SYLAR_LOG_ERROR(g_logger) << m_name << " schedule to unknown thread " << ft.thread
+                                      << ", run on any thread";
+            ft.thread = -1;
+            if (enqueue(ft)) {
+                tickle();
+            }
+            return;
+        }
+        Worker* worker = it->second;
+        TaskNode* node = AllocTaskNode();
+        node->task = std::move(ft);
+        worker->mailbox.push(node);
+        ++worker->pinned;
+        tickleWorker(worker->index);
+    }
+
+    // 取到的任务先加活跃数再减任务数, stopping()不会看到两个都为0的中间状态
+    bool Scheduler::takeTask(Worker* worker, FiberAndThread& ft, bool& tickle_me) {
+        if (takePinned(worker, ft, tickle_me)) {
+            RecordDelay(worker, ft);
+            return true;
+        }
+        // 按虚拟时间从小到大排, 虚拟时间最小的优先级先取, 按权重公平, 不会饿死
+        int order[PRIORITY_COUNT];
+        for (int i = 0; i < PRIORITY_COUNT; ++i) {
+            int j = i;
+            for (; j > 0 && worker->pass[order[j - 1]] > worker->pass[i]; --j) {
+                order[j] = order[j - 1];
+            }
+            order[j] = i;
+        }
+        bool global_first = ++worker->tick % GLOBAL_QUEUE_INTERVAL == 0;
+        for (int priority : order) {
+            if (m_priorityCount[priority] == 0) {
+                continue;
+            }
+            bool found = (global_first && takeGlobal(worker, priority, ft, tickle_me))
+                    || takeDeadline(worker, priority, ft, tickle_me)
+                    || takeLocal(worker, priority, ft, tickle_me)
+                    || takeGlobal(worker, priority, ft, tickle_me)
+                    || steal(worker, priority, ft, tickle_me);
+            if (!found) {
+                continue;
+            }
+            // 空着的优先级不攒虚拟时间, 否则来了任务后会连续占用很久
+            uint64_t now = worker->pass[priority];
+            worker->pass[priority] += m_stride[priority];
+            for (int i = 0; i < PRIORITY_COUNT; ++i) {
+                if (worker->pass[i] < now && m_priorityCount[i] == 0) {
+                    worker->pass[i] = now;
+                }
+            }
+            RecordDelay(worker, ft);
+            if (m_blockedCount > 0 && m_taskCount < m_maxQueueDepth) {
+                wakeProducer();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void Scheduler::RecordDelay(Worker* worker, const FiberAndThread& ft) {
+        uint64_t now = GetCurrentUS();
+        uint64_t delay = now > ft.enqueueUs ? now - ft.enqueueUs : 0;
+        worker->taskStartUs = now;
+        StatAdd(worker->stats.waitHistogram[HistogramBucket(delay)], 1);
+        Worker::Counter& counter = worker->counters[ft.priority];
+        StatAdd(counter.tasks, 1);
+        StatAdd(counter.totalDelayUs, delay);
+        if (delay > counter.maxDelayUs.load(std::memory_order_relaxed)) {
+            counter.maxDelayUs.store(delay, std::memory_order_relaxed);
+        }
+        if (ft.deadline && now / 1000 > ft.deadline) {
+            StatAdd(counter.deadlineMissed, 1);
+        }
+    }
+
+    bool Scheduler::PopRunnable(std::deque<FiberAndThread>& queue, FiberAndThread& ft, bool& tickle_me) {
+        for (size_t n = queue.size(); n > 0; --n) {
+            FiberAndThread& front = queue.front();
+            SYLAR_ASSERT(front.fiber || front.cb);  // 有协程 或者 回调函数, 任务非空
+            if (front.fiber && front.fiber->getState() == Fiber::EXEC) {
+                // 协程还没从别的线程切出来, 放回队尾稍后再试
+                queue.push_back(std::move(front));
+                queue.pop_front();
+                tickle_me = true;
+                continue;
+            }
+            ft = std::move(front);
+            queue.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    bool Scheduler::DeadlineGreater(const FiberAndThread& a, const FiberAndThread& b) {
+        return a.deadline > b.deadline;
+    }
+
+    bool Scheduler::takePinned(Worker* worker, FiberAndThread& ft, bool& tickle_me) {
+        // 指定给本线程的任务别人不能做, 优先处理
+        for (size_t n = worker->pinned; n > 0; --n) {
+            TaskNode* node = static_cast<TaskNode*>(worker->mailbox.pop());
+            if (!node) {
+                break;
+            }
+            if (node->task.fiber && node->task.fiber->getState() == Fiber::EXEC) {
+                worker->mailbox.push(node);
+                tickle_me = true;
+                continue;
+            }
+            ft = std::move(node->task);
+            FreeTaskNode(node);
+            ++m_activeThreadCount;
+            --worker->pinned;
+            return true;
+        }
+        return false;
+    }
+
+    bool Scheduler::takeDeadline(Worker* worker, int priority, FiberAndThread& ft, bool& tickle_me) {
+        DeadlineQueue& queue = m_deadlineQueue[priority];
+        if (queue.size == 0) {
+            return false;
+        }
+        Spinlock::Lock lock(queue.mutex);
+        while (!queue.heap.empty()) {
+            std::pop_heap(queue.heap.begin(), queue.heap.end(), DeadlineGreater);
+            FiberAndThread& top = queue.heap.back();
+            if (top.fiber && top.fiber->getState() == Fiber::EXEC) {
+                // 还在执行的协程放到本地队列, 由PopRunnable稍后再试
+                Worker::MutexType::Lock wlock(worker->mutex);
+                worker->tasks[priority].push_back(std::move(top));
+                queue.heap.pop_back();
+                --queue.size;
+                tickle_me = true;
+                continue;
+            }
+            ft = std::move(top);
+            queue.heap.pop_back();
+            --queue.size;
+            ++m_activeThreadCount;
+            --m_priorityCount[priority];
+            --m_taskCount;
+            return true;
+        }
+        return false;
+    }
+
+    bool Scheduler::takeLocal(Worker* worker, int priority, FiberAndThread& ft, bool& tickle_me) {
+        Worker::MutexType::Lock lock(worker->mutex);
+        if (PopRunnable(worker->tasks[priority], ft, tickle_me)) {
+            ++m_activeThreadCount;
+            --m_priorityCount[priority];
+            --m_taskCount;
+            return true;
+        }
+        return false;
+    }
+
+    bool Scheduler::takeGlobal(Worker* worker, int priority, FiberAndThread& ft, bool& tickle_me) {
+        if (m_priorityCount[priority] == 0) {
+            return false;
+        }
+        // 别的线程正在取, 它会分一批到自己的本地队列, 这边去偷就行
+        if (!m_injectLock[priority].tryLock()) {
+            return false;
+        }
+        // 除了自己要执行的, 再按线程数均分一批到本地队列, 减少抢全局队列的次数
+        size_t max_batch = std::min(m_priorityCount[priority] / m_workers.size(), GLOBAL_QUEUE_BATCH);
+        bool found = false;
+        size_t count = 0;
+        Worker::MutexType::Lock lock(worker->mutex);
+        // 本地队列最多放max_batch个; 还没找到能执行的任务时多看一个, max_batch为0时也能取到任务
+        while (count < max_batch || (!found && count == max_batch)) {
+            TaskNode* node = static_cast<TaskNode*>(m_injectQueue[priority].pop());
+            if (!node) {
+                break;
+            }
+            SYLAR_ASSERT(node->task.fiber || node->task.cb);  // 有协程 或者 回调函数, 任务非空
+            if (!found && !(node->task.fiber && node->task.fiber->getState() == Fiber::EXEC)) {
+                ft = std::move(node->task);
+                found = true;
+                ++m_activeThreadCount;
+                --m_priorityCount[priority];
+                --m_taskCount;
+            } else {
+                // 还在执行的协程也放到本地队列, 由PopRunnable稍后再试
+                if (node->task.fiber && node->task.fiber->getState() == Fiber::EXEC) {
+                    tickle_me = true;
+                }
+                worker->tasks[priority].push_back(std::move(node->task));
+                ++count;
+            }
+            FreeTaskNode(node);
+        }
+        lock.unlock();
+        m_injectLock[priority].unlock();
+        return found;
+    }
+
+    bool Scheduler::steal(Worker* worker, int priority, FiberAndThread& ft, bool& tickle_me) {
+        // 只在同一组(NUMA节点)里偷
+        const std::vector<Worker*>& peers = m_groups[worker->group];
+        size_t count = peers.size();
+        std::vector<FiberAndThread> stolen;
+        for (size_t i = 1; i <= count && stolen.empty(); ++i) {
+            // 从不同的位置开始找, 避免所有空闲线程都去偷同一个
+            Worker* victim = peers[(worker->index + worker->tick + i) % count];
+            if (victim == worker) {
+                continue;
+            }
+            Worker::MutexType::Lock lock(victim->mutex);
+            // 从尾部偷一半, 队头留给victim自己
+            std::deque<FiberAndThread>& tasks = victim->tasks[priority];
+            size_t n = (tasks.size() + 1) / 2;
+            for (auto it = tasks.end() - n; it != tasks.end(); ++it) {
+                stolen.push_back(std::move(*it));
+            }
+            tasks.erase(tasks.end() - n, tasks.end());
+        }
+        if (stolen.empty()) {
+            return false;
+        }
+        StatAdd(worker->stats.steals, 1);
+        StatAdd(worker->stats.stolenTasks, stolen.size());
+        {
+            Worker::MutexType::Lock lock(worker->mutex);
+            for (auto& i : stolen) {
+                worker->tasks[priority].push_back(std::move(i));
+            }
+        }
+        return takeLocal(worker, priority, ft, tickle_me);
+    }
+
     void Scheduler::tickle() {
         SYLAR_LOG_INFO(g_logger) << "tickle";
     }
 
-    bool Scheduler::stopping() {
+    void Scheduler::tickleWorker(size_t /*index*/) {
+        // 基类没有单独唤醒某个线程的手段, 只能通知整个调度器
+        tickle();
+    }
+
+    void Scheduler::tickleIdle(size_t count) {
+        count = std::min<size_t>(count, m_idleThreadCount);
+        for (size_t i = 0; i < count; ++i) {
+            tickle();
+        }
+    }
+
+    void Scheduler::statTickleSent() {
+        Worker* worker = (Worker*)t_worker;
+        if (worker && worker->scheduler == this) {
+            StatAdd(worker->stats.ticklesSent, 1);
+        } else {
+            ++m_externalTickles;
+        }
+    }
+
+    void Scheduler::statTickleReceived() {
+        Worker* worker = (Worker*)t_worker;
+        if (worker && worker->scheduler == this) {
+            StatAdd(worker->stats.ticklesReceived, 1);
+        }
+    }
+
+    void Scheduler::statPollTime(uint64_t us) {
+        Worker* worker = (Worker*)t_worker;
+        if (worker && worker->scheduler == this) {
+            StatAdd(worker->stats.pollUs, us);
+        }
+    }
+
+    std::vector<Scheduler::WorkerStats> Scheduler::getStats() {
+        MutexType::Lock lock(m_mutex);
+        std::vector<WorkerStats> rt(m_workers.size());
+        for (size_t i = 0; i < m_workers.size(); ++i) {
+            Worker::Stats& stats = m_workers[i]->stats;
+            WorkerStats& ws = rt[i];
+            ws.index = m_workers[i]->index;
+            ws.thread = m_workers[i]->thread;
+            ws.fibers = stats.fibers;
+            ws.callbacks = stats.callbacks;
+            ws.runUs = stats.runUs;
+            ws.idleUs = stats.idleUs;
+            ws.pollUs = stats.pollUs;
+            ws.steals = stats.steals;
+            ws.stolenTasks = stats.stolenTasks;
+            ws.ticklesSent = stats.ticklesSent;
+            ws.ticklesReceived = stats.ticklesReceived;
+            ws.longSlices = stats.longSlices;
+            ws.fiberPoolHits = stats.fiberPoolHits;
+            ws.fiberPoolMisses = stats.fiberPoolMisses;
+            for (size_t j = 0; j < WorkerStats::HISTOGRAM_BUCKETS; ++j) {
+                ws.waitHistogram[j] = stats.waitHistogram[j];
+                ws.sliceHistogram[j] = stats.sliceHistogram[j];
+            }
+        }
+        return rt;
+    }
+
+    void Scheduler::dumpStats(std::ostream& os) {
+        std::vector<WorkerStats> stats = getStats();
+        WorkerStats total;
+        auto dump = [&os](const WorkerStats& ws) {
+            os << " tasks=" << ws.tasks()
+               << " fibers=" << ws.fibers
+               << " callbacks=" << ws.callbacks
+               << " run_ms=" << ws.runUs / 1000
+               << " idle_ms=" << ws.idleUs / 1000
+               << " poll_ms=" << ws.pollUs / 1000
+               << " steals=" << ws.steals
+               << " stolen=" << ws.stolenTasks
+               << " tickles_sent=" << ws.ticklesSent
+               << " tickles_received=" << ws.ticklesReceived
+               << " wait_p50_us=" << HistogramPercentile(ws.waitHistogram, 0.5)
+               << " wait_p99_us=" << HistogramPercentile(ws.waitHistogram, 0.99)
+               << " slice_p50_us=" << HistogramPercentile(ws.sliceHistogram, 0.5)
+               << " slice_p99_us=" << HistogramPercentile(ws.sliceHistogram, 0.99)
+               << " long_slices=" << ws.longSlices
+               << " fiber_pool_hits=" << ws.fiberPoolHits
+               << " fiber_pool_misses=" << ws.fiberPoolMisses;
+        };
+        os << "scheduler " << m_name << " pending=" << m_taskCount
+           << " active=" << m_activeThreadCount << " idle=" << m_idleThreadCount
+           << " external_tickles=" << m_externalTickles << std::endl;
+        for (auto& ws : stats) {
+            os << "  worker=" << ws.index << " thread=" << ws.thread;
+            dump(ws);
+            os << std::endl;
+            total.fibers += ws.fibers;
+            total.callbacks += ws.callbacks;
+            total.runUs += ws.runUs;
+            total.idleUs += ws.idleUs;
+            total.pollUs += ws.pollUs;
+            total.steals += ws.steals;
+            total.stolenTasks += ws.stolenTasks;
+            total.ticklesSent += ws.ticklesSent;
+            total.ticklesReceived += ws.ticklesReceived;
+            total.longSlices += ws.longSlices;
+            total.fiberPoolHits += ws.fiberPoolHits;
+            total.fiberPoolMisses += ws.fiberPoolMisses;
+            for (size_t i = 0; i < WorkerStats::HISTOGRAM_BUCKETS; ++i) {
+                total.waitHistogram[i] += ws.waitHistogram[i];
+                total.sliceHistogram[i] += ws.sliceHistogram[i];
+            }
+        }
+        os << "  total";
+        dump(total);
+    }
+
+    Fiber::ptr Scheduler::takeFiber(Worker* worker, std::function<void()>& cb) {
+        bool shared = m_sharedStack;
+        // 按回调入口的栈统计选栈大小(fiber.stack_adaptive), 取池里栈大小相同的协程.
+        // 入口的统计只查一次, 两个功能都关闭时不查
+        StackProfile* profile = nullptr;
+        size_t stacksize = 0;
+        if (!shared) {
+            if (IsStackProfiling() || IsStackAdaptive()) {
+                profile = GetStackProfile(cb);
+            }
+            stacksize = Fiber::StackSizeFor(profile);
+        }
+        std::vector<Fiber::ptr>& pool = worker->fiberPool;
+        for (size_t i = pool.size(); i > 0; --i) {
+            Fiber::ptr& fiber = pool[i - 1];
+            if (fiber->isSharedStack() != shared) {
+                // 改过setSharedStack之后, 池里栈模式不同的协程丢掉
+                pool.erase(pool.begin() + (i - 1));
+                continue;
+            }
+            if (shared || fiber->m_stacksize == stacksize) {
+                Fiber::ptr rt = std::move(fiber);
+                pool.erase(pool.begin() + (i - 1));
+                rt->reset(std::move(cb), profile);
+                StatAdd(worker->stats.fiberPoolHits, 1);
+                return rt;
+            }
+        }
+        StatAdd(worker->stats.fiberPoolMisses, 1);
+        Fiber::ptr fiber(new Fiber(std::move(cb), stacksize, false, shared));   // 创建一个协程任务
+        fiber->m_recyclable = true;
+        return fiber;
+    }
+
+    void Scheduler::recycleFiber(Worker* worker, Fiber::ptr& fiber) {
+        if (fiber->m_recyclable && fiber.use_count() == 1
+                && worker->fiberPool.size() < m_fiberPoolSize) {
+            fiber->reset(nullptr);  // 尽早释放回调捕获的对象
+            worker->fiberPool.push_back(std::move(fiber));
+        }
+        fiber.reset();
+    }
+
+    void Scheduler::BeginSlice(Worker* worker, Fiber* fiber) {
+        worker->sliceFiberId.store(fiber->getId(), std::memory_order_relaxed);
+        worker->sliceStartUs.store(worker->taskStartUs, std::memory_order_release);
+    }
+
+    void Scheduler::endSlice(Worker* worker, uint64_t now_us) {
+        worker->sliceStartUs.store(0, std::memory_order_relaxed);
+        worker->sliceFlags.store(0, std::memory_order_relaxed);
+        uint64_t slice = now_us > worker->taskStartUs ? now_us - worker->taskStartUs : 0;
+        StatAdd(worker->stats.runUs, slice);
+        StatAdd(worker->stats.sliceHistogram[HistogramBucket(slice)], 1);
+        if (m_sliceBudgetUs && slice > m_sliceBudgetUs) {
+            StatAdd(worker->stats.longSlices, 1);
+        }
+    }
+
+    void Scheduler::watchdog() {
+        // 检查间隔取预算的1/4, 在1ms到100ms之间
+        uint64_t interval = std::min<uint64_t>(std::max<uint64_t>(m_sliceBudgetUs / 4, 1000), 100 * 1000);
+        int flags = Fiber::SLICE_OVERRUN | (m_sliceYield ? Fiber::SLICE_YIELD : 0);
+        while (!m_watchdogStop) {
+            usleep(interval);
+            uint64_t now = GetCurrentUS();
+            for (auto& worker : m_workers) {
+                uint64_t start = worker->sliceStartUs.load(std::memory_order_acquire);
+                if (start == 0 || now < start + m_sliceBudgetUs
+                        || (worker->sliceFlags & Fiber::SLICE_OVERRUN)) {
+                    continue;
+                }
+                worker->sliceFlags |= flags;
+                if (worker->sliceStartUs != start) {
+                    // 标记之前时间片已经结束了, 撤销, 不能留给下一个时间片
+                    int expected = flags;
+                    worker->sliceFlags.compare_exchange_strong(expected, 0);
+                    continue;
+                }
+                SYLAR_LOG_WARN(g_logger) << m_name << " worker=" << worker->index
+                                         << " fiber_id=" << worker->sliceFiberId
+                                         << " has run " << (now - start) / 1000 << "ms without yielding"
+                                         << ", scheduler.slice_budget=" << m_sliceBudgetUs / 1000 << "ms";
+            }
+        }
+    }
+
+    void Scheduler::stopWatchdog() {
+        if (m_watchdog) {
+            m_watchdogStop = true;
+            m_watchdog->join();
+            m_watchdog.reset();
+        }
+    }
+
+    void Scheduler::maybeDumpStats(uint64_t now_us) {
+        uint64_t next = m_nextDumpUs;
+        if (next == 0 || now_us < next) {
+            return;
+        }
+        uint64_t interval = g_stats_interval->getValue() * 1000;
+        if (!m_nextDumpUs.compare_exchange_strong(next, interval ? now_us + interval : 0)) {
+            return;     // 别的线程在输出
+        }
+        if (interval == 0) {
+            return;
+        }
+        std::stringstream ss;
+        dumpStats(ss);
+        SYLAR_LOG_INFO(SYLAR_LOG_NAME(g_stats_logger->getValue())) << ss.str();
+    }
+
+    bool Scheduler::hasPendingTasks() {
+        if (m_taskCount > 0) {
+            return true;
+        }
+        Worker* worker = (Worker*)t_worker;
+        return worker && worker->scheduler == this && worker->pinned > 0;
+    }
+
+    std::vector<Scheduler::PriorityStats> Scheduler::getPriorityStats() {
+        std::vector<PriorityStats> stats(PRIORITY_COUNT);
         MutexType::Lock lock(m_mutex);
-        return m_autoStop && m_stopping
-               && m_fibers.empty() && m_activeThreadCount == 0;
+        for (auto& worker : m_workers) {
+            for (int i = 0; i < PRIORITY_COUNT; ++i) {
+                Worker::Counter& counter = worker->counters[i];
+                stats[i].tasks += counter.tasks;
+                stats[i].totalDelayUs += counter.totalDelayUs;
+                stats[i].maxDelayUs = std::max<uint64_t>(stats[i].maxDelayUs, counter.maxDelayUs);
+                stats[i].deadlineMissed += counter.deadlineMissed;
+            }
+        }
+        return stats;
+    }
+
+    int Scheduler::getWorkerIndex() {
+        Worker* worker = (Worker*)t_worker;
+        return worker && worker->scheduler == this ? (int)worker->index : -1;
+    }
+
+    bool Scheduler::stopping() {
+        if (!m_autoStop || !m_stopping
+                || m_taskCount != 0 || m_activeThreadCount != 0) {
+            return false;
+        }
+        for (auto& i : m_workers) {
+            if (i->pinned) {
+                return false;
+            }
+        }
+        return true;
     }
 
     void Scheduler::idle() {
@@ -8,7 +8,10 @@
 #include "fiber.h"
 #include "thread.h"
 #include <list>
+#include <deque>
 #include <memory>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 #include <iostream>
 
@@ -49,51 +52,247 @@ namespace sylar {
 
         void stop();    // 停止协程调度器
 
+        /**
+         * @brief 任务优先级
+         * @details 各优先级按权重(scheduler.priority_weights)轮流取任务, 低优先级也不会饿死.
+         *          指定了线程的任务不区分优先级, 总是先执行
+         */
+        enum Priority {
+            PRIORITY_HIGH = 0,
+            PRIORITY_NORMAL = 1,
+            PRIORITY_LOW = 2,
+            PRIORITY_COUNT = 3
+        };
+
+        /**
+         * @brief 待执行任务数达到上限时的处理方式
+         */
+        enum OverflowPolicy {
+            OVERFLOW_REJECT = 0,        // 丢掉新任务
+            OVERFLOW_BLOCK = 1,         // 生产者协程(或线程)等到有空位; 没有别的线程执行任务时同OVERFLOW_REJECT
+            OVERFLOW_DROP_OLDEST = 2    // 从低优先级开始丢掉最早入队的任务
+        };
+
+        /**
+         * @brief 一个优先级的排队统计
+         */
+        struct PriorityStats {
+            uint64_t tasks = 0;             // 开始执行的任务数
+            uint64_t totalDelayUs = 0;      // 入队到开始执行的总耗时
+            uint64_t maxDelayUs = 0;        // 最大排队耗时
+            uint64_t deadlineMissed = 0;    // 开始执行时已经超过截止时间的任务数
+        };
+
+        /**
+         * @brief 一个调度线程的统计快照
+         */
+        struct WorkerStats {
+            // 耗时分布的桶数, 第0个桶为0微秒, 第i个桶为[2^(i-1), 2^i)微秒, 最后一个桶包含更大的
+            static const size_t HISTOGRAM_BUCKETS = 24;
+
+            size_t index = 0;               // 调度线程序号
+            int thread = -1;                // 线程id
+            uint64_t fibers = 0;            // 恢复执行的协程数
+            uint64_t callbacks = 0;         // 执行的回调数
+            uint64_t runUs = 0;             // 执行任务的时间
+            uint64_t idleUs = 0;            // 在idle协程里的时间
+            uint64_t pollUs = 0;            // 其中阻塞等待(epoll_wait, 休眠)的时间
+            uint64_t steals = 0;            // 成功窃取的次数
+            uint64_t stolenTasks = 0;       // 窃取到的任务数
+            uint64_t ticklesSent = 0;       // 发出的唤醒
+            uint64_t ticklesReceived = 0;   // 收到的唤醒
+            uint64_t longSlices = 0;        // 超过scheduler.slice_budget的时间片数
+            uint64_t fiberPoolHits = 0;     // 回调从协程池取到协程的次数
+            uint64_t fiberPoolMisses = 0;   // 协程池为空, 新建协程的次数
+            uint64_t waitHistogram[HISTOGRAM_BUCKETS] = {0};   // 入队到开始执行的耗时分布
+            uint64_t sliceHistogram[HISTOGRAM_BUCKETS] = {0};  // 每次执行任务(时间片)的时长分布
+
+            uint64_t tasks() const { return fibers + callbacks;}
+        };
+
         /**
          * @brief 调度协程
          * @param[in] fc 协程或函数
          * @param[in] thread 协程执行的线程id,-1标识任意线程
+         * @details 协程沿用它自己的优先级(Fiber::getPriority), 函数为PRIORITY_NORMAL
          */
         template <class FiberOrCb>
         void schedule(FiberOrCb fc, int thread = -1)
         {
-            bool need_tickle = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                need_tickle = scheduleNoLock(fc, thread);
+            FiberAndThread ft(fc, thread);
+            if ((ft.fiber || ft.cb) && admit(ft, false) && enqueue(ft)) {
+                tickle();
             }
-            if (need_tickle) {
+        }
+
+        /**
+         * @brief 尝试调度协程, 不会阻塞
+         * @return 待执行任务数达到上限被拒绝时返回false(OVERFLOW_DROP_OLDEST会丢掉旧任务后接受)
+         */
+        template <class FiberOrCb>
+        bool trySchedule(FiberOrCb fc, int thread = -1)
+        {
+            FiberAndThread ft(fc, thread);
+            if (!ft.fiber && !ft.cb) {
+                return false;
+            }
+            if (!admit(ft, true)) {
+                return false;
+            }
+            if (enqueue(ft)) {
                 tickle();
             }
+            return true;
         }
 
+        /**
+         * @brief 按优先级调度协程
+         * @param[in] fc 协程或函数
+         * @param[in] priority 优先级, 调度的是协程时记到协程上, 之后再被调度时沿用
+         * @param[in] deadline 截止时间(GetCurrentMS), 0表示没有. 同一优先级里有截止时间的任务按截止时间先执行
+         * @param[in] thread 协程执行的线程id,-1标识任意线程
+         */
+        template <class FiberOrCb>
+        void schedule(FiberOrCb fc, Priority priority, uint64_t deadline = 0, int thread = -1)
+        {
+            FiberAndThread ft(fc, thread);
+            if (!ft.fiber && !ft.cb) {
+                return;
+            }
+            ft.priority = priority;
+            ft.deadline = deadline;
+            if (ft.fiber) {
+                ft.fiber->setPriority(priority);
+            }
+            if (admit(ft, false) && enqueue(ft)) {
+                tickle();
+            }
+        }
+
+        /**
+         * @brief 按优先级尝试调度协程, 不会阻塞
+         * @return 被拒绝时返回false
+         */
+        template <class FiberOrCb>
+        bool trySchedule(FiberOrCb fc, Priority priority, uint64_t deadline = 0, int thread = -1)
+        {
+            FiberAndThread ft(fc, thread);
+            if (!ft.fiber && !ft.cb) {
+                return false;
+            }
+            ft.priority = priority;
+            ft.deadline = deadline;
+            if (!admit(ft, true)) {
+                return false;
+            }
+            if (ft.fiber) {
+                ft.fiber->setPriority(priority);
+            }
+            if (enqueue(ft)) {
+                tickle();
+            }
+            return true;
+        }
+
+        class TaskBatch;
+
+        /**
+         * @brief 提交一批任务
+         * @details 每个优先级的任务在batch里已经连成链表, 一次拼到全局队列的尾部,
+         *          再唤醒最多min(任务数, 空闲线程数)个线程. 不受待执行任务数上限的限制
+         * @post batch为空, 可以继续添加
+         */
+        void schedule(TaskBatch& batch);
+
         /**
          * @brief 批量调度协程
          * @param[in] begin 协程数组的开始
          * @param[in] end 协程数组的结束
+         * @attention 不受待执行任务数上限的限制
          */
         template <class InputIterator>
         void schedule(InputIterator begin, InputIterator end) {
-            bool need_tickle = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                while (begin != end)
-                {
-                    need_tickle = scheduleNoLock(&*begin, -1) || need_tickle;
-                    ++begin;
-                }
-                if (need_tickle)
-                {
-                    tickle();
-                }
-            }
+            scheduleBatch(begin, end, -1);
+        }
+
+        /**
+         * @brief 按优先级批量调度协程
+         * @param[in] begin 协程数组的开始
+         * @param[in] end 协程数组的结束
+         * @param[in] priority 优先级
+         */
+        template <class InputIterator>
+        void schedule(InputIterator begin, InputIterator end, Priority priority) {
+            scheduleBatch(begin, end, priority);
         }
 
+        /**
+         * @brief 各优先级的排队统计, 下标为Priority
+         */
+        std::vector<PriorityStats> getPriorityStats();
+
+        /**
+         * @brief 各调度线程的统计快照
+         * @details 计数由各线程在自己的Worker里累加, 这里读取时才汇总, 可以一直开着
+         */
+        std::vector<WorkerStats> getStats();
+
+        /**
+         * @brief 输出统计, 每个调度线程一行, 最后一行为汇总
+         * @details start时scheduler.stats_interval大于0, 调度线程就按这个间隔(ms)输出到scheduler.stats_logger
+         */
+        void dumpStats(std::ostream& os);
+
+        /**
+         * @brief 设置待执行任务数上限(默认取scheduler.max_queue_depth和scheduler.overflow_policy)
+         * @param[in] depth 上限, 0表示不限制
+         * @param[in] policy 达到上限时的处理方式
+         * @details 只限制新任务(回调和还没执行过的协程), 执行过的协程重新入队,
+         *          以及调度器自己的调度协程和idle协程里调度的任务不受限制.
+         *          多个生产者同时调度时可能略微超过上限
+         */
+        void setMaxQueueDepth(size_t depth, OverflowPolicy policy);
+
+        size_t getMaxQueueDepth() const { return m_maxQueueDepth;}
+
+        OverflowPolicy getOverflowPolicy() const { return (OverflowPolicy)m_overflowPolicy.load();}
+
+        /**
+         * @brief 设置回调任务是否在共享栈协程里执行(默认取scheduler.shared_stack)
+         * @details 共享栈协程第一次执行后只在那个调度线程上执行, 见Fiber::Fiber
+         */
+        void setSharedStack(bool v) { m_sharedStack = v;}
+
+        bool isSharedStack() const { return m_sharedStack;}
+
+        /**
+         * @brief 因为达到上限被拒绝的任务数
+         */
+        uint64_t getRejectedCount() const { return m_rejectedCount;}
+
+        /**
+         * @brief OVERFLOW_DROP_OLDEST丢掉的任务数
+         */
+        uint64_t getDroppedCount() const { return m_droppedCount;}
+
     protected:
         /**
          * @brief 通知协程调度器有任务了
          */
         virtual void tickle();
+
+        /**
+         * @brief 只通知指定的调度线程, 用于指定了线程的任务
+         * @param[in] index 调度线程序号, 见getWorkerIndex()
+         * @details 基类不能只唤醒一个线程, 默认实现等同于tickle(); 能按线程唤醒的子类(IOManager)重写
+         */
+        virtual void tickleWorker(size_t index);
+
+        /**
+         * @brief 一次来了count个任务, 最多唤醒min(count, 空闲线程数)个线程
+         */
+        virtual void tickleIdle(size_t count);
+
         /**
          * @brief 协程调度函数
          */
@@ -113,25 +312,47 @@ namespace sylar {
          */
         void setThis();
 
+        /**
+         * @brief 统计当前线程发出了一次唤醒, 不是调度线程时记在调度器上
+         */
+        void statTickleSent();
+
+        /**
+         * @brief 统计当前调度线程收到了一次唤醒
+         */
+        void statTickleReceived();
+
+        /**
+         * @brief 统计当前调度线程阻塞等待的时间
+         */
+        void statPollTime(uint64_t us);
+
         /**
          * @brief 是否有空闲线程
          */
         bool hasIdleThreads() { return m_idleThreadCount > 0;}
 
-    private:
         /**
-         * @brief 协程调度启动(无锁)
+         * @brief 当前线程是否还有能执行的任务(不含指定给其他线程的任务)
+         * @details 空闲线程阻塞前再检查一次, 避免schedule时还没计入空闲线程而漏掉tickle
          */
-        template <class FiberOrCb>
-        bool scheduleNoLock(FiberOrCb fc, int thread) {
-            bool need_tickle = m_fibers.empty();
-            FiberAndThread ft(fc, thread);
-            if (ft.fiber || ft.cb)
-            {
-                m_fibers.push_back(ft);
-            }
-            return need_tickle;
-        }
+        bool hasPendingTasks();
+
+        /**
+         * @brief 全局队列, 本地队列, 截止时间队列中待执行的任务数(不含mailbox)
+         */
+        size_t getPendingTaskCount() const { return m_taskCount;}
+
+        /**
+         * @brief 当前线程的调度线程序号, 不是本调度器的线程返回-1
+         * @details 调度线程按创建顺序为0~m_threadCount-1, use_caller的主线程为m_threadCount
+         */
+        int getWorkerIndex();
+
+        /**
+         * @brief 调度线程数(包含use_caller的主线程)
+         */
+        size_t getWorkerCount() const { return m_threadCount + (m_rootThread == -1 ? 0 : 1);}
 
     private:
         /**
@@ -144,11 +365,17 @@ namespace sylar {
             std::function<void ()> cb;
             // 线程id
             int thread;
+            // 优先级
+            int priority = PRIORITY_NORMAL;
+            // 截止时间(ms), 0表示没有
+            uint64_t deadline = 0;
+            // 入队时间(us), 用于统计排队耗时
+            uint64_t enqueueUs = 0;
 
             FiberAndThread(Fiber::ptr f, int thr)
                 : fiber(f), thread(thr)
             {
-
+                initFromFiber();
             }
             /**
              * @brief 构造函数
@@ -159,6 +386,7 @@ namespace sylar {
              FiberAndThread(Fiber::ptr* f, int thr)
              :thread(thr) {
                      fiber.swap(*f);
+                     initFromFiber();
              }
 
              /**
@@ -195,15 +423,276 @@ namespace sylar {
                  fiber = nullptr;
                  cb = nullptr;
                  thread = -1;
+                 priority = PRIORITY_NORMAL;
+                 deadline = 0;
+                 enqueueUs = 0;
+             }
+
+             /**
+              * @brief 协程沿用它自己的优先级, 共享栈协程只能回到共享栈所在的线程
+              */
+             void initFromFiber() {
+                 if (!fiber) {
+                     return;
+                 }
+                 if (fiber->getPriority() >= 0 && fiber->getPriority() < PRIORITY_COUNT) {
+                     priority = fiber->getPriority();
+                 }
+                 if (thread == -1 && fiber->getStackThread() != -1) {
+                     thread = fiber->getStackThread();
+                 }
              }
 
          };
+
+        /**
+         * @brief 工作线程的本地任务队列
+         * @details 工作线程里schedule的任务压到自己队列的尾部, 从头部取出执行,
+         *          自己没任务时从其他工作线程的队列尾部窃取一半.
+         *          指定了线程的任务放到目标线程的mailbox, 只有目标线程会取, 不会被窃取
+         */
+        struct Worker {
+            typedef Spinlock MutexType;
+
+            /**
+             * @brief 排队统计, 只有本线程写, getPriorityStats读
+             */
+            struct Counter {
+                std::atomic<uint64_t> tasks = {0};
+                std::atomic<uint64_t> totalDelayUs = {0};
+                std::atomic<uint64_t> maxDelayUs = {0};
+                std::atomic<uint64_t> deadlineMissed = {0};
+            };
+
+            /**
+             * @brief WorkerStats的计数, 只有本线程写, getStats读
+             */
+            struct Stats {
+                std::atomic<uint64_t> fibers = {0};
+                std::atomic<uint64_t> callbacks = {0};
+                std::atomic<uint64_t> runUs = {0};
+                std::atomic<uint64_t> idleUs = {0};
+                std::atomic<uint64_t> pollUs = {0};
+                std::atomic<uint64_t> steals = {0};
+                std::atomic<uint64_t> stolenTasks = {0};
+                std::atomic<uint64_t> ticklesSent = {0};
+                std::atomic<uint64_t> ticklesReceived = {0};
+                std::atomic<uint64_t> longSlices = {0};
+                std::atomic<uint64_t> fiberPoolHits = {0};
+                std::atomic<uint64_t> fiberPoolMisses = {0};
+                std::atomic<uint64_t> waitHistogram[WorkerStats::HISTOGRAM_BUCKETS];
+                std::atomic<uint64_t> sliceHistogram[WorkerStats::HISTOGRAM_BUCKETS];
+
+                Stats() {
+                    for (auto& i : waitHistogram) {
+                        i = 0;
+                    }
+                    for (auto& i : sliceHistogram) {
+                        i = 0;
+                    }
+                }
+            };
+
+            MutexType mutex;
+            std::deque<FiberAndThread> tasks[PRIORITY_COUNT];   // 每个优先级一个队列
+            MPSCQueue mailbox;  // 只有本线程消费, 不需要锁
+            std::atomic<size_t> pinned = {0};   // mailbox中的任务数
+            Scheduler* scheduler = nullptr;
+            size_t index = 0;
+            size_t group = 0;   // 所在的组(NUMA节点), 只从同组的线程窃取
+            int thread = -1;
+            uint32_t tick = 0;  // 取任务次数, 用来定期优先检查全局队列
+            uint64_t pass[PRIORITY_COUNT] = {0};   // 各优先级的虚拟时间, 每取一个任务加上该优先级的步长, 取最小的
+            Counter counters[PRIORITY_COUNT];
+            Stats stats;
+            uint64_t taskStartUs = 0;   // 当前任务开始执行的时间
+            std::atomic<uint64_t> sliceStartUs = {0};   // 正在执行的时间片的开始时间, 0表示没有, 看门狗读
+            std::atomic<uint64_t> sliceFiberId = {0};   // 正在执行的协程id
+            std::atomic<int> sliceFlags = {0};  // 看门狗设置的Fiber::SliceFlag, 时间片结束时清除
+            std::vector<Fiber::ptr> fiberPool;  // 结束了的回调协程, 只有本线程存取
+        };
+
+        /**
+         * @brief 有截止时间的任务, 按截止时间排成小顶堆
+         */
+        struct DeadlineQueue {
+            Spinlock mutex;
+            std::vector<FiberAndThread> heap;
+            std::atomic<size_t> size = {0};
+        };
+
+        /**
+         * @brief 无锁队列(全局队列和mailbox)里的任务节点
+         */
+        struct TaskNode : public MPSCNode {
+            FiberAndThread task;
+        };
+
+        /**
+         * @brief 每个线程缓存的空闲TaskNode, 定义在scheduler.cpp
+         */
+        struct TaskNodeCache;
+
+        /**
+         * @brief 优先从当前线程的缓存里取节点, 缓存空了从全局池批量取, 都没有才new
+         */
+        static TaskNode* AllocTaskNode();
+
+        /**
+         * @brief 节点放回当前线程的缓存, 缓存满了一半还给全局池
+         */
+        static void FreeTaskNode(TaskNode* node);
+
+        template <class InputIterator>
+        void scheduleBatch(InputIterator begin, InputIterator end, int priority);
+
+        /**
+         * @brief 准入控制, 待执行任务数达到上限时按m_overflowPolicy处理
+         * @param[in] nonblock 为true时OVERFLOW_BLOCK也不等待, 直接拒绝
+         * @return 是否可以入队
+         */
+        bool admit(FiberAndThread& ft, bool nonblock) {
+            return m_maxQueueDepth == 0 || admitSlow(ft, nonblock);
+        }
+
+        bool admitSlow(FiberAndThread& ft, bool nonblock);
+
+        /**
+         * @brief 当前协程等到待执行任务数低于上限
+         * @details 在调度器的协程里把协程挂起, 否则阻塞当前线程
+         * @return 没有别的线程能执行任务, 等下去不会有空位时返回false, 不等待:
+         *         调度器没有运行(start之前, stop之后), 没有额外的调度线程, 或者调用方是use_caller的主线程
+         */
+        bool waitForRoom(size_t max_depth);
+
+        /**
+         * @brief 唤醒一个等待空位的生产者
+         */
+        void wakeProducer();
+
+        /**
+         * @brief 从低优先级开始丢掉一个最早入队的新任务
+         * @return 是否丢掉了任务
+         */
+        bool dropOldest();
+
+        /**
+         * @brief 任务入队, 有截止时间的放截止时间队列, 工作线程放本地队列,
+         *        其他线程放全局队列, 指定了线程的放目标线程的mailbox
+         * @return 是否需要tickle
+         */
+        bool enqueue(FiberAndThread& ft);
+
+        /**
+         * @brief 把指定了线程的任务放到目标线程的mailbox并通知它
+         */
+        void enqueuePinned(FiberAndThread& ft);
+
+        /**
+         * @brief 从队头取第一个可执行的任务, 还在执行中的协程挪到队尾
+         */
+        static bool PopRunnable(std::deque<FiberAndThread>& queue, FiberAndThread& ft, bool& tickle_me);
+
+        /**
+         * @brief 截止时间队列的比较函数, 截止时间早的在堆顶
+         */
+        static bool DeadlineGreater(const FiberAndThread& a, const FiberAndThread& b);
+
+        /**
+         * @brief 为worker取一个可执行的任务, 先取mailbox, 再按优先级的虚拟时间从小到大,
+         *        每个优先级依次尝试截止时间队列, 本地队列, 全局队列, 其他线程的队列
+         * @param[out] tickle_me 有跳过的任务, 需要通知其他线程
+         */
+        bool takeTask(Worker* worker, FiberAndThread& ft, bool& tickle_me);
+
+        bool takePinned(Worker* worker, FiberAndThread& ft, bool& tickle_me);
+
+        bool takeDeadline(Worker* worker, int priority, FiberAndThread& ft, bool& tickle_me);
+
+        bool takeLocal(Worker* worker, int priority, FiberAndThread& ft, bool& tickle_me);
+
+        bool takeGlobal(Worker* worker, int priority, FiberAndThread& ft, bool& tickle_me);
+
+        bool steal(Worker* worker, int priority, FiberAndThread& ft, bool& tickle_me);
+
+        /**
+         * @brief 取到一个任务后记录排队耗时, 当前时间记为任务开始执行的时间
+         */
+        static void RecordDelay(Worker* worker, const FiberAndThread& ft);
+
+        /**
+         * @brief 从当前线程的协程池取一个协程执行回调, 池空了才新建
+         */
+        Fiber::ptr takeFiber(Worker* worker, std::function<void()>& cb);
+
+        /**
+         * @brief 结束了的回调协程放回协程池, 池满了(scheduler.fiber_pool_size)或者还有别人引用就不放
+         */
+        void recycleFiber(Worker* worker, Fiber::ptr& fiber);
+
+        /**
+         * @brief 开始执行协程, 时间片从taskStartUs算起
+         */
+        static void BeginSlice(Worker* worker, Fiber* fiber);
+
+        /**
+         * @brief 协程让出, 记录时间片的时长
+         */
+        void endSlice(Worker* worker, uint64_t now_us);
+
+        /**
+         * @brief 看门狗线程, 检查各调度线程当前的时间片, 超过scheduler.slice_budget时标记并告警
+         */
+        void watchdog();
+
+        void stopWatchdog();
+
+        /**
+         * @brief 到了scheduler.stats_interval就输出一次统计, 多个线程只有一个会输出
+         */
+        void maybeDumpStats(uint64_t now_us);
+
     private:
         MutexType m_mutex;
         std::vector<Thread::ptr> m_threads; // 线程池
-        std::list<FiberAndThread>   m_fibers;   // 待执行的协程队列
+        MPSCQueue m_injectQueue[PRIORITY_COUNT];    // 全局队列, 非工作线程schedule的任务, 每个优先级一个
+        Spinlock m_injectLock[PRIORITY_COUNT];      // 全局队列的消费者锁, 拿到锁的线程一次取一批
+        DeadlineQueue m_deadlineQueue[PRIORITY_COUNT];  // 有截止时间的任务, 每个优先级一个
+        std::list<FiberAndThread>   m_fibers;   // start之前指定了线程的任务, start时分到mailbox
+        std::vector<std::unique_ptr<Worker> > m_workers;    // 每个调度线程一个, use_caller时最后一个属于主线程
+        std::unordered_map<int, Worker*> m_threadWorkers;   // 线程id(m_threadIds) -> Worker, start后只读
+        std::vector<std::vector<Worker*> > m_groups;    // 按NUMA节点分的组, 没有配置fox_thread.placement时只有一组
+        std::atomic<bool> m_workersReady = {false};     // m_threadWorkers是否可用
+        std::atomic<size_t> m_taskCount = {0};  // 全局队列, 本地队列, 截止时间队列中待执行的任务数, 不含mailbox
+        std::atomic<size_t> m_priorityCount[PRIORITY_COUNT];   // 按优先级分的m_taskCount
+        uint64_t m_stride[PRIORITY_COUNT];  // 各优先级的步长, 与权重成反比, start时按配置计算
+        std::atomic<size_t> m_maxQueueDepth = {0};  // 待执行任务数上限, 0表示不限制
+        std::atomic<int> m_overflowPolicy = {OVERFLOW_REJECT};  // 达到上限时的处理方式
+        std::atomic<uint64_t> m_rejectedCount = {0};
+        std::atomic<uint64_t> m_droppedCount = {0};
+        std::atomic<bool> m_sharedStack = {false};  // 回调任务是否用共享栈协程执行
+        size_t m_fiberPoolSize = 0;     // 每个调度线程的协程池上限, 构造时按配置设置
+        std::atomic<uint64_t> m_externalTickles = {0};  // 非调度线程发出的唤醒
+        std::atomic<uint64_t> m_nextDumpUs = {0};   // 下次输出统计的时间
+        uint64_t m_sliceBudgetUs = 0;   // 时间片预算, 0表示不检查, start时按配置设置
+        bool m_sliceYield = false;  // 超过预算时是否设置Fiber::ShouldYield
+        Thread::ptr m_watchdog;     // 看门狗线程, 配置了时间片预算才有
+        std::atomic<bool> m_watchdogStop = {false};
+
+        /**
+         * @brief 等待空位的生产者, 协程由它所在的调度器重新调度, 线程用信号量唤醒
+         */
+        struct BlockedProducer {
+            Fiber::ptr fiber;
+            Scheduler* scheduler = nullptr;
+            Semaphore* sem = nullptr;
+        };
+        Spinlock m_blockedMutex;
+        std::deque<BlockedProducer> m_blocked;
+        std::atomic<size_t> m_blockedCount = {0};   // 不加锁判断有没有等待的生产者
         Fiber::ptr m_rootFiber;     // use_caller为true时有效，调度协程
         std::string m_name; // 协程调度器名称
+        static thread_local TaskNodeCache s_nodeCache;
     protected:
         std::vector<int> m_threadIds;   // 协程下的线程id数组
         size_t m_threadCount = 0;   // 线程数量
@@ -213,6 +702,119 @@ namespace sylar {
         bool m_autoStop = false;    // 是否自动停止
         int m_rootThread = 0;   // 主线程id(use_caller)
     };
+
+    /**
+     * @brief 一批待提交的任务
+     * @details add时就按优先级把任务节点连成链表, Scheduler::schedule(TaskBatch&)整串拼到全局队列.
+     *          回调可以是只能移动的函数对象. 不是线程安全的, 由一个线程添加和提交
+     */
+    class Scheduler::TaskBatch {
+    friend class Scheduler;
+    public:
+        TaskBatch() {}
+
+        /**
+         * @brief 没有提交的任务直接丢掉
+         */
+        ~TaskBatch();
+
+        /**
+         * @brief 添加协程, 沿用协程自己的优先级
+         */
+        void add(Fiber::ptr fiber, int thread = -1) {
+            FiberAndThread ft(fiber, thread);
+            push(ft);
+        }
+
+        void add(Fiber::ptr fiber, Priority priority, int thread = -1) {
+            FiberAndThread ft(fiber, thread);
+            ft.priority = priority;
+            if (ft.fiber) {
+                ft.fiber->setPriority(priority);
+            }
+            push(ft);
+        }
+
+        /**
+         * @brief 添加回调, 可以是只能移动的函数对象
+         */
+        template <class F, class = typename std::enable_if<
+                !std::is_convertible<F, Fiber::ptr>::value>::type>
+        void add(F&& cb, int thread = -1) {
+            FiberAndThread ft(MakeCallback(std::forward<F>(cb)), thread);
+            push(ft);
+        }
+
+        template <class F, class = typename std::enable_if<
+                !std::is_convertible<F, Fiber::ptr>::value>::type>
+        void add(F&& cb, Priority priority, int thread = -1) {
+            FiberAndThread ft(MakeCallback(std::forward<F>(cb)), thread);
+            ft.priority = priority;
+            push(ft);
+        }
+
+        size_t size() const { return m_size;}
+
+        bool empty() const { return m_size == 0;}
+
+    private:
+        TaskBatch(const TaskBatch&) = delete;
+        TaskBatch& operator=(const TaskBatch&) = delete;
+
+        /**
+         * @brief std::function要求可拷贝, 只能移动的函数对象放到shared_ptr里再包一层
+         */
+        template <class F>
+        static std::function<void()> MakeCallback(F&& cb) {
+            typedef typename std::decay<F>::type Fun;
+            return MakeCallback(std::forward<F>(cb), std::is_copy_constructible<Fun>());
+        }
+
+        template <class F>
+        static std::function<void()> MakeCallback(F&& cb, std::true_type) {
+            return std::function<void()>(std::forward<F>(cb));
+        }
+
+        template <class F>
+        static std::function<void()> MakeCallback(F&& cb, std::false_type) {
+            typedef typename std::decay<F>::type Fun;
+            std::shared_ptr<Fun> fun = std::make_shared<Fun>(std::forward<F>(cb));
+            return [fun]() { (*fun)(); };
+        }
+
+        /**
+         * @brief 普通任务连到对应优先级的链表尾部, 指定了线程或有截止时间的单独存放
+         */
+        void push(FiberAndThread& ft);
+
+    private:
+        TaskNode* m_first[PRIORITY_COUNT] = {nullptr};
+        TaskNode* m_last[PRIORITY_COUNT] = {nullptr};
+        size_t m_count[PRIORITY_COUNT] = {0};
+        std::vector<FiberAndThread> m_others;   // 提交时逐个入队
+        size_t m_size = 0;
+        uint64_t m_createUs = 0;    // 第一个任务加入的时间, 作为整批的入队时间
+    };
+
+    template <class InputIterator>
+    void Scheduler::scheduleBatch(InputIterator begin, InputIterator end, int priority) {
+        TaskBatch batch;
+        while (begin != end)
+        {
+            FiberAndThread ft(&*begin, -1);
+            if (ft.fiber || ft.cb) {
+                if (priority >= 0) {
+                    ft.priority = priority;
+                    if (ft.fiber) {
+                        ft.fiber->setPriority(priority);
+                    }
+                }
+                batch.push(ft);
+            }
+            ++begin;
+        }
+        schedule(batch);
+    }
 };
 
 
@@ -0,0 +1,275 @@
+//
+// 协程栈使用统计和按统计选择栈大小
+//
+
+#include "stack_profile.h"
+#include "config.h"
+#include "log.h"
+#include "mutex.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <cxxabi.h>
+#include <memory>
+#include <sstream>
+#include <typeindex>
+#include <unordered_map>
+
+namespace sylar {
+
+    static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    static ConfigVar<bool>::ptr g_stack_profile =
+            Config::Lookup<bool>("fiber.stack_profile", false,
+                                 "paint fiber stacks and record high-water marks per entry point");
+
+    static ConfigVar<bool>::ptr g_stack_adaptive =
+            Config::Lookup<bool>("fiber.stack_adaptive", false,
+                                 "pick fiber stack size from fiber.stack_classes by recorded high-water marks");
+
+    static ConfigVar<std::vector<uint32_t> >::ptr g_stack_classes =
+            Config::Lookup("fiber.stack_classes", std::vector<uint32_t>{16 * 1024, 32 * 1024, 64 * 1024, 128 * 1024},
+                           "fiber stack size classes for fiber.stack_adaptive");
+
+    static ConfigVar<uint32_t>::ptr g_stack_headroom =
+            Config::Lookup<uint32_t>("fiber.stack_headroom", 100,
+                                     "percent added to the high-water mark when picking a stack class");
+
+    // 填充栈的字节
+    static const uint8_t STACK_PAINT = 0xa5;
+
+    // 最多支持的栈大小档位数
+    static const size_t MAX_STACK_CLASSES = 16;
+
+    // 配置在调度路径上读, 缓存到原子变量里, 由配置的监听器更新, 读时不加锁.
+    // 更新档位的过程中读到新旧混合的档位只会让一次分配选错档, 不影响正确性
+    static std::atomic<bool> s_profiling = {false};
+    static std::atomic<bool> s_adaptive = {false};
+    static std::atomic<uint32_t> s_headroom = {100};
+    static std::atomic<uint32_t> s_classes[MAX_STACK_CLASSES] = {{16 * 1024}, {32 * 1024}, {64 * 1024}, {128 * 1024}};
+    static std::atomic<size_t> s_class_count = {4};
+
+    static void SetStackClasses(std::vector<uint32_t> classes) {
+        std::sort(classes.begin(), classes.end());
+        if (classes.size() > MAX_STACK_CLASSES) {
+            SYLAR_LOG_WARN(g_logger) << "fiber.stack_classes has " << classes.size()
+                                     << " classes, only the smallest " << MAX_STACK_CLASSES << " are used";
+            classes.resize(MAX_STACK_CLASSES);
+        }
+        s_class_count.store(0, std::memory_order_release);
+        for (size_t i = 0; i < classes.size(); ++i) {
+            s_classes[i].store(classes[i], std::memory_order_relaxed);
+        }
+        s_class_count.store(classes.size(), std::memory_order_release);
+    }
+
+    struct StackProfileIniter {
+        StackProfileIniter() {
+            s_profiling = g_stack_profile->getValue();
+            s_adaptive = g_stack_adaptive->getValue();
+            s_headroom = g_stack_headroom->getValue();
+            SetStackClasses(g_stack_classes->getValue());
+            g_stack_profile->addListener([](const bool&, const bool& new_value) {
+                s_profiling = new_value;
+            });
+            g_stack_adaptive->addListener([](const bool&, const bool& new_value) {
+                s_adaptive = new_value;
+            });
+            g_stack_headroom->addListener([](const uint32_t&, const uint32_t& new_value) {
+                s_headroom = new_value;
+            });
+            g_stack_classes->addListener([](const std::vector<uint32_t>&, const std::vector<uint32_t>& new_value) {
+                SetStackClasses(new_value);
+            });
+        }
+    };
+
+    static StackProfileIniter s_stack_profile_initer;
+
+    // 入口的三种区分方式各用一个表, 查找时不用构造新的key
+    struct StackProfileMap {
+        std::unordered_map<std::type_index, StackProfile*> types;
+        std::unordered_map<const void*, StackProfile*> functions;
+        std::unordered_map<std::string, StackProfile*> tags;
+    };
+
+    // 统计项只增不删, 指针一直有效
+    struct StackProfileRegistry {
+        RWMutex mutex;
+        StackProfileMap profiles;
+        std::vector<std::unique_ptr<StackProfile> > owned;
+    };
+
+    static StackProfileRegistry* GetRegistry() {
+        // 不析构, 进程退出时还在析构的协程可以继续记录
+        static StackProfileRegistry* s_registry = new StackProfileRegistry;
+        return s_registry;
+    }
+
+    // 每个线程缓存查到过的统计项, 稳定后查找不加锁也不分配内存
+    static thread_local StackProfileMap t_profiles;
+
+    static std::string Demangle(const char* name) {
+        char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, nullptr);
+        if (!demangled) {
+            return name;
+        }
+        std::string rt = demangled;
+        free(demangled);
+        return rt;
+    }
+
+    /**
+     * @brief 先查线程缓存, 再查全局表, 都没有时新建
+     * @param[in] name 新建时生成入口名称
+     */
+    template<class Key, class NameFunc>
+    static StackProfile* LookupProfile(std::unordered_map<Key, StackProfile*> StackProfileMap::* table
+                                       , const Key& key, NameFunc name) {
+        std::unordered_map<Key, StackProfile*>& local = t_profiles.*table;
+        auto it = local.find(key);
+        if (it != local.end()) {
+            return it->second;
+        }
+
+        StackProfile* profile = nullptr;
+        StackProfileRegistry* registry = GetRegistry();
+        {
+            RWMutex::ReadLock lock(registry->mutex);
+            auto git = (registry->profiles.*table).find(key);
+            if (git != (registry->profiles.*table).end()) {
+                profile = git->second;
+            }
+        }
+        if (!profile) {
+            RWMutex::WriteLock lock(registry->mutex);
+            StackProfile*& slot = (registry->profiles.*table)[key];
+            if (!slot) {
+                slot = new StackProfile;
+                slot->name = name();
+                registry->owned.emplace_back(slot);
+            }
+            profile = slot;
+        }
+        local[key] = profile;
+        return profile;
+    }
+
+    bool IsStackProfiling() {
+        return s_profiling.load(std::memory_order_relaxed);
+    }
+
+    bool IsStackAdaptive() {
+        return s_adaptive.load(std::memory_order_relaxed);
+    }
+
+    StackProfile* GetStackProfile(const std::function<void()>& cb) {
+        if (!cb) {
+            return nullptr;
+        }
+        // 标签, 普通函数按地址, 其他按回调的类型(lambda的类型名里有定义它的函数)
+        if (const StackTagged* tagged = cb.target<StackTagged>()) {
+            return LookupProfile(&StackProfileMap::tags, tagged->tag, [tagged]() {
+                return "tag:" + tagged->tag;
+            });
+        }
+        if (void (* const* fn)() = cb.target<void (*)()>()) {
+            const void* addr = (const void*)*fn;
+            return LookupProfile(&StackProfileMap::functions, addr, [addr]() {
+                std::stringstream ss;
+                ss << "function:" << addr;
+                return ss.str();
+            });
+        }
+        const std::type_info& type = cb.target_type();
+        return LookupProfile(&StackProfileMap::types, std::type_index(type), [&type]() {
+            return Demangle(type.name());
+        });
+    }
+
+    size_t ChooseStackSize(const StackProfile* profile, size_t default_size) {
+        if (!profile || profile->count.load(std::memory_order_relaxed) == 0) {
+            return default_size;
+        }
+        uint64_t want = profile->maxUsed.load(std::memory_order_relaxed)
+                        * (100 + s_headroom.load(std::memory_order_relaxed)) / 100;
+        size_t count = s_class_count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t size = s_classes[i].load(std::memory_order_relaxed);
+            if (size >= want) {
+                return size;
+            }
+        }
+        return default_size;
+    }
+
+    void PaintStack(void* stack, size_t size) {
+        memset(stack, STACK_PAINT, size);
+    }
+
+    size_t MeasureStack(const void* stack, size_t size) {
+        const uint8_t* begin = (const uint8_t*)stack;
+        const uint8_t* end = begin + size;
+        const uint8_t* p = begin;
+        // 按8字节比较, 剩下的逐字节
+        uint64_t word = 0;
+        memset(&word, STACK_PAINT, sizeof(word));
+        while (p + sizeof(word) <= end && *(const uint64_t*)p == word) {
+            p += sizeof(word);
+        }
+        while (p < end && *p == STACK_PAINT) {
+            ++p;
+        }
+        return end - p;
+    }
+
+    void RecordStackUsage(StackProfile* profile, size_t used, size_t stack_size) {
+        ++profile->count;
+        profile->totalUsed += used;
+        profile->stackSize = stack_size;
+        uint64_t max = profile->maxUsed;
+        while (used > max && !profile->maxUsed.compare_exchange_weak(max, used)) {
+        }
+    }
+
+    std::vector<StackUsage> GetStackUsage() {
+        std::vector<StackUsage> rt;
+        StackProfileRegistry* registry = GetRegistry();
+        RWMutex::ReadLock lock(registry->mutex);
+        for (auto& i : registry->owned) {
+            const StackProfile& profile = *i;
+            StackUsage usage;
+            usage.name = profile.name;
+            usage.count = profile.count;
+            usage.avgUsed = usage.count ? profile.totalUsed / usage.count : 0;
+            usage.maxUsed = profile.maxUsed;
+            usage.stackSize = profile.stackSize;
+            usage.classSize = ChooseStackSize(&profile, 0);
+            rt.push_back(usage);
+        }
+        lock.unlock();
+        std::sort(rt.begin(), rt.end(), [](const StackUsage& a, const StackUsage& b) {
+            return a.maxUsed > b.maxUsed;
+        });
+        return rt;
+    }
+
+    void DumpStackUsage(std::ostream& os) {
+        std::vector<StackUsage> usage = GetStackUsage();
+        os << "fiber stack usage entries=" << usage.size() << std::endl;
+        for (auto& i : usage) {
+            os << "  max=" << i.maxUsed
+               << " avg=" << i.avgUsed
+               << " count=" << i.count
+               << " stack=" << i.stackSize
+               << " class=";
+            if (i.classSize) {
+                os << i.classSize;
+            } else {
+                os << "default";
+            }
+            os << " entry=" << i.name << std::endl;
+        }
+    }
+}
@@ -0,0 +1,111 @@
+//
+// 协程栈使用统计和按统计选择栈大小
+//
+
+#ifndef MYSYLAR_STACK_PROFILE_H
+#define MYSYLAR_STACK_PROFILE_H
+
+#include <atomic>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace sylar {
+
+    /**
+     * @brief 一个协程入口的栈使用统计
+     * @details 入口按回调的类型区分(每个lambda是一个类型, 相当于按调用点区分),
+     *          普通函数指针按函数地址区分, 用WithStackTag包装的回调按标签区分
+     */
+    struct StackProfile {
+        std::string name;                       // 入口名称, 回调的类型名或标签
+        std::atomic<uint64_t> count = {0};      // 统计过的协程数
+        std::atomic<uint64_t> totalUsed = {0};  // 栈使用量之和
+        std::atomic<uint64_t> maxUsed = {0};    // 栈使用量的最大值(high-water mark)
+        std::atomic<uint64_t> stackSize = {0};  // 最近一次分配的栈大小
+    };
+
+    /**
+     * @brief 报告里的一行
+     */
+    struct StackUsage {
+        std::string name;
+        uint64_t count = 0;
+        uint64_t avgUsed = 0;
+        uint64_t maxUsed = 0;
+        uint64_t stackSize = 0;     // 最近一次分配的栈大小
+        uint64_t classSize = 0;     // 按当前统计选出的栈大小
+    };
+
+    /**
+     * @brief 带标签的回调, 栈统计按标签而不是回调的类型归类
+     */
+    struct StackTagged {
+        std::string tag;
+        std::function<void()> cb;
+
+        void operator()() const { cb();}
+    };
+
+    /**
+     * @brief 给回调打上栈统计的标签, 同一标签的回调共用统计和栈大小
+     */
+    inline std::function<void()> WithStackTag(const std::string& tag, std::function<void()> cb) {
+        return StackTagged{tag, std::move(cb)};
+    }
+
+    /**
+     * @brief 是否统计栈使用(fiber.stack_profile)
+     * @details 开启后分配栈时用固定的字节填满, 协程结束时从栈底找第一个被改写的位置得到使用量.
+     *          填充会让整个栈常驻内存, 只在压测或者预发布环境打开
+     */
+    bool IsStackProfiling();
+
+    /**
+     * @brief 是否按统计选择栈大小(fiber.stack_adaptive)
+     */
+    bool IsStackAdaptive();
+
+    /**
+     * @brief 回调对应的统计项, 没有时新建, 返回的指针一直有效
+     * @details 按回调的类型(std::type_index), 函数地址或标签查找, 每个线程缓存查到过的项,
+     *          同一入口再次查找不加锁也不分配内存
+     * @return cb为空时返回nullptr
+     */
+    StackProfile* GetStackProfile(const std::function<void()>& cb);
+
+    /**
+     * @brief 按统计选择栈大小
+     * @details 从fiber.stack_classes里选不小于maxUsed * (100 + fiber.stack_headroom) / 100的最小一档,
+     *          没有统计或者都不够时返回default_size
+     */
+    size_t ChooseStackSize(const StackProfile* profile, size_t default_size);
+
+    /**
+     * @brief 用固定的字节填充[stack, stack + size)
+     */
+    void PaintStack(void* stack, size_t size);
+
+    /**
+     * @brief 从栈底往上找第一个被改写的位置, 返回栈的使用量
+     */
+    size_t MeasureStack(const void* stack, size_t size);
+
+    /**
+     * @brief 记录一次栈使用
+     */
+    void RecordStackUsage(StackProfile* profile, size_t used, size_t stack_size);
+
+    /**
+     * @brief 所有入口的统计, 按最大使用量从大到小
+     */
+    std::vector<StackUsage> GetStackUsage();
+
+    /**
+     * @brief 输出统计报告, 每个入口一行
+     */
+    void DumpStackUsage(std::ostream& os);
+}
+
+#endif //MYSYLAR_STACK_PROFILE_H
@@ -13,9 +13,12 @@
 #include "mutex.h"
 #include "macro.h"
 #include "fiber.h"
+#include "fiber_context.h"
 #include "scheduler.h"
 #include "iomanager.h"
 #include "timer.h"
 #include "hook.h"
+#include "affinity.h"
+#include "stack_profile.h"
 
 #endif //MYSYLAR_SYLAR_H
@@ -3,9 +3,21 @@
 //
 
 #include "sylar.h"
+#include <ucontext.h>
+#include <sys/wait.h>
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
+static const int SWITCH_ROUNDS = 1000000;
+static ucontext_t s_main_ctx;
+static ucontext_t s_uc_ctx;
+
+static void uc_func() {
+    while (true) {
+        swapcontext(&s_uc_ctx, &s_main_ctx);
+    }
+}
+
 void run_in_fiber() {
     SYLAR_LOG_INFO(g_logger) << "run_in_fiber begin";
     sylar::Fiber::YieldToHold();
@@ -28,6 +40,169 @@ void test_fiber() {
     SYLAR_LOG_INFO(g_logger) << "main after end2";
 }
 
+// 切换开销: 协程和主协程来回切换, 和直接用swapcontext(每次切换一次rt_sigprocmask)对比
+void test_switch_bench() {
+    sylar::Fiber::GetThis();
+    sylar::Fiber::ptr fiber(new sylar::Fiber([]() {
+        for (int i = 0; i < SWITCH_ROUNDS; ++i) {
+            sylar::Fiber::YieldToHold();
+        }
+    }));
+    uint64_t begin = sylar::GetCurrentUS();
+    for (int i = 0; i <= SWITCH_ROUNDS; ++i) {
+        fiber->swapIn();
+    }
+    uint64_t fiber_us = sylar::GetCurrentUS() - begin;
+    SYLAR_ASSERT(fiber->getState() == sylar::Fiber::TERM);
+
+    std::vector<char> stack(64 * 1024);
+    getcontext(&s_uc_ctx);
+    s_uc_ctx.uc_link = nullptr;
+    s_uc_ctx.uc_stack.ss_sp = &stack[0];
+    s_uc_ctx.uc_stack.ss_size = stack.size();
+    makecontext(&s_uc_ctx, &uc_func, 0);
+    begin = sylar::GetCurrentUS();
+    for (int i = 0; i < SWITCH_ROUNDS; ++i) {
+        swapcontext(&s_main_ctx, &s_uc_ctx);
+    }
+    uint64_t uc_us = sylar::GetCurrentUS() - begin;
+
+    // 一轮是两次切换
+    SYLAR_LOG_INFO(g_logger) << "switch bench rounds=" << SWITCH_ROUNDS
+                             << " fiber(" << sylar::FiberContextImpl() << ")="
+                             << fiber_us * 1000.0 / (2 * SWITCH_ROUNDS) << "ns"
+                             << " swapcontext=" << uc_us * 1000.0 / (2 * SWITCH_ROUNDS) << "ns";
+}
+
+// 协程的创建销毁, 栈从线程缓存里复用
+void test_stack_pool() {
+    sylar::Fiber::GetThis();
+    uint64_t begin = sylar::GetCurrentUS();
+    int count = 0;
+    for (int i = 0; i < 100000; ++i) {
+        sylar::Fiber::ptr fiber(new sylar::Fiber([&count]() { ++count; }));
+        fiber->swapIn();
+    }
+    uint64_t us = sylar::GetCurrentUS() - begin;
+    SYLAR_LOG_INFO(g_logger) << "stack pool fibers=" << count << " " << us * 1000.0 / count << "ns per fiber";
+    SYLAR_ASSERT(count == 100000);
+}
+
+static int overflow(int depth) {
+    char buf[1024];
+    memset(buf, depth, sizeof(buf));
+    return depth > 1000000 ? buf[0] : overflow(depth + 1) + buf[depth % sizeof(buf)];
+}
+
+// 栈溢出碰到保护页, 子进程应该被SIGSEGV杀掉而不是写坏堆
+void test_stack_guard() {
+    pid_t pid = fork();
+    if (pid == 0) {
+        sylar::Fiber::GetThis();
+        sylar::Fiber::ptr fiber(new sylar::Fiber([]() { overflow(0); }));
+        fiber->swapIn();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    SYLAR_LOG_INFO(g_logger) << "stack guard signaled=" << WIFSIGNALED(status)
+                             << " signal=" << (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    SYLAR_ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+}
+
+// 虚拟内存和常驻内存, 单位KB
+static void MemoryKB(long& vsz, long& rss) {
+    vsz = rss = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &vsz, &rss) != 2) {
+            vsz = rss = 0;
+        }
+        fclose(fp);
+    }
+    vsz = vsz * sysconf(_SC_PAGESIZE) / 1024;
+    rss = rss * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+// 处理请求时用到较深的栈
+static int __attribute__((noinline)) deep_work(int n) {
+    volatile char buf[32 * 1024];
+    for (size_t i = 0; i < sizeof(buf); i += 64) {
+        buf[i] = (char)(n + i);
+    }
+    return buf[n % sizeof(buf)];
+}
+
+// 模拟挂起的连接: 处理完一个请求后等下一个, 栈上有1KB的缓冲区, 恢复后内容不能变
+static void parked_func() {
+    deep_work(1);
+    char buf[1024];
+    char c = (char)sylar::Fiber::GetFiberId();
+    memset(buf, c, sizeof(buf));
+    sylar::Fiber::YieldToHold();
+    for (auto i : buf) {
+        SYLAR_ASSERT(i == c);
+    }
+}
+
+// 共享栈: 挂起的协程占用的内存, 和独立栈对比
+void test_shared_stack_memory() {
+    sylar::Fiber::GetThis();
+    const int count = 10000;
+    for (int shared = 1; shared >= 0; --shared) {
+        std::vector<sylar::Fiber::ptr> fibers;
+        long vsz = 0, rss = 0;
+        MemoryKB(vsz, rss);
+        for (int i = 0; i < count; ++i) {
+            sylar::Fiber::ptr fiber(new sylar::Fiber(&parked_func, 0, false, shared));
+            fiber->swapIn();
+            fibers.push_back(fiber);
+        }
+        long vsz_after = 0, rss_after = 0;
+        MemoryKB(vsz_after, rss_after);
+        size_t saved = 0;
+        for (auto& i : fibers) {
+            saved += i->getSavedStackSize();
+        }
+        for (auto& i : fibers) {
+            i->swapIn();
+            SYLAR_ASSERT(i->getState() == sylar::Fiber::TERM);
+        }
+        SYLAR_LOG_INFO(g_logger) << "parked fibers=" << count << " shared_stack=" << shared
+                                 << " vsz_per_fiber=" << (vsz_after - vsz) * 1024 / count << "B"
+                                 << " rss_per_fiber=" << (rss_after - rss) * 1024 / count << "B"
+                                 << " saved_stack_per_fiber=" << saved / count << "B";
+    }
+}
+
+// 共享栈的切换开销: 两个协程轮流执行, 一个共享栈时每次切换都要拷贝栈
+void test_shared_stack_switch() {
+    sylar::Fiber::GetThis();
+    const int rounds = 200000;
+    for (int shared = 0; shared < 2; ++shared) {
+        sylar::Fiber::ptr fibers[2];
+        for (auto& i : fibers) {
+            i.reset(new sylar::Fiber([rounds]() {
+                char buf[1024];
+                memset(buf, 0, sizeof(buf));
+                for (int n = 0; n < rounds; ++n) {
+                    sylar::Fiber::YieldToHold();
+                }
+            }, 0, false, shared));
+        }
+        uint64_t begin = sylar::GetCurrentUS();
+        for (int n = 0; n <= rounds; ++n) {
+            fibers[0]->swapIn();
+            fibers[1]->swapIn();
+        }
+        uint64_t us = sylar::GetCurrentUS() - begin;
+        SYLAR_ASSERT(fibers[0]->getState() == sylar::Fiber::TERM);
+        SYLAR_LOG_INFO(g_logger) << "switch shared_stack=" << shared
+                                 << " saved=" << fibers[0]->getSavedStackSize() << "B "
+                                 << us * 1000.0 / (4 * rounds) << "ns per switch";
+    }
+}
+
 int main ()
 {
     sylar::Thread::SetName("main");
@@ -42,5 +217,18 @@ int main ()
     {
         i->join();
     }
+
+    sylar::Thread thr(&test_switch_bench, "switch_bench");
+    thr.join();
+    sylar::Thread pool_thr(&test_stack_pool, "stack_pool");
+    pool_thr.join();
+    test_stack_guard();
+
+    sylar::Thread memory_thr(&test_shared_stack_memory, "shared_memory");
+    memory_thr.join();
+    // 两个协程用同一个共享栈
+    sylar::Config::Lookup<uint32_t>("fiber.shared_stack_count")->setValue(1);
+    sylar::Thread switch_thr(&test_shared_stack_switch, "shared_switch");
+    switch_thr.join();
     return 0;
 }
\ No newline at end of file
@@ -64,8 +64,33 @@ void test_timer() {
     }, true);
 }
 
+// 调度统计, 按scheduler.stats_interval定期输出, 结束时再输出一次
+void test_stats() {
+    sylar::Config::Lookup<uint64_t>("scheduler.stats_interval")->setValue(500);
+    sylar::IOManager iom(2, false, "stats");
+    for (int i = 0; i < 1000; ++i) {
+        iom.schedule([]() {
+            usleep(1000);
+        });
+    }
+    for (int i = 0; i < 10; ++i) {
+        iom.addTimer(100 * i, []() {});
+    }
+    sleep(2);
+    std::stringstream ss;
+    iom.dumpStats(ss);
+    SYLAR_LOG_INFO(g_logger) << ss.str();
+    uint64_t tasks = 0;
+    for (auto& i : iom.getStats()) {
+        tasks += i.tasks();
+    }
+    SYLAR_ASSERT(tasks >= 1010);
+    sylar::Config::Lookup<uint64_t>("scheduler.stats_interval")->setValue(0);
+}
+
 int main() {
     //test1();
     test_timer();
+    test_stats();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,285 @@
+//
+// 日志吞吐和延迟基准测试, 结果以JSON输出, 便于跨提交对比log.cpp的性能变化
+// 用法: test_log_bench [-n 每线程日志条数] [-t 最大线程数] [-a appender,...] [-o 输出文件]
+// appender: stdout file async binary ring, 线程数按1,2,4...直到最大线程数
+// 每组测试记录 events/sec(写日志线程视角, 不含异步刷盘) 和单条日志耗时的 p50/p99/p999/max
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include "../log.h"
+
+// Logger::Logger中的默认格式
+static const char* s_full_pattern = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n";
+static const char* s_message_pattern = "%m%n";
+
+struct BenchResult {
+    std::string appender;
+    std::string macro;
+    std::string pattern;
+    int threads;
+    uint64_t events;
+    double seconds;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+static std::string s_dir;
+
+// CreateAppender支持的输出地
+static const char* s_appenders[] = {"stdout", "file", "async", "binary", "ring"};
+
+static bool IsKnownAppender(const std::string& name)
+{
+    return std::find(std::begin(s_appenders), std::end(s_appenders), name) != std::end(s_appenders);
+}
+
+static sylar::LogAppender::ptr CreateAppender(const std::string& name, int id)
+{
+    std::string file = s_dir + "/" + name + "_" + std::to_string(id) + ".log";
+    if (name == "stdout")
+    {
+        return sylar::LogAppender::ptr(new sylar::StdoutLogAppender);
+    }
+    if (name == "file")
+    {
+        return sylar::LogAppender::ptr(new sylar::FileLogAppender(file));
+    }
+    if (name == "async")
+    {
+        return sylar::LogAppender::ptr(new sylar::AsyncFileLogAppender(file));
+    }
+    if (name == "binary")
+    {
+        return sylar::LogAppender::ptr(new sylar::BinaryFileLogAppender(file));
+    }
+    if (name == "ring")
+    {
+        return sylar::LogAppender::ptr(new sylar::MmapRingLogAppender(file, 64 * 1024 * 1024));
+    }
+    return nullptr;
+}
+
+static uint64_t Percentile(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t idx = (size_t)(p * (sorted.size() - 1));
+    return sorted[idx];
+}
+
+static BenchResult RunOne(const std::string& appender_name, const std::string& macro
+                          , const std::string& pattern_name, int threads, int n, int id)
+{
+    sylar::Logger::ptr logger(new sylar::Logger("bench"));
+    sylar::LogAppender::ptr appender = CreateAppender(appender_name, id);
+    appender->setFormatter(sylar::LogFormatter::ptr(new sylar::LogFormatter(
+            pattern_name == "full" ? s_full_pattern : s_message_pattern)));
+    logger->addAppender(appender);
+
+    std::vector<std::vector<uint64_t> > latencies(threads);
+    std::atomic<int> ready = {0};
+    std::atomic<bool> go = {false};
+    bool fmt = macro == "fmt";
+
+    auto worker = [&](int idx) {
+        std::vector<uint64_t>& lat = latencies[idx];
+        lat.resize(n);
+        ++ready;
+        while (!go)
+        {
+            sched_yield();
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            if (fmt)
+            {
+                SYLAR_LOG_FMT_INFO(logger, "bench message thread=%d seq=%d value=%f", idx, i, i * 0.5);
+            }
+            else
+            {
+                SYLAR_LOG_INFO(logger) << "bench message thread=" << idx << " seq=" << i << " value=" << i * 0.5;
+            }
+            lat[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - begin).count();
+        }
+    };
+
+    std::vector<sylar::Thread::ptr> thrs;
+    for (int i = 0; i < threads; ++i)
+    {
+        thrs.push_back(sylar::Thread::ptr(new sylar::Thread(std::bind(worker, i), "bench_" + std::to_string(i))));
+    }
+    while (ready != threads)
+    {
+        sched_yield();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    go = true;
+    for (auto& i : thrs)
+    {
+        i->join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::vector<uint64_t> all;
+    all.reserve((size_t)threads * n);
+    for (auto& i : latencies)
+    {
+        all.insert(all.end(), i.begin(), i.end());
+    }
+    std::sort(all.begin(), all.end());
+
+    BenchResult r;
+    r.appender = appender_name;
+    r.macro = macro;
+    r.pattern = pattern_name;
+    r.threads = threads;
+    r.events = all.size();
+    r.seconds = seconds;
+    r.p50 = Percentile(all, 0.5);
+    r.p99 = Percentile(all, 0.99);
+    r.p999 = Percentile(all, 0.999);
+    r.max = all.empty() ? 0 : all.back();
+    return r;
+}
+
+static std::vector<std::string> Split(const std::string& str)
+{
+    std::vector<std::string> rt;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        if (!item.empty())
+        {
+            rt.push_back(item);
+        }
+    }
+    return rt;
+}
+
+int main(int argc, char** argv)
+{
+    int n = 100000;
+    int max_threads = std::max(4u, std::thread::hardware_concurrency());
+    std::string appenders = "stdout,file,async,binary,ring";
+    std::string output;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:a:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                n = atoi(optarg);
+                break;
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 'a':
+                appenders = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                std::cerr << "usage: " << argv[0]
+                          << " [-n events_per_thread] [-t max_threads] [-a stdout,file,async,binary,ring] [-o out.json]"
+                          << std::endl;
+                return 1;
+        }
+    }
+
+    char tmpl[] = "/tmp/sylar_log_bench.XXXXXX";
+    if (!mkdtemp(tmpl))
+    {
+        std::cerr << "mkdtemp failed" << std::endl;
+        return 1;
+    }
+    s_dir = tmpl;
+
+    // StdoutLogAppender的输出丢到/dev/null, 结果最后写回原来的stdout
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    std::vector<BenchResult> results;
+    int id = 0;
+    for (auto& a : Split(appenders))
+    {
+        if (!IsKnownAppender(a))
+        {
+            std::cerr << "unknown appender " << a << std::endl;
+            continue;
+        }
+        for (int threads = 1; threads <= max_threads; threads *= 2)
+        {
+            for (const char* macro : {"stream", "fmt"})
+            {
+                for (const char* pattern : {"full", "message"})
+                {
+                    results.push_back(RunOne(a, macro, pattern, threads, n, id++));
+                    const BenchResult& r = results.back();
+                    std::cerr << r.appender << "\tthreads=" << r.threads << "\t" << r.macro
+                              << "\t" << r.pattern << "\tevents/s=" << (uint64_t)(r.events / r.seconds)
+                              << "\tp99=" << r.p99 << "ns" << std::endl;
+                }
+            }
+        }
+    }
+
+    std::cout.flush();
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    system(("rm -rf " + s_dir).c_str());
+
+    std::stringstream ss;
+    ss << "{\n  \"events_per_thread\": " << n << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult& r = results[i];
+        ss << "    {\"appender\": \"" << r.appender << "\""
+           << ", \"threads\": " << r.threads
+           << ", \"macro\": \"" << r.macro << "\""
+           << ", \"pattern\": \"" << r.pattern << "\""
+           << ", \"events\": " << r.events
+           << ", \"seconds\": " << r.seconds
+           << ", \"events_per_sec\": " << (uint64_t)(r.events / r.seconds)
+           << ", \"p50_ns\": " << r.p50
+           << ", \"p99_ns\": " << r.p99
+           << ", \"p999_ns\": " << r.p999
+           << ", \"max_ns\": " << r.max
+           << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    ss << "  ]\n}\n";
+
+    if (output.empty())
+    {
+        std::cout << ss.str();
+    }
+    else
+    {
+        std::ofstream ofs(output);
+        ofs << ss.str();
+    }
+    return 0;
+}
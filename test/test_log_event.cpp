@@ -0,0 +1,420 @@
+//
+// 对比日志宏两种LogEvent构造方式的开销: 每条日志的耗时(ns/op)和内存分配次数(allocs/op)
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <new>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include "../log.h"
+#include "../macro.h"
+
+static std::atomic<uint64_t> s_alloc_count {0};
+
+void* operator new(size_t size) {
+    ++s_alloc_count;
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+// 只读取内容, 不做格式化和IO, 只衡量事件本身的构造开销
+class NullLogAppender : public sylar::LogAppender {
+public:
+    void log(const std::shared_ptr<sylar::Logger>& logger, sylar::LogLevel::Level level, const sylar::LogEvent::ptr& event) override {
+        m_bytes += event->getContentSize();
+    }
+    std::string toYamlString() override { return ""; }
+    uint64_t m_bytes = 0;
+};
+
+// 原来的宏展开: 每条日志new一个LogEvent, 并拷贝线程名
+#define LEGACY_LOG_LEVEL(logger, level) \
+    if (logger->getLevel() <= level) \
+        sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger, level, \
+                __FILE__, __LINE__, 0, sylar::GetThreadId(),\
+                sylar::GetFiberId(), time(0), sylar::Thread::GetName()))).getSS()
+
+#define LEGACY_LOG_FMT_LEVEL(logger, level, fmt, ...) \
+    if (logger->getLevel() <= level) \
+        sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger, level, \
+                __FILE__, __LINE__, 0, sylar::GetThreadId(),\
+                sylar::GetFiberId(), time(0), sylar::Thread::GetName()))).getEvent()->format(fmt, __VA_ARGS__)
+
+// 保存每条日志的内容, 读取内容时才执行延迟的格式化
+class CaptureLogAppender : public sylar::LogAppender {
+public:
+    typedef std::shared_ptr<CaptureLogAppender> ptr;
+    void log(const std::shared_ptr<sylar::Logger>& logger, sylar::LogLevel::Level level, const sylar::LogEvent::ptr& event) override {
+        if (level >= m_level) {
+            m_lines.push_back(event->getContent());
+        }
+    }
+    std::string toYamlString() override { return ""; }
+    std::vector<std::string> m_lines;
+};
+
+// 析构时改写内容, 模拟调用方的字符串在日志真正格式化之前就变了(临时对象先于LogEventWrap析构)
+struct Scribble {
+    char buf[16];
+    Scribble(const char* s) { snprintf(buf, sizeof(buf), "%s", s); }
+    ~Scribble() { memset(buf, 'x', sizeof(buf) - 1); }
+    char* get() { return buf; }
+};
+
+static std::string Sprintf(const char* fmt, ...) {
+    char buf[256];
+    va_list al;
+    va_start(al, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, al);
+    va_end(al);
+    return buf;
+}
+
+// C字符串只在对应普通%s时拷贝延迟格式化, 其他用法立即格式化
+void test_lazy_strings() {
+    sylar::Logger::ptr logger(new sylar::Logger("lazy_strings"));
+    CaptureLogAppender::ptr appender(new CaptureLogAppender);
+    logger->addAppender(appender);
+
+    // %s: 拷贝内容, 调用方的缓冲区之后被改写也不影响
+    SYLAR_LOG_FMT_INFO(logger, "name=%s", Scribble("original").get());
+    SYLAR_ASSERT(appender->m_lines.back() == "name=original");
+    const char* null_str = nullptr;
+    SYLAR_LOG_FMT_INFO(logger, "null=%s", null_str);
+    SYLAR_ASSERT(appender->m_lines.back() == Sprintf("null=%s", null_str));
+
+    // %p: 输出调用方的指针, 而不是副本的地址
+    char buf[] = "abc";
+    SYLAR_LOG_FMT_INFO(logger, "ptr=%p", buf);
+    SYLAR_ASSERT(appender->m_lines.back() == Sprintf("ptr=%p", buf));
+
+    // %.*s: 没有结束符的缓冲区只读精度指定的长度
+    char raw[4] = {'a', 'b', 'c', 'd'};
+    SYLAR_LOG_FMT_INFO(logger, "raw=%.*s", 2, raw);
+    SYLAR_ASSERT(appender->m_lines.back() == "raw=ab");
+    SYLAR_LOG_FMT_INFO(logger, "raw=%.3s", raw);
+    SYLAR_ASSERT(appender->m_lines.back() == "raw=abc");
+
+    SYLAR_ASSERT(sylar::LogFormatSite::CheckLazyStrings("%d %s %10s %-s", 0xe));
+    SYLAR_ASSERT(!sylar::LogFormatSite::CheckLazyStrings("%d %p", 0x2));
+    SYLAR_ASSERT(!sylar::LogFormatSite::CheckLazyStrings("%*d %s", 0x1));
+    SYLAR_ASSERT(!sylar::LogFormatSite::CheckLazyStrings("%ls", 0x1));
+    SYLAR_ASSERT(!sylar::LogFormatSite::CheckLazyStrings("%1$s", 0x1));
+    SYLAR_ASSERT(!sylar::LogFormatSite::CheckLazyStrings("%d", 0x2));
+    SYLAR_ASSERT(sylar::LogFormatSite::CheckLazyStrings("%% %m %s", 0x1));
+    std::cout << "test_lazy_strings ok" << std::endl;
+}
+
+static int s_evaluated = 0;
+
+static int Evaluate(int v) {
+    ++s_evaluated;
+    return v;
+}
+
+// 延迟格式化的输出和立即格式化一致, 参数在调用时按值保存, 按日志器和Appender的汇总级别过滤
+void test_lazy_format() {
+    sylar::Logger::ptr logger(new sylar::Logger("lazy_format"));
+    logger->setLevel(sylar::LogLevel::DEBUG);
+    CaptureLogAppender::ptr appender(new CaptureLogAppender);
+    logger->addAppender(appender);
+
+    // 各种参数类型混合
+    int i = -42;
+    unsigned u = 42;
+    long l = -1234567890L;
+    long long ll = 1234567890123LL;
+    unsigned long long ull = 18446744073709551615ULL;
+    double d = 3.25;
+    char c = 'z';
+    short sh = -7;
+    const char* str = "text";
+    void* ptr = &i;
+    size_t sz = 99;
+    SYLAR_LOG_FMT_INFO(logger, "%d %u %ld %lld %llu %.2f %c %hd %s %p %zu %x %5.1e"
+                       , i, u, l, ll, ull, d, c, sh, str, ptr, sz, u, d);
+    SYLAR_ASSERT(appender->m_lines.back() == Sprintf("%d %u %ld %lld %llu %.2f %c %hd %s %p %zu %x %5.1e"
+                                                     , i, u, l, ll, ull, d, c, sh, str, ptr, sz, u, d));
+
+    // 参数在调用时保存: 之后变量改了, 字符串缓冲区被改写, 都不影响输出
+    int counter = 1;
+    std::string name = "before";
+    SYLAR_LOG_FMT_INFO(logger, "counter=%d name=%s tmp=%s", counter++, name.c_str()
+                       , Scribble("temporary").get());
+    name = "after";
+    SYLAR_ASSERT(counter == 2);
+    SYLAR_ASSERT(appender->m_lines.back() == "counter=1 name=before tmp=temporary");
+
+    // 参数放不下时立即格式化, 结果相同
+    SYLAR_LOG_FMT_INFO(logger, "%.0f %.0f %.0f %.0f %.0f %.0f %.0f %.0f %.0f %.0f %.0f %.0f %.0f %.0f %.0f %.0f %.0f %.0f"
+                       , 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 16.0, 17.0, 18.0);
+    SYLAR_ASSERT(appender->m_lines.back() == "1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18");
+
+    // 汇总级别: 唯一的Appender是ERROR时INFO被过滤, 参数都不求值
+    appender->setLevel(sylar::LogLevel::ERROR);
+    size_t lines = appender->m_lines.size();
+    s_evaluated = 0;
+    SYLAR_LOG_FMT_INFO(logger, "filtered %d", Evaluate(1));
+    SYLAR_ASSERT(s_evaluated == 0);
+    SYLAR_ASSERT(appender->m_lines.size() == lines);
+    SYLAR_LOG_FMT_ERROR(logger, "error %d", Evaluate(2));
+    SYLAR_ASSERT(s_evaluated == 1);
+    SYLAR_ASSERT(appender->m_lines.back() == "error 2");
+
+    // 加一个DEBUG的Appender后INFO放行, 但只有它输出
+    CaptureLogAppender::ptr debug_appender(new CaptureLogAppender);
+    debug_appender->setLevel(sylar::LogLevel::DEBUG);
+    logger->addAppender(debug_appender);
+    lines = appender->m_lines.size();
+    SYLAR_LOG_FMT_INFO(logger, "info %d", Evaluate(3));
+    SYLAR_ASSERT(s_evaluated == 2);
+    SYLAR_ASSERT(appender->m_lines.size() == lines);
+    SYLAR_ASSERT(debug_appender->m_lines.size() == 1 && debug_appender->m_lines.back() == "info 3");
+
+    // 日志器级别高于所有Appender时按日志器级别过滤
+    logger->setLevel(sylar::LogLevel::WARN);
+    SYLAR_LOG_FMT_INFO(logger, "info %d", Evaluate(4));
+    SYLAR_ASSERT(s_evaluated == 2);
+    SYLAR_ASSERT(debug_appender->m_lines.size() == 1);
+    std::cout << "test_lazy_format ok" << std::endl;
+}
+
+static std::string ReadFile(const std::string& path) {
+    std::ifstream ifs(path);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    return ss.str();
+}
+
+// dir下除name以外以name开头的文件(滚动出来的历史文件)
+static std::string FindRotated(const std::string& dir, const std::string& name) {
+    std::string rt;
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return rt;
+    }
+    while (struct dirent* entry = readdir(d)) {
+        std::string file = entry->d_name;
+        if (file != name && file.compare(0, name.size(), name) == 0) {
+            rt = dir + "/" + file;
+        }
+    }
+    closedir(d);
+    return rt;
+}
+
+// 同步文件输出每条日志写完就能从文件读到, 滚动之后写到新文件
+void test_file_flush(const std::string& dir) {
+    std::string path = dir + "/flush.log";
+    sylar::Logger::ptr logger(new sylar::Logger("flush"));
+    std::shared_ptr<sylar::FileLogAppender> appender(new sylar::FileLogAppender(path));
+    appender->setFormatter(sylar::LogFormatter::ptr(new sylar::LogFormatter("%m%n")));
+    logger->addAppender(appender);
+
+    SYLAR_LOG_ERROR(logger) << "error line";
+    SYLAR_ASSERT(ReadFile(path) == "error line\n");
+    SYLAR_LOG_INFO(logger) << "info line";
+    SYLAR_ASSERT(ReadFile(path) == "error line\ninfo line\n");
+
+    // 没有%n时ERROR以上也要刷新
+    appender->setFormatter(sylar::LogFormatter::ptr(new sylar::LogFormatter("[%m]")));
+    SYLAR_LOG_FATAL(logger) << "fatal";
+    SYLAR_ASSERT(ReadFile(path) == "error line\ninfo line\n[fatal]");
+    appender->setFormatter(sylar::LogFormatter::ptr(new sylar::LogFormatter("%m%n")));
+
+    // 超过max_size由后台线程滚动, 等到新文件建好
+    sylar::LogRotateConfig conf;
+    conf.max_size = 32;
+    appender->setRotateConfig(conf);
+    SYLAR_LOG_INFO(logger) << "trigger rotate";
+    std::string rotated;
+    for (int i = 0; i < 500 && (rotated.empty() || access(path.c_str(), F_OK) != 0); ++i) {
+        usleep(10 * 1000);
+        rotated = FindRotated(dir, "flush.log");
+    }
+    SYLAR_ASSERT(!rotated.empty());
+    SYLAR_ASSERT(ReadFile(rotated) == "error line\ninfo line\n[fatal]trigger rotate\n");
+    SYLAR_LOG_INFO(logger) << "after rotate";
+    SYLAR_ASSERT(ReadFile(path) == "after rotate\n");
+    std::cout << "test_file_flush ok" << std::endl;
+}
+
+static std::vector<std::string> ReadLines(const std::string& path) {
+    std::vector<std::string> lines;
+    std::ifstream ifs(path);
+    std::string line;
+    while (std::getline(ifs, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+// 按顺序是"line 0", "line 1"... 中的一部分; contiguous为true时不能有缺失
+static bool CheckSequence(const std::vector<std::string>& lines, int total, bool contiguous) {
+    int last = -1;
+    for (auto& i : lines) {
+        int n = -1;
+        if (sscanf(i.c_str(), "line %d", &n) != 1 || n <= last || n >= total
+                || (contiguous && n != last + 1)) {
+            return false;
+        }
+        last = n;
+    }
+    return !contiguous || last == total - 1;
+}
+
+// 异步文件输出: 析构时写完缓冲里的日志; 缓冲写满时BLOCK不丢日志, DROP丢掉并计数; reopen前后的日志都不丢
+void test_async_appender(const std::string& dir) {
+    const int total = 10000;
+    sylar::LogFormatter::ptr formatter(new sylar::LogFormatter("%m%n"));
+
+    // 刷盘间隔很长, 日志只在缓冲里, 析构时落盘
+    {
+        std::string path = dir + "/async_drain.log";
+        sylar::Logger::ptr logger(new sylar::Logger("async_drain"));
+        sylar::AsyncFileLogAppender::ptr appender(new sylar::AsyncFileLogAppender(path, 1024 * 1024, 4, 60 * 1000));
+        appender->setFormatter(formatter);
+        logger->addAppender(appender);
+        for (int i = 0; i < 100; ++i) {
+            SYLAR_LOG_INFO(logger) << "line " << i;
+        }
+        logger->clearAppenders();
+        appender.reset();
+        SYLAR_ASSERT(CheckSequence(ReadLines(path), 100, true));
+    }
+
+    // 两个很小的缓冲, 写日志比刷盘快, 一定会写满
+    {
+        std::string path = dir + "/async_block.log";
+        sylar::Logger::ptr logger(new sylar::Logger("async_block"));
+        sylar::AsyncFileLogAppender::ptr appender(new sylar::AsyncFileLogAppender(path, 64, 2, 60 * 1000
+                , sylar::AsyncFileLogAppender::BLOCK));
+        appender->setFormatter(formatter);
+        logger->addAppender(appender);
+        for (int i = 0; i < total; ++i) {
+            SYLAR_LOG_INFO(logger) << "line " << i;
+        }
+        SYLAR_ASSERT(appender->getDropped() == 0);
+        logger->clearAppenders();
+        appender.reset();
+        SYLAR_ASSERT(CheckSequence(ReadLines(path), total, true));
+    }
+    {
+        std::string path = dir + "/async_drop.log";
+        sylar::Logger::ptr logger(new sylar::Logger("async_drop"));
+        sylar::AsyncFileLogAppender::ptr appender(new sylar::AsyncFileLogAppender(path, 64, 2, 60 * 1000
+                , sylar::AsyncFileLogAppender::DROP));
+        appender->setFormatter(formatter);
+        logger->addAppender(appender);
+        for (int i = 0; i < total; ++i) {
+            SYLAR_LOG_INFO(logger) << "line " << i;
+        }
+        uint64_t dropped = appender->getDropped();
+        logger->clearAppenders();
+        appender.reset();
+        std::vector<std::string> lines = ReadLines(path);
+        std::cout << "async drop written=" << lines.size() << " dropped=" << dropped << std::endl;
+        SYLAR_ASSERT(dropped > 0);
+        SYLAR_ASSERT(lines.size() + dropped == (size_t)total);
+        SYLAR_ASSERT(CheckSequence(lines, total, false));
+    }
+
+    // 外部改名后reopen(logrotate的用法): 旧文件和新文件合起来一条不少
+    {
+        std::string path = dir + "/async_reopen.log";
+        std::string moved = dir + "/async_reopen.log.1";
+        sylar::Logger::ptr logger(new sylar::Logger("async_reopen"));
+        sylar::AsyncFileLogAppender::ptr appender(new sylar::AsyncFileLogAppender(path, 1024 * 1024, 4, 60 * 1000));
+        appender->setFormatter(formatter);
+        logger->addAppender(appender);
+        for (int i = 0; i < 50; ++i) {
+            SYLAR_LOG_INFO(logger) << "line " << i;
+        }
+        SYLAR_ASSERT(rename(path.c_str(), moved.c_str()) == 0);
+        SYLAR_ASSERT(appender->reopen());
+        for (int i = 50; i < 100; ++i) {
+            SYLAR_LOG_INFO(logger) << "line " << i;
+        }
+        logger->clearAppenders();
+        appender.reset();
+        std::vector<std::string> lines = ReadLines(moved);
+        std::vector<std::string> after = ReadLines(path);
+        lines.insert(lines.end(), after.begin(), after.end());
+        SYLAR_ASSERT(CheckSequence(lines, 100, true));
+    }
+    std::cout << "test_async_appender ok" << std::endl;
+}
+
+template<class F>
+void bench(const char* name, int n, F f) {
+    f(1000);    // 预热, 让事件池填满
+    uint64_t allocs = s_alloc_count;
+    uint64_t begin = sylar::GetCurrentUS();
+    f(n);
+    uint64_t end = sylar::GetCurrentUS();
+    allocs = s_alloc_count - allocs;
+    std::cout << name
+              << "\tns/op=" << (end - begin) * 1000.0 / n
+              << "\tallocs/op=" << (double)allocs / n
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    char tmpl[] = "/tmp/sylar_log_event.XXXXXX";
+    SYLAR_ASSERT(mkdtemp(tmpl));
+    std::string dir = tmpl;
+    test_file_flush(dir);
+    test_async_appender(dir);
+    test_lazy_strings();
+    test_lazy_format();
+    system(("rm -rf " + dir).c_str());
+
+    sylar::Logger::ptr logger(new sylar::Logger("bench"));
+    std::shared_ptr<NullLogAppender> appender(new NullLogAppender);
+    logger->addAppender(appender);
+
+    bench("legacy stream", n, [&](int count) {
+        for (int i = 0; i < count; ++i) {
+            LEGACY_LOG_LEVEL(logger, sylar::LogLevel::INFO) << "hello sylar log i=" << i;
+        }
+    });
+    bench("pooled stream", n, [&](int count) {
+        for (int i = 0; i < count; ++i) {
+            SYLAR_LOG_INFO(logger) << "hello sylar log i=" << i;
+        }
+    });
+    bench("legacy fmt", n, [&](int count) {
+        for (int i = 0; i < count; ++i) {
+            LEGACY_LOG_FMT_LEVEL(logger, sylar::LogLevel::INFO, "hello sylar log i=%d", i);
+        }
+    });
+    bench("pooled fmt", n, [&](int count) {
+        for (int i = 0; i < count; ++i) {
+            SYLAR_LOG_FMT_INFO(logger, "hello sylar log i=%d", i);
+        }
+    });
+
+    std::cout << "bytes=" << appender->m_bytes << std::endl;
+    return 0;
+}
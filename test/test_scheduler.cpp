@@ -1,4 +1,5 @@
 #include "sylar.h"
+#include <yaml-cpp/yaml.h>
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
@@ -12,7 +13,348 @@ void test_fiber() {
     }
 }
 
+// 单线程调度, 看各优先级的执行顺序和排队统计
+void test_priority() {
+    sylar::Scheduler sc(1, false, "priority");
+    std::vector<int> order;
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule([&order]() { order.push_back(sylar::Scheduler::PRIORITY_LOW); }
+                    , sylar::Scheduler::PRIORITY_LOW);
+        sc.schedule([&order]() { order.push_back(sylar::Scheduler::PRIORITY_NORMAL); });
+        sc.schedule([&order]() { order.push_back(sylar::Scheduler::PRIORITY_HIGH); }
+                    , sylar::Scheduler::PRIORITY_HIGH);
+    }
+    // 截止时间早的先执行
+    uint64_t now = sylar::GetCurrentMS();
+    std::vector<int> deadlines;
+    for (int i = 3; i > 0; --i) {
+        sc.schedule([&deadlines, i]() { deadlines.push_back(i); }
+                    , sylar::Scheduler::PRIORITY_NORMAL, now + i * 1000);
+    }
+    sc.start();
+    sc.stop();
+
+    int count[sylar::Scheduler::PRIORITY_COUNT] = {0};
+    for (size_t i = 0; i < 65 && i < order.size(); ++i) {
+        ++count[order[i]];
+    }
+    SYLAR_LOG_INFO(g_logger) << "first 65 tasks high=" << count[0] << " normal=" << count[1]
+                             << " low=" << count[2];
+    SYLAR_ASSERT(count[0] > count[1] && count[1] > count[2] && count[2] > 0);
+    SYLAR_ASSERT(deadlines.size() == 3 && deadlines[0] == 1 && deadlines[2] == 3);
+
+    auto stats = sc.getPriorityStats();
+    for (size_t i = 0; i < stats.size(); ++i) {
+        SYLAR_LOG_INFO(g_logger) << "priority=" << i << " tasks=" << stats[i].tasks
+                                 << " avg_delay_us=" << (stats[i].tasks ? stats[i].totalDelayUs / stats[i].tasks : 0)
+                                 << " max_delay_us=" << stats[i].maxDelayUs
+                                 << " deadline_missed=" << stats[i].deadlineMissed;
+    }
+}
+
+// 待执行任务数上限, 三种处理方式
+void test_admission() {
+    sylar::Scheduler sc(1, false, "admission");
+    std::atomic<int> done = {0};
+    auto task = [&done]() { ++done; };
+
+    // start之前没有线程取任务, 超过上限的被拒绝
+    sc.setMaxQueueDepth(10, sylar::Scheduler::OVERFLOW_REJECT);
+    int accepted = 0;
+    for (int i = 0; i < 20; ++i) {
+        accepted += sc.trySchedule(task);
+    }
+    SYLAR_LOG_INFO(g_logger) << "reject accepted=" << accepted << " rejected=" << sc.getRejectedCount();
+    SYLAR_ASSERT(accepted == 10 && sc.getRejectedCount() == 10);
+    sc.start();
+    while (done < 10) {
+        usleep(1000);
+    }
+
+    // 唯一的调度线程被占住, 新任务挤掉旧任务
+    std::atomic<bool> hold = {true};
+    std::atomic<bool> holding = {false};
+    sc.schedule([&hold, &holding]() {
+        holding = true;
+        while (hold) {
+            usleep(1000);
+        }
+    });
+    while (!holding) {
+        usleep(1000);
+    }
+    sc.setMaxQueueDepth(10, sylar::Scheduler::OVERFLOW_DROP_OLDEST);
+    for (int i = 0; i < 20; ++i) {
+        sc.schedule(task);
+    }
+    SYLAR_LOG_INFO(g_logger) << "drop_oldest dropped=" << sc.getDroppedCount();
+    SYLAR_ASSERT(sc.getDroppedCount() == 10);
+    hold = false;
+
+    // 线程和协程作为生产者都会等到有空位, 不丢任务
+    sc.setMaxQueueDepth(5, sylar::Scheduler::OVERFLOW_BLOCK);
+    for (int i = 0; i < 50; ++i) {
+        sc.schedule(task);
+    }
+    sc.schedule([&sc, task]() {
+        for (int i = 0; i < 50; ++i) {
+            sc.schedule(task);
+        }
+    });
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "done=" << done << " rejected=" << sc.getRejectedCount()
+                             << " dropped=" << sc.getDroppedCount();
+    SYLAR_ASSERT(done == 10 + 10 + 100);
+
+    // 没有别的线程执行任务时OVERFLOW_BLOCK不能等, 否则永远等不到空位: 退化为拒绝
+    sylar::Scheduler idle_sc(1, false, "admission_idle");
+    idle_sc.setMaxQueueDepth(5, sylar::Scheduler::OVERFLOW_BLOCK);
+    for (int i = 0; i < 10; ++i) {
+        idle_sc.schedule(task);     // start之前
+    }
+    SYLAR_ASSERT(idle_sc.getRejectedCount() == 5);
+    idle_sc.start();
+    idle_sc.stop();
+    SYLAR_ASSERT(done == 120 + 5);
+
+    // use_caller且没有额外线程, 调用方是唯一能执行任务的线程, start之后也不能等
+    sylar::Scheduler caller_sc(1, true, "admission_caller");
+    caller_sc.setMaxQueueDepth(5, sylar::Scheduler::OVERFLOW_BLOCK);
+    caller_sc.start();
+    // 在调度器自己的协程里可以挂起等空位, stop里本线程会继续执行任务
+    caller_sc.schedule([&caller_sc, task]() {
+        for (int i = 0; i < 20; ++i) {
+            caller_sc.schedule(task);
+        }
+    });
+    for (int i = 0; i < 10; ++i) {
+        caller_sc.schedule(task);
+    }
+    SYLAR_ASSERT(caller_sc.getRejectedCount() == 6);
+    caller_sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "admission_caller done=" << done << " rejected=" << caller_sc.getRejectedCount();
+    SYLAR_ASSERT(caller_sc.getRejectedCount() == 6);
+    SYLAR_ASSERT(done == 125 + 4 + 20);
+}
+
+// 批量提交, 回调可以是只能移动的函数对象
+void test_batch() {
+    sylar::Scheduler sc(2, false, "batch");
+    sc.start();
+    std::atomic<int> done = {0};
+    sylar::Scheduler::TaskBatch batch;
+    for (int i = 0; i < 100; ++i) {
+        std::unique_ptr<int> value(new int(i));
+        batch.add([&done, value = std::move(value)]() { done += *value >= 0; });
+    }
+    batch.add(sylar::Fiber::ptr(new sylar::Fiber([&done]() { ++done; })), sylar::Scheduler::PRIORITY_HIGH);
+    SYLAR_ASSERT(batch.size() == 101);
+    sc.schedule(batch);
+    SYLAR_ASSERT(batch.empty());
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "batch done=" << done;
+    SYLAR_ASSERT(done == 101);
+}
+
+// 按fox_thread.placement绑核
+void test_placement() {
+    SYLAR_ASSERT(sylar::ParseCpuList("0-2, 5,3") == std::vector<int>({0, 1, 2, 3, 5}));
+    for (auto& i : sylar::GetNumaNodes()) {
+        SYLAR_LOG_INFO(g_logger) << "numa node=" << i.id << " cpus=" << i.cpus.size();
+    }
+
+    // 绑到允许使用的第一个CPU, cpuset或容器里不一定有CPU 0
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    SYLAR_ASSERT(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+    int cpu = 0;
+    while (cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &allowed)) {
+        ++cpu;
+    }
+    SYLAR_ASSERT(cpu < CPU_SETSIZE);
+    YAML::Node root = YAML::Load("fox_thread:\n"
+                                 "    placement:\n"
+                                 "        placed:\n"
+                                 "            cpus: " + std::to_string(cpu) + "\n"
+                                 "            bind: cpu\n"
+                                 "            numa_groups: true\n");
+    sylar::Config::LoadFromYaml(root);
+
+    sylar::Scheduler sc(2, false, "placed");
+    sc.start();
+    std::atomic<int> pinned = {0};
+    for (int i = 0; i < 10; ++i) {
+        sc.schedule([&pinned, cpu]() {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            sched_getaffinity(0, sizeof(set), &set);
+            pinned += CPU_COUNT(&set) == 1 && CPU_ISSET(cpu, &set);
+        });
+    }
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "placement pinned=" << pinned;
+    SYLAR_ASSERT(pinned == 10);
+}
+
+// 长时间不让出的协程: 看门狗告警, ShouldYield变为true, 统计到超长时间片
+void test_watchdog() {
+    sylar::Config::Lookup<uint64_t>("scheduler.slice_budget")->setValue(20);
+    sylar::Scheduler sc(2, false, "watchdog");
+    sc.start();
+    std::atomic<int> yielded = {0};
+    std::atomic<int> done = {0};
+    for (int i = 0; i < 2; ++i) {
+        sc.schedule([&yielded, &done]() {
+            uint64_t begin = sylar::GetCurrentMS();
+            while (!sylar::Fiber::ShouldYield() && sylar::GetCurrentMS() - begin < 2000) {
+            }
+            if (sylar::Fiber::ShouldYield()) {
+                ++yielded;
+                sylar::Fiber::YieldToReady();
+                SYLAR_ASSERT(!sylar::Fiber::ShouldYield());
+            }
+            ++done;
+        });
+    }
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule([&done]() { ++done; });
+    }
+    sc.stop();
+    sylar::Config::Lookup<uint64_t>("scheduler.slice_budget")->setValue(0);
+
+    uint64_t long_slices = 0;
+    for (auto& i : sc.getStats()) {
+        long_slices += i.longSlices;
+    }
+    std::stringstream ss;
+    sc.dumpStats(ss);
+    SYLAR_LOG_INFO(g_logger) << "watchdog yielded=" << yielded << " long_slices=" << long_slices
+                             << std::endl << ss.str();
+    SYLAR_ASSERT(done == 102);
+    SYLAR_ASSERT(yielded == 2);
+    SYLAR_ASSERT(long_slices >= 2);
+}
+
+// 共享栈协程让出后回到原来的线程, 栈上的内容不变
+void test_shared_stack() {
+    sylar::Scheduler sc(3, false, "shared");
+    sc.setSharedStack(true);
+    sc.start();
+    std::atomic<int> done = {0};
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule([i, &done]() {
+            SYLAR_ASSERT(sylar::Fiber::GetThis()->isSharedStack());
+            int thread = sylar::GetThreadId();
+            char buf[512];
+            memset(buf, i, sizeof(buf));
+            for (int n = 0; n < 10; ++n) {
+                sylar::Fiber::YieldToReady();
+                SYLAR_ASSERT(sylar::GetThreadId() == thread);
+            }
+            for (auto c : buf) {
+                SYLAR_ASSERT(c == (char)i);
+            }
+            ++done;
+        });
+    }
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "shared stack done=" << done;
+    SYLAR_ASSERT(done == 100);
+}
+
+// 让出过的回调结束后协程放回协程池, 之后的回调不再新建协程
+void test_fiber_pool() {
+    sylar::Scheduler sc(2, false, "fiber_pool");
+    sc.start();
+    std::atomic<int> done = {0};
+    for (int round = 0; round < 100; ++round) {
+        for (int i = 0; i < 10; ++i) {
+            sc.schedule([&done]() {
+                sylar::Fiber::YieldToReady();
+                ++done;
+            });
+        }
+        while (done < (round + 1) * 10) {
+            usleep(100);
+        }
+    }
+    sc.stop();
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    for (auto& i : sc.getStats()) {
+        hits += i.fiberPoolHits;
+        misses += i.fiberPoolMisses;
+    }
+    SYLAR_LOG_INFO(g_logger) << "fiber pool hits=" << hits << " misses=" << misses;
+    SYLAR_ASSERT(hits + misses == 1000);
+    SYLAR_ASSERT(misses <= 64);
+}
+
+static void deep_stack() {
+    volatile char buf[40 * 1024];
+    memset((char*)buf, 1, sizeof(buf));
+}
+
+void test_stack_profile() {
+    auto profile = sylar::Config::Lookup<bool>("fiber.stack_profile");
+    auto adaptive = sylar::Config::Lookup<bool>("fiber.stack_adaptive");
+    profile->setValue(true);
+
+    sylar::Scheduler sc(2, false, "stack_profile");
+    sc.start();
+    std::atomic<int> done = {0};
+    auto shallow_cb = [&done]() { ++done; };
+    auto deep_cb = [&done]() { deep_stack(); ++done; };
+    for (int i = 0; i < 20; ++i) {
+        sc.schedule(shallow_cb);
+        sc.schedule(deep_cb);
+        sc.schedule(sylar::WithStackTag("deep", [&done]() { deep_stack(); ++done; }));
+    }
+    while (done < 60) {
+        usleep(100);
+    }
+
+    sylar::StackProfile* shallow = sylar::GetStackProfile(shallow_cb);
+    sylar::StackProfile* deep = sylar::GetStackProfile(deep_cb);
+    sylar::StackProfile* tagged = sylar::GetStackProfile(sylar::WithStackTag("deep", nullptr));
+    // 回调里的计数先于协程切回来记录栈使用
+    while (shallow->count + deep->count + tagged->count < 60) {
+        usleep(100);
+    }
+    SYLAR_ASSERT(shallow->count == 20 && deep->count == 20 && tagged->count == 20);
+    SYLAR_ASSERT(deep->maxUsed >= 40 * 1024 && tagged->maxUsed >= 40 * 1024);
+    SYLAR_ASSERT(shallow->maxUsed < deep->maxUsed);
+
+    // 按统计选栈: 浅的用最小一档, 深的40K * 2超过64K用128K
+    adaptive->setValue(true);
+    SYLAR_ASSERT(sylar::Fiber::StackSizeFor(shallow) == 16 * 1024);
+    SYLAR_ASSERT(sylar::Fiber::StackSizeFor(deep) == 128 * 1024);
+    for (int i = 0; i < 20; ++i) {
+        sc.schedule(shallow_cb);
+        sc.schedule(deep_cb);
+    }
+    sc.stop();
+    SYLAR_ASSERT(done == 100);
+    SYLAR_ASSERT(shallow->stackSize == 16 * 1024);
+    SYLAR_ASSERT(deep->stackSize == 128 * 1024);
+
+    std::stringstream ss;
+    sylar::DumpStackUsage(ss);
+    SYLAR_LOG_INFO(g_logger) << ss.str();
+    adaptive->setValue(false);
+    profile->setValue(false);
+}
+
 int main(int argc, char** argv) {
+    test_priority();
+    test_admission();
+    test_batch();
+    test_placement();
+    test_watchdog();
+    test_shared_stack();
+    test_fiber_pool();
+    test_stack_profile();
     SYLAR_LOG_INFO(g_logger) << "main";
     sylar::Scheduler sc(3, false, "test");
     sc.start(); // 创建线程
@@ -0,0 +1,409 @@
+//
+// 协程调度器吞吐基准测试, 结果以JSON输出, 便于跨提交对比scheduler.cpp的性能变化
+// 用法: test_scheduler_bench [-n 任务数] [-t 最大线程数] [-w 每个任务的空转次数] [-o 输出文件]
+// 场景:
+//   inject  非调度线程逐个schedule回调, 全部经过全局队列
+//   batch   非调度线程每64个回调用TaskBatch提交一次
+//   spawn   少量根任务在调度线程里再schedule子任务, 走本地队列和窃取
+//   yield   协程反复YieldToReady, 测协程重新入队的开销
+//   pingpong 非调度线程schedule一个回调, 等它执行完再schedule下一个, 测单次往返延迟
+// 线程数按1,2,4...直到最大线程数
+// 另外单独测全局队列的入队+出队开销: 原来的std::list+Mutex 对比 MPSCQueue+节点复用
+// 唤醒相关的系统调用(read/write/poll/epoll_wait)在本文件里拦截计数, 结果里给出每个任务的平均次数
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <list>
+#include "../sylar.h"
+
+struct BenchResult {
+    std::string scenario;
+    int threads;
+    uint64_t tasks;
+    double seconds;
+    uint64_t syscalls;
+};
+
+// 拦截调度器唤醒路径上的系统调用, 只计数, 实际调用libc的实现
+static std::atomic<uint64_t> s_syscalls = {0};
+
+template<class Fun>
+static Fun NextFun(const char* name)
+{
+    return (Fun)dlsym(RTLD_NEXT, name);
+}
+
+extern "C" {
+ssize_t read(int fd, void* buf, size_t count)
+{
+    static auto fun = NextFun<ssize_t (*)(int, void*, size_t)>("read");
+    ++s_syscalls;
+    return fun(fd, buf, count);
+}
+
+ssize_t write(int fd, const void* buf, size_t count)
+{
+    static auto fun = NextFun<ssize_t (*)(int, const void*, size_t)>("write");
+    ++s_syscalls;
+    return fun(fd, buf, count);
+}
+
+int poll(struct pollfd* fds, nfds_t nfds, int timeout)
+{
+    static auto fun = NextFun<int (*)(struct pollfd*, nfds_t, int)>("poll");
+    ++s_syscalls;
+    return fun(fds, nfds, timeout);
+}
+
+int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout)
+{
+    static auto fun = NextFun<int (*)(int, struct epoll_event*, int, int)>("epoll_wait");
+    ++s_syscalls;
+    return fun(epfd, events, maxevents, timeout);
+}
+}
+
+static std::atomic<uint64_t> s_done = {0};
+static int s_work = 100;
+
+static void Work()
+{
+    volatile int sum = 0;
+    for (int i = 0; i < s_work; ++i)
+    {
+        sum += i;
+    }
+    ++s_done;
+}
+
+static void WaitDone(uint64_t total)
+{
+    while (s_done < total)
+    {
+        usleep(100);
+    }
+}
+
+static BenchResult RunOne(const std::string& scenario, int threads, uint64_t n)
+{
+    s_done = 0;
+    uint64_t total = n;
+    double seconds = 0;
+    uint64_t syscalls = 0;
+    {
+        sylar::IOManager iom(threads, false, "bench");
+        auto begin = std::chrono::steady_clock::now();
+        uint64_t syscalls_begin = s_syscalls;
+        if (scenario == "inject")
+        {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                iom.schedule(&Work);
+            }
+        }
+        else if (scenario == "batch")
+        {
+            const uint64_t batch_size = 64;
+            sylar::Scheduler::TaskBatch batch;
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                batch.add(&Work);
+                if (batch.size() == batch_size)
+                {
+                    iom.schedule(batch);
+                }
+            }
+            iom.schedule(batch);
+        }
+        else if (scenario == "spawn")
+        {
+            // 每个根任务派生fanout个子任务
+            const uint64_t fanout = 1000;
+            uint64_t roots = std::max<uint64_t>(1, n / fanout);
+            total = roots * fanout;
+            for (uint64_t i = 0; i < roots; ++i)
+            {
+                iom.schedule([fanout]() {
+                    for (uint64_t j = 0; j < fanout; ++j)
+                    {
+                        sylar::Scheduler::GetThis()->schedule(&Work);
+                    }
+                });
+            }
+        }
+        else if (scenario == "pingpong")
+        {
+            // 往返一次要经过唤醒, 次数少一些
+            total = std::max<uint64_t>(1, n / 20);
+            for (uint64_t i = 0; i < total; ++i)
+            {
+                iom.schedule(&Work);
+                while (s_done <= i)
+                {
+                    sched_yield();
+                }
+            }
+        }
+        else
+        {
+            // 每个协程让出yields次, 每次让出算一个任务
+            const uint64_t yields = 100;
+            uint64_t fibers = std::max<uint64_t>(1, n / yields);
+            total = fibers * yields;
+            for (uint64_t i = 0; i < fibers; ++i)
+            {
+                iom.schedule(sylar::Fiber::ptr(new sylar::Fiber([yields]() {
+                    for (uint64_t j = 0; j < yields; ++j)
+                    {
+                        Work();
+                        sylar::Fiber::YieldToReady();
+                    }
+                })));
+            }
+        }
+        WaitDone(total);
+        // 不计入stop的时间
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        syscalls = s_syscalls - syscalls_begin;
+    }
+
+    BenchResult r;
+    r.scenario = scenario;
+    r.threads = threads;
+    r.tasks = total;
+    r.seconds = seconds;
+    r.syscalls = syscalls;
+    return r;
+}
+
+struct QueueResult {
+    std::string queue;
+    int producers;
+    uint64_t ops;
+    double seconds;
+};
+
+struct QueueNode : public sylar::MPSCNode {
+    std::function<void()> cb;
+};
+
+// producers个线程各入队n个回调, 一个线程出队并执行
+template<class Push, class Pop>
+static QueueResult RunQueue(const std::string& name, int producers, uint64_t n, Push push, Pop pop)
+{
+    s_done = 0;
+    std::atomic<bool> go = {false};
+    std::vector<std::thread> thrs;
+    for (int i = 0; i < producers; ++i)
+    {
+        thrs.emplace_back([&]() {
+            while (!go)
+            {
+                sched_yield();
+            }
+            for (uint64_t j = 0; j < n; ++j)
+            {
+                push(std::function<void()>(&Work));
+            }
+        });
+    }
+    auto begin = std::chrono::steady_clock::now();
+    go = true;
+    uint64_t total = n * producers;
+    std::function<void()> cb;
+    for (uint64_t i = 0; i < total;)
+    {
+        if (pop(cb))
+        {
+            cb();
+            ++i;
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    for (auto& i : thrs)
+    {
+        i.join();
+    }
+    return QueueResult{name, producers, total, seconds};
+}
+
+static void RunQueues(int producers, uint64_t n, std::vector<QueueResult>& results)
+{
+    {
+        sylar::Mutex mutex;
+        std::list<std::function<void()> > list;
+        results.push_back(RunQueue("list", producers, n,
+            [&](std::function<void()>&& cb) {
+                sylar::Mutex::Lock lock(mutex);
+                list.push_back(std::move(cb));
+            },
+            [&](std::function<void()>& cb) {
+                sylar::Mutex::Lock lock(mutex);
+                if (list.empty())
+                {
+                    return false;
+                }
+                cb = std::move(list.front());
+                list.pop_front();
+                return true;
+            }));
+    }
+    {
+        // 和Scheduler一样, 节点出队后放回线程缓存, 缓存满了交给全局池
+        sylar::MPSCQueue queue;
+        sylar::Spinlock pool_mutex;
+        std::vector<QueueNode*> pool;
+        results.push_back(RunQueue("mpsc", producers, n,
+            [&](std::function<void()>&& cb) {
+                static thread_local std::vector<QueueNode*> cache;
+                if (cache.empty())
+                {
+                    sylar::Spinlock::Lock lock(pool_mutex);
+                    size_t count = std::min<size_t>(pool.size(), 128);
+                    cache.insert(cache.end(), pool.end() - count, pool.end());
+                    pool.resize(pool.size() - count);
+                }
+                QueueNode* node = nullptr;
+                if (cache.empty())
+                {
+                    node = new QueueNode;
+                }
+                else
+                {
+                    node = cache.back();
+                    cache.pop_back();
+                }
+                node->cb = std::move(cb);
+                queue.push(node);
+            },
+            [&](std::function<void()>& cb) {
+                static std::vector<QueueNode*> freed;
+                QueueNode* node = static_cast<QueueNode*>(queue.pop());
+                if (!node)
+                {
+                    return false;
+                }
+                cb = std::move(node->cb);
+                freed.push_back(node);
+                if (freed.size() >= 256)
+                {
+                    sylar::Spinlock::Lock lock(pool_mutex);
+                    pool.insert(pool.end(), freed.begin(), freed.end());
+                    freed.clear();
+                }
+                return true;
+            }));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t n = 1000000;
+    int max_threads = std::max(4u, std::thread::hardware_concurrency());
+    std::string output;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:w:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                n = strtoull(optarg, nullptr, 10);
+                break;
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 'w':
+                s_work = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                std::cerr << "usage: " << argv[0]
+                          << " [-n tasks] [-t max_threads] [-w work_per_task] [-o out.json]"
+                          << std::endl;
+                return 1;
+        }
+    }
+
+    // 调度器自己的INFO/DEBUG日志会影响结果
+    SYLAR_LOG_ROOT()->setLevel(sylar::LogLevel::WARN);
+
+    std::vector<BenchResult> results;
+    for (const char* scenario : {"inject", "batch", "spawn", "yield", "pingpong"})
+    {
+        for (int threads = 1; threads <= max_threads; threads *= 2)
+        {
+            results.push_back(RunOne(scenario, threads, n));
+            const BenchResult& r = results.back();
+            std::cerr << r.scenario << "\tthreads=" << r.threads
+                      << "\ttasks/s=" << (uint64_t)(r.tasks / r.seconds)
+                      << "\tsyscalls/task=" << (double)r.syscalls / r.tasks << std::endl;
+        }
+    }
+
+    std::vector<QueueResult> queue_results;
+    for (int producers = 1; producers <= max_threads; producers *= 2)
+    {
+        RunQueues(producers, n / producers, queue_results);
+        for (size_t i = queue_results.size() - 2; i < queue_results.size(); ++i)
+        {
+            const QueueResult& r = queue_results[i];
+            std::cerr << "queue " << r.queue << "\tproducers=" << r.producers
+                      << "\tns/op=" << (uint64_t)(r.seconds * 1e9 / r.ops) << std::endl;
+        }
+    }
+
+    std::stringstream ss;
+    ss << "{\n  \"work_per_task\": " << s_work << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult& r = results[i];
+        ss << "    {\"scenario\": \"" << r.scenario << "\""
+           << ", \"threads\": " << r.threads
+           << ", \"tasks\": " << r.tasks
+           << ", \"seconds\": " << r.seconds
+           << ", \"tasks_per_sec\": " << (uint64_t)(r.tasks / r.seconds)
+           << ", \"syscalls_per_task\": " << (double)r.syscalls / r.tasks
+           << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    ss << "  ],\n  \"queue_results\": [\n";
+    for (size_t i = 0; i < queue_results.size(); ++i)
+    {
+        const QueueResult& r = queue_results[i];
+        ss << "    {\"queue\": \"" << r.queue << "\""
+           << ", \"producers\": " << r.producers
+           << ", \"ops\": " << r.ops
+           << ", \"seconds\": " << r.seconds
+           << ", \"ns_per_op\": " << (uint64_t)(r.seconds * 1e9 / r.ops)
+           << "}" << (i + 1 < queue_results.size() ? "," : "") << "\n";
+    }
+    ss << "  ]\n}\n";
+
+    if (output.empty())
+    {
+        std::cout << ss.str();
+    }
+    else
+    {
+        std::ofstream ofs(output);
+        ofs << ss.str();
+    }
+    return 0;
+}
@@ -4,9 +4,25 @@
 
 #include "sylar.h"
 #include <assert.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
+// fork之后子进程的线程id不能沿用父进程缓存的值
+void test_thread_id_fork() {
+    SYLAR_ASSERT(sylar::GetThreadId() == getpid());
+    pid_t pid = fork();
+    SYLAR_ASSERT(pid >= 0);
+    if (pid == 0) {
+        _exit(sylar::GetThreadId() == getpid() ? 0 : 1);
+    }
+    int status = 0;
+    SYLAR_ASSERT(waitpid(pid, &status, 0) == pid);
+    SYLAR_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    SYLAR_LOG_INFO(g_logger) << "test_thread_id_fork ok";
+}
+
 void test_assert() {
     SYLAR_LOG_INFO(g_logger) << sylar::BacktraceToString(10);
     //SYLAR_ASSERT(0 == 0);
@@ -14,6 +30,7 @@ void test_assert() {
 }
 
 int main() {
+    test_thread_id_fork();
     test_assert();
 
     return 0;
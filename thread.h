@@ -6,6 +6,7 @@
 #define MYSYLAR_THREAD_H
 
 #include <thread>
+#include <string>
 #include <functional>
 #include <memory>
 #include <pthread.h>
@@ -0,0 +1,110 @@
+//
+// 把BinaryFileLogAppender输出的二进制日志还原成文本
+// 用法: sylar_logcat [-p pattern] file...
+// 默认使用文件头中记录的格式模版, -p 指定时覆盖; 支持滚动后压缩的 .gz 文件
+//
+
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string.h>
+#include <zlib.h>
+#include "../log.h"
+
+static void usage(const char* prog)
+{
+    std::cerr << "usage: " << prog << " [-p pattern] file..." << std::endl;
+}
+
+static bool cat(const std::string& path, const std::string& pattern)
+{
+    std::stringstream ss;
+    gzFile in = gzopen(path.c_str(), "rb");    // 未压缩的文件按原样读出
+    if (!in)
+    {
+        std::cerr << "open " << path << " failed" << std::endl;
+        return false;
+    }
+    char buf[64 * 1024];
+    int len = 0;
+    while ((len = gzread(in, buf, sizeof(buf))) > 0)
+    {
+        ss.write(buf, len);
+    }
+    gzclose(in);
+    if (len < 0)
+    {
+        std::cerr << "read " << path << " failed" << std::endl;
+        return false;
+    }
+    sylar::BinaryLogReader reader(ss);
+    std::map<std::string, sylar::Logger::ptr> loggers;
+    sylar::LogFormatter::ptr fmt;
+    std::string cur_pattern;
+
+    sylar::LogEvent::ptr event;
+    std::string logger_name;
+    while (reader.next(event, logger_name))
+    {
+        const std::string& p = pattern.empty() ? reader.getPattern() : pattern;
+        if (!fmt || p != cur_pattern)
+        {
+            cur_pattern = p;
+            fmt.reset(new sylar::LogFormatter(p.empty()
+                    ? "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n" : p));
+            if (fmt->isError())
+            {
+                std::cerr << "invalid pattern: " << p << std::endl;
+                return false;
+            }
+        }
+        sylar::Logger::ptr& logger = loggers[logger_name];
+        if (!logger)
+        {
+            logger.reset(new sylar::Logger(logger_name));
+        }
+        fmt->format(std::cout, logger, event->getLevel(), event);
+    }
+    if (reader.isError())
+    {
+        std::cerr << path << ": corrupted record at offset " << ss.tellg() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    std::string pattern;
+    int i = 1;
+    for (; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            pattern = argv[++i];
+        }
+        else if (argv[i][0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (i >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    int rt = 0;
+    for (; i < argc; ++i)
+    {
+        if (!cat(argv[i], pattern))
+        {
+            rt = 1;
+        }
+    }
+    return rt;
+}
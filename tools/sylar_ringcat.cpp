@@ -0,0 +1,38 @@
+//
+// 从MmapRingLogAppender的文件中按写入顺序还原日志, 用于进程崩溃后查看最近的日志
+// 用法: sylar_ringcat file...
+//
+
+#include <iostream>
+#include "../log.h"
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " file..." << std::endl;
+        return 1;
+    }
+    int rt = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        sylar::MmapRingLogReader reader(argv[i]);
+        if (!reader.isValid())
+        {
+            std::cerr << argv[i] << ": not a ring log file" << std::endl;
+            rt = 1;
+            continue;
+        }
+        std::string record;
+        while (reader.next(record))
+        {
+            std::cout << record;
+        }
+        if (reader.getSkipped())
+        {
+            std::cerr << argv[i] << ": skipped " << reader.getSkipped()
+                      << " bytes of overwritten or incomplete records" << std::endl;
+        }
+    }
+    return rt;
+}
@@ -6,6 +6,7 @@
 #include "log.h"
 #include "fiber.h"
 #include <syscall.h>
+#include <pthread.h>
 #include <zconf.h>
 #include <cstdint>
 #include <vector>
@@ -17,9 +18,26 @@ namespace sylar {
 
     static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+    // 日志宏每次都会调用GetThreadId, 缓存起来避免每次都进行系统调用
+    static thread_local pid_t t_tid = 0;
+
+    // fork出的子进程里只剩调用fork的线程, 它的tid变了, 清掉缓存
+    struct ThreadIdForkHandler {
+        ThreadIdForkHandler()
+        {
+            pthread_atfork(nullptr, nullptr, []() { t_tid = 0; });
+        }
+    };
+
+    static ThreadIdForkHandler s_thread_id_fork_handler;
+
     pid_t GetThreadId()
     {
-        return syscall(SYS_gettid); // 获取线程id唯一标识
+        if (!t_tid)
+        {
+            t_tid = syscall(SYS_gettid); // 获取线程id唯一标识
+        }
+        return t_tid;
     }
 
     uint32_t GetFiberId()